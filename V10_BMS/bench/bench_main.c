@@ -0,0 +1,147 @@
+/**
+ * bench_main.c - entry point for the on-target micro-benchmark firmware.
+ *
+ * Built as samd20_firmware_bench.elf (cmake --build build --target bench) - same sources as the
+ * real firmware, but instead of running the state machine it times a fixed set of kernels and
+ * prints median/max core clock cycles over the debug USART.
+ *
+ * Cycles are measured with SysTick (systime_cycles()), as the Cortex-M0+ has no DWT cycle counter.
+ * The overhead of the timing calls themselves is measured first and subtracted.
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include <inttypes.h>
+#include "bms.h"
+
+#ifndef SERIAL_DEBUG
+#error The benchmark firmware reports over the debug USART, so needs SERIAL_DEBUG
+#endif
+
+#define BENCH_MAX_SAMPLES 32
+
+//Not in the headers, as they're internal to their modules.
+uint8_t bq7693_calc_checksum(uint8_t inCrc, uint8_t data);
+void bms_interrupt_callback(void);
+
+extern volatile struct eeprom_data eeprom_data;
+
+struct bench_kernel {
+	const char *name;
+	void (*fn)(void);
+	uint8_t samples;
+	uint16_t settle_ms; //Delay before each sample, eg to wait for the next CC reading.
+};
+
+static volatile uint32_t bench_sink;
+static uint32_t bench_samples[BENCH_MAX_SAMPLES];
+static uint32_t bench_overhead = 0;
+
+static void bench_empty(void) {
+}
+
+static void bench_checksum(void) {
+	//A full register write's worth - slave address, register, data.
+	uint8_t crc = bq7693_calc_checksum(0x00, (BQ7693_ADDR << 1) | 0);
+	crc = bq7693_calc_checksum(crc, SYS_CTRL2);
+	crc = bq7693_calc_checksum(crc, 0x42);
+	bench_sink = crc;
+}
+
+static void bench_read_temperature(void) {
+	bench_sink = bq7693_read_temperature();
+}
+
+static void bench_get_cell_voltages(void) {
+	uint16_t cell_voltages[NUM_CELLS];
+	bq7693_get_cell_voltages(cell_voltages);
+	bench_sink = cell_voltages[0];
+}
+
+static void bench_cc_isr(void) {
+	bms_interrupt_callback();
+}
+
+static void bench_serial_next_message(void) {
+	serial_send_next_message();
+}
+
+static void bench_sprintf(void) {
+	bench_sink = sprintf(debug_msg_buffer, "Discharging at %d mA, %d mAH, capacity %d mAH, Temp %d'C\r\n", 
+		-12345, 1234, 2500, 251);
+}
+
+static void bench_eeprom_commit(void) {
+	eeprom_write();
+}
+
+static const struct bench_kernel bench_kernels[] = {
+	{ "bq7693_calc_checksum x3",	bench_checksum,				BENCH_MAX_SAMPLES,	0 },
+	{ "bq7693_read_temperature",	bench_read_temperature,		BENCH_MAX_SAMPLES,	0 },
+	{ "bq7693_get_cell_voltages",	bench_get_cell_voltages,	BENCH_MAX_SAMPLES,	0 },
+	{ "CC ISR (CC_READY set)",		bench_cc_isr,				16,					260 },
+	{ "serial next block + tx",		bench_serial_next_message,	BENCH_MAX_SAMPLES,	0 },
+	{ "sprintf debug line",			bench_sprintf,				BENCH_MAX_SAMPLES,	0 },
+	{ "eeprom_write + commit",		bench_eeprom_commit,		8,					0 },	//Keep low - wears the flash.
+};
+
+static void bench_sort(uint32_t *samples, int count) {
+	//Insertion sort - tiny arrays.
+	for (int i=1; i<count; ++i) {
+		uint32_t val = samples[i];
+		int j = i - 1;
+		while (j >= 0 && samples[j] > val) {
+			samples[j + 1] = samples[j];
+			j--;
+		}
+		samples[j + 1] = val;
+	}
+}
+
+static uint32_t bench_time(void (*fn)(void)) {
+	uint32_t start = systime_cycles();
+	fn();
+	return systime_cycles() - start;
+}
+
+static void bench_run_kernel(const struct bench_kernel *kernel) {
+	for (int i=0; i<kernel->samples; ++i) {
+		if (kernel->settle_ms) {
+			delay_ms(kernel->settle_ms);
+		}
+		uint32_t cycles = bench_time(kernel->fn);
+		bench_samples[i] = cycles > bench_overhead ? cycles - bench_overhead : 0;
+	}
+	bench_sort(bench_samples, kernel->samples);
+	
+	sprintf(debug_msg_buffer, "%-26s med %7" PRIu32 " max %7" PRIu32 " (n=%d)\r\n", kernel->name,
+		bench_samples[kernel->samples / 2], bench_samples[kernel->samples - 1], kernel->samples);
+	serial_debug_send_message(debug_msg_buffer);
+}
+
+int main(void) {
+	bms_init();
+	
+	//The CC kernel is timed directly, so stop the ALERT interrupt from servicing the CC reading first.
+	extint_chan_disable_callback(8, EXTINT_CALLBACK_TYPE_DETECT);
+	
+	//Cost of the measurement itself - subtracted from every sample.
+	for (int i=0; i<BENCH_MAX_SAMPLES; ++i) {
+		bench_samples[i] = bench_time(bench_empty);
+	}
+	bench_sort(bench_samples, BENCH_MAX_SAMPLES);
+	bench_overhead = bench_samples[BENCH_MAX_SAMPLES / 2];
+	
+	sprintf(debug_msg_buffer, "Benchmark: %" PRIu32 " cycles/ms, timing overhead %" PRIu32 " cycles\r\n", 
+		systime_cycles_per_ms(), bench_overhead);
+	serial_debug_send_message(debug_msg_buffer);
+	
+	for (size_t i=0; i<sizeof(bench_kernels)/sizeof(bench_kernels[0]); ++i) {
+		bench_run_kernel(&bench_kernels[i]);
+	}
+	serial_debug_send_message("Benchmark complete\r\n");
+	
+	while (1);
+}
@@ -0,0 +1,275 @@
+/*
+ * check_transitions.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//The tables are static - build them in with the check.
+#include "../src/bms.c"
+
+/* Checks the state machine's transition table against its handlers.
+
+Usage:
+	check_transitions src/bms.c src/bms.h
+
+Which events each state's handler can return is read from the source: the bms_state_handlers[] initialiser
+says which handler runs in which state, and each handler's body is searched for its return statements, which must
+all be a BMS_EVT_ constant. The mainloop also dispatches BMS_EVT_FAULT in any state, ahead of the handler.
+
+Then, for every state:
+	- every event it can see has a row that always matches (unguarded), in its own rows or the any-state ones,
+	  so nothing falls through to "unhandled".
+	- every row can fire - its event is one the state can see, and no unguarded row for the same event is ahead
+	  of it.
+Any-state rows must be able to fire in at least one state.
+
+Exits with 0 if all is well, listing what isn't otherwise.
+*/
+
+#define CHECK_MAX_NAMES 32
+#define CHECK_NAME_LEN 48
+
+struct name_list {
+	char names[CHECK_MAX_NAMES][CHECK_NAME_LEN];
+	int count;
+};
+
+static int check_failures = 0;
+
+static void check_fail(const char *message, const char *state, const char *event) {
+	printf("FAIL: %s - state %s, event %s\n", message, state, event);
+	check_failures++;
+}
+
+static char *read_file(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		exit(2);
+	}
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = calloc(len + 1, 1);
+	if (fread(text, 1, len, file) != (size_t)len) {
+		perror(path);
+		exit(2);
+	}
+	fclose(file);
+	return text;
+}
+
+//Copy the identifier at *p into name, and step past it.
+static bool take_ident(const char **p, char *name) {
+	int len = 0;
+	while ((**p >= 'A' && **p <= 'Z') || (**p >= 'a' && **p <= 'z') || (**p >= '0' && **p <= '9') || **p == '_') {
+		if (len < CHECK_NAME_LEN - 1) {
+			name[len++] = **p;
+		}
+		(*p)++;
+	}
+	name[len] = 0;
+	return len > 0;
+}
+
+static void skip_space_and_comments(const char **p) {
+	while (**p) {
+		if (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+			(*p)++;
+		}
+		else if ((*p)[0] == '/' && (*p)[1] == '/') {
+			while (**p && **p != '\n') {
+				(*p)++;
+			}
+		}
+		else {
+			break;
+		}
+	}
+}
+
+//The enumerators of enum <name> in order - so their values, as none are given explicitly.
+static void read_enum(const char *header, const char *name, struct name_list *list) {
+	char start[64];
+	snprintf(start, sizeof(start), "enum %s {", name);
+	const char *p = strstr(header, start);
+	if (!p) {
+		printf("FAIL: no %s in the header\n", start);
+		exit(2);
+	}
+	p += strlen(start);
+	list->count = 0;
+	while (1) {
+		skip_space_and_comments(&p);
+		if (*p == '}' || list->count == CHECK_MAX_NAMES || !take_ident(&p, list->names[list->count])) {
+			break;
+		}
+		list->count++;
+		skip_space_and_comments(&p);
+		if (*p == ',') {
+			p++;
+		}
+	}
+}
+
+static int find_name(const struct name_list *list, const char *name) {
+	for (int i=0; i<list->count; ++i) {
+		if (!strcmp(list->names[i], name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//Events (one bit each) that the handler called name can return.
+static uint32_t handler_events(const char *source, const char *name, const struct name_list *events) {
+	char start[80];
+	snprintf(start, sizeof(start), "\nenum BMS_EVENT %s() {", name);
+	const char *p = strstr(source, start);
+	if (!p) {
+		printf("FAIL: no definition of %s\n", name);
+		exit(2);
+	}
+	const char *end = strstr(p + 1, "\n}");
+	uint32_t mask = 0;
+
+	while ((p = strstr(p + 1, "return")) && p < end) {
+		//Not in a comment, or part of a longer name.
+		const char *line = p;
+		while (line[-1] != '\n') {
+			line--;
+		}
+		const char *comment = strstr(line, "//");
+		if ((comment && comment < p) || (p[-1] != ' ' && p[-1] != '\t') || (p[6] != ' ' && p[6] != ';')) {
+			continue;
+		}
+		const char *q = p + strlen("return");
+		skip_space_and_comments(&q);
+		char event[CHECK_NAME_LEN];
+		int value = take_ident(&q, event) && *q == ';' ? find_name(events, event) : -1;
+		if (value < 0) {
+			printf("FAIL: %s returns something other than a BMS_EVT_ constant - %.40s\n", name, p);
+			check_failures++;
+			continue;
+		}
+		mask |= 1UL << value;
+	}
+	return mask;
+}
+
+//Which handler the bms_state_handlers[] initialiser puts in each state.
+static void read_handlers(const char *source, const struct name_list *states, struct name_list *handlers) {
+	const char *p = strstr(source, "bms_state_handlers[])(void) = {");
+	if (!p) {
+		printf("FAIL: no bms_state_handlers[] in the source\n");
+		exit(2);
+	}
+	const char *end = strstr(p, "};");
+	memset(handlers, 0, sizeof(*handlers));
+	handlers->count = states->count;
+
+	while ((p = strchr(p + 1, '[')) && p < end) {
+		p++;
+		char state[CHECK_NAME_LEN];
+		take_ident(&p, state);
+		int index = find_name(states, state);
+		p = strchr(p, '=') + 1;
+		skip_space_and_comments(&p);
+		if (index >= 0) {
+			take_ident(&p, handlers->names[index]);
+		}
+	}
+}
+
+//Whether rows[index] is behind an unguarded row for the same event.
+static bool row_shadowed(const struct bms_transition_rows *table, uint8_t index) {
+	for (uint8_t i=0; i<index; ++i) {
+		if (table->rows[i].event == table->rows[index].event && !table->rows[i].guard) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//Whether the table always has an answer for event.
+static bool rows_cover(const struct bms_transition_rows *table, uint8_t event) {
+	for (uint8_t i=0; i<table->count; ++i) {
+		if (table->rows[i].event == event && !table->rows[i].guard) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		printf("Usage: %s bms.c bms.h\n", argv[0]);
+		return 2;
+	}
+	char *source = read_file(argv[1]);
+	char *header = read_file(argv[2]);
+
+	struct name_list states, events, handlers;
+	read_enum(header, "BMS_STATE", &states);
+	read_enum(header, "BMS_EVENT", &events);
+	read_handlers(source, &states, &handlers);
+
+	if (states.count != sizeof(bms_transitions) / sizeof(bms_transitions[0])) {
+		printf("FAIL: %d states, but bms_transitions[] has %d\n", states.count, (int)(sizeof(bms_transitions) / sizeof(bms_transitions[0])));
+		check_failures++;
+	}
+
+	uint32_t any_fired = 0;
+	for (int state=0; state<states.count; ++state) {
+		if (!handlers.names[state][0]) {
+			check_fail("no handler", states.names[state], "-");
+			continue;
+		}
+		uint32_t seen = handler_events(source, handlers.names[state], &events) | 1UL << BMS_EVT_FAULT;
+		const struct bms_transition_rows *table = &bms_transitions[state];
+
+		for (int event=0; event<events.count; ++event) {
+			if ((seen & (1UL << event)) && !rows_cover(table, event) && !rows_cover(&bms_transitions_any, event)) {
+				check_fail("no row that always matches", states.names[state], events.names[event]);
+			}
+		}
+
+		for (uint8_t i=0; i<table->count; ++i) {
+			const char *event = events.names[table->rows[i].event];
+			if (!(seen & (1UL << table->rows[i].event))) {
+				check_fail("row for an event the state never sees", states.names[state], event);
+			}
+			else if (row_shadowed(table, i)) {
+				check_fail("row behind an unguarded row", states.names[state], event);
+			}
+		}
+
+		for (uint8_t i=0; i<bms_transitions_any.count; ++i) {
+			uint8_t event = bms_transitions_any.rows[i].event;
+			if ((seen & (1UL << event)) && !rows_cover(table, event) && !row_shadowed(&bms_transitions_any, i)) {
+				any_fired |= 1UL << i;
+			}
+		}
+	}
+
+	for (uint8_t i=0; i<bms_transitions_any.count; ++i) {
+		if (!(any_fired & (1UL << i))) {
+			check_fail("any-state row that can never fire", "any", events.names[bms_transitions_any.rows[i].event]);
+		}
+	}
+
+	free(source);
+	free(header);
+	if (check_failures) {
+		printf("%d problems with the transition table\n", check_failures);
+		return 1;
+	}
+	printf("Transition table covers all %d states\n", states.count);
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * fuzz_driver.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Stands in for libFuzzer where the compiler doesn't have it (gcc) - runs LLVMFuzzerTestOneInput() on each
+file given (or each file in each directory given), then on FUZZ_MUTATIONS random mutations of each, under
+the sanitizers. Not coverage guided, but the same target and corpus as the real fuzzer.
+
+	fuzz_driver [-runs=N] corpus_dir_or_file...
+*/
+
+#define FUZZ_MUTATIONS 20000
+#define FUZZ_MAX_LEN 256
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static uint32_t fuzz_seed = 0x12345678;
+
+static uint32_t fuzz_random(void) {
+	//xorshift32 - the same mutations every run.
+	fuzz_seed ^= fuzz_seed << 13;
+	fuzz_seed ^= fuzz_seed >> 17;
+	fuzz_seed ^= fuzz_seed << 5;
+	return fuzz_seed;
+}
+
+static void fuzz_one(const uint8_t *data, size_t size) {
+	//Exactly sized copy, so AddressSanitizer catches a read past the end.
+	uint8_t *copy = malloc(size ? size : 1);
+	memcpy(copy, data, size);
+	LLVMFuzzerTestOneInput(copy, size);
+	free(copy);
+}
+
+static void fuzz_mutate(const uint8_t *seed, size_t seed_len, long runs) {
+	uint8_t buf[FUZZ_MAX_LEN];
+	
+	for (long n=0; n<runs; ++n) {
+		size_t len = seed_len > FUZZ_MAX_LEN ? FUZZ_MAX_LEN : seed_len;
+		memcpy(buf, seed, len);
+		
+		int edits = 1 + fuzz_random() % 4;
+		for (int e=0; e<edits; ++e) {
+			size_t pos = len ? fuzz_random() % len : 0;
+			switch (fuzz_random() % 5) {
+				case 0:		//Flip a bit
+					if (len) {
+						buf[pos] ^= 1 << (fuzz_random() % 8);
+					}
+					break;
+				case 1:		//A delimiter somewhere - the parser is all about those
+					if (len) {
+						buf[pos] = 0x12;
+					}
+					break;
+				case 2:		//Random byte
+					if (len) {
+						buf[pos] = fuzz_random();
+					}
+					break;
+				case 3:		//Cut short
+					len = pos;
+					break;
+				case 4:		//Insert a byte
+					if (len < FUZZ_MAX_LEN) {
+						memmove(&buf[pos + 1], &buf[pos], len - pos);
+						buf[pos] = fuzz_random() % 2 ? 0x12 : fuzz_random();
+						len++;
+					}
+					break;
+			}
+		}
+		fuzz_one(buf, len);
+	}
+}
+
+static int fuzz_file(const char *path, long runs) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+	uint8_t data[FUZZ_MAX_LEN];
+	size_t len = fread(data, 1, sizeof(data), file);
+	fclose(file);
+	
+	fuzz_one(data, len);
+	fuzz_mutate(data, len, runs);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	long runs = FUZZ_MUTATIONS;
+	int inputs = 0, failed = 0;
+	
+	for (int i=1; i<argc; ++i) {
+		if (!strncmp(argv[i], "-runs=", 6)) {
+			runs = atol(&argv[i][6]);
+			continue;
+		}
+		DIR *dir = opendir(argv[i]);
+		if (!dir) {
+			failed |= fuzz_file(argv[i], runs);
+			inputs++;
+			continue;
+		}
+		struct dirent *entry;
+		while ((entry = readdir(dir))) {
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+			failed |= fuzz_file(path, runs);
+			inputs++;
+		}
+		closedir(dir);
+	}
+	
+	if (!inputs) {
+		fprintf(stderr, "Usage: %s [-runs=N] corpus_dir_or_file...\n", argv[0]);
+		return 2;
+	}
+	printf("%d inputs, %ld mutations of each - no crashes\n", inputs, runs);
+	return failed;
+}
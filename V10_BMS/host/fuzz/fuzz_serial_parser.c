@@ -0,0 +1,29 @@
+/*
+ * fuzz_serial_parser.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include "../../src/serial_parser.h"
+
+/* libFuzzer target for serial_parse_frame() - whatever the vacuum (or a noisy line) sends ends up in it, from
+the USART RX interrupt. Seed it with host/corpus/serial_parser.
+
+Built with clang, this links against libFuzzer (-fsanitize=fuzzer,address). Built with gcc, fuzz_driver.c
+stands in for libFuzzer, so the same target still runs under ctest.
+*/
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	bool error = false;
+	enum SERIAL_RX_RESULT result = serial_parse_frame(data, size, &error);
+	
+	//A status frame is exactly 21 bytes between delimiters, so there must have been room for one.
+	if ((result == SERIAL_RX_FILTER_STATUS || result == SERIAL_RX_BLOCKED_STATUS) && size <= MSG_STATUS_FRAME_LEN) {
+		__builtin_trap();
+	}
+	return 0;
+}
@@ -0,0 +1,405 @@
+/*
+ * pack_sim.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include <stdlib.h>
+#include "pack_sim.h"
+#include "../src/bq7693.h"
+
+//The BQ7693 as the firmware sees it - ADCGAIN1/2 and ADCOFFSET read as 0, so 365uV/LSB and no offset.
+#define SIM_ADC_GAIN_UV 365
+#define SIM_TS_25C 4319				//TS2 reading for a 10k thermistor at 25'C
+#define SIM_CC_PERIOD_MS 250
+#define SIM_TRIP_DELAY_MS 1000		//UV/OV delay, as set by PROTECT3 = 0
+
+#define SIM_LOAD_RAMP_MS 50 		//The vacuum's motor soft-starting once it has power
+#define SIM_CHARGE_MA 3000			//Charger's constant current, before it goes constant voltage
+#define SIM_CHARGE_CELL_MV 4200		//The charger's voltage, per cell
+
+#define SIM_EVENTS 16
+
+struct sim_scenario {
+	const char *name;
+	uint32_t end_ms;
+	uint32_t trigger_on_ms;
+	uint32_t trigger_off_ms;
+	uint32_t charger_on_ms;
+	uint32_t charger_off_ms;
+	uint16_t start_mah;				//In each cell
+	int32_t load_ma;				//Drawn by the vacuum while the trigger is pulled
+	bool stop_on_cutoff;			//End the run once the discharge FET has gone off with the trigger still pulled
+};
+
+static const struct sim_scenario sim_scenarios[] = {
+	{ "basic", 50000, 3000, 13000, 16000, 46000, 1500, 10000, false },
+	{ "rundown", 1200000, 3000, 1200000, 0, 0, 160, 20000, true },
+};
+
+struct sim_cell {
+	uint16_t capacity_mah;
+	uint16_t resistance_mohm;
+	double mah;						//Left in it - goes below 0 once it's past what the OCV table calls empty
+};
+
+//Slightly mismatched, as real cells are - cell 3 is the weak one.
+static struct sim_cell sim_cells[NUM_CELLS] = {
+	{ 2600, 28 }, { 2600, 30 }, { 2580, 29 }, { 2500, 34 }, { 2600, 31 }, { 2590, 30 }, { 2600, 29 },
+};
+
+//Resting voltage against charge left, as % of capacity.
+static const int16_t sim_ocv[][2] = {
+	{ -2, 2000 }, { 0, 2500 }, { 2, 3000 }, { 5, 3300 }, { 10, 3450 }, { 20, 3550 }, { 30, 3620 }, { 40, 3680 },
+	{ 50, 3740 }, { 60, 3810 }, { 70, 3900 }, { 80, 3990 }, { 90, 4080 }, { 100, 4200 }, { 102, 4350 },
+};
+#define SIM_OCV_POINTS (sizeof(sim_ocv) / sizeof(sim_ocv[0]))
+
+static const struct sim_scenario *sim;
+static uint32_t sim_ms = 0;
+static uint32_t sim_powered_ms = 0;			//When the vacuum last got power
+
+static uint8_t sim_regs[256];
+static uint8_t sim_sys_stat = 0;
+static uint16_t sim_uv_trip_mv = 0;
+static uint16_t sim_ov_trip_mv = 5000;
+static uint32_t sim_uv_ms = 0;
+static uint32_t sim_ov_ms = 0;
+
+//The coulomb counter's conversion in progress, and its last result.
+static int64_t sim_cc_sum = 0;
+static uint32_t sim_cc_ms = 0;
+static int16_t sim_cc = 0;
+
+static struct host_event sim_events[SIM_EVENTS];
+static int sim_event_head = 0;
+static int sim_event_count = 0;
+
+//For pack_sim_report()
+static double sim_delivered_mah = 0;
+static double sim_loaded_cutoff_mah = -1;		//When the weakest cell's loaded voltage first fell below CELL_LOWEST_DISCHARGE_VOLTAGE
+static double sim_resting_cutoff_mah = -1;		//...and its resting voltage
+static double sim_stopped_mah = -1;
+static uint32_t sim_stopped_ms = 0;
+static uint16_t sim_stopped_min_mv = 0;
+static bool sim_uv_tripped = false;
+
+static bool sim_trigger(uint32_t ms) {
+	return ms >= sim->trigger_on_ms && ms < sim->trigger_off_ms;
+}
+
+static bool sim_charger(uint32_t ms) {
+	return ms >= sim->charger_on_ms && ms < sim->charger_off_ms;
+}
+
+static int sim_cell_ocv(const struct sim_cell *cell) {
+	double percent = cell->mah * 100.0 / cell->capacity_mah;
+	if (percent <= sim_ocv[0][0]) {
+		return sim_ocv[0][1];
+	}
+	for (size_t i=1; i<SIM_OCV_POINTS; ++i) {
+		if (percent <= sim_ocv[i][0]) {
+			double frac = (percent - sim_ocv[i - 1][0]) / (sim_ocv[i][0] - sim_ocv[i - 1][0]);
+			return (int)(sim_ocv[i - 1][1] + frac * (sim_ocv[i][1] - sim_ocv[i - 1][1]));
+		}
+	}
+	return sim_ocv[SIM_OCV_POINTS - 1][1];
+}
+
+static int32_t sim_current(uint32_t ms) {
+	//mA, positive charging.
+	if ((sim_regs[SYS_CTRL2] & 0x02) && sim_trigger(ms)) {
+		uint32_t on_ms = ms - sim_powered_ms;
+		return on_ms < SIM_LOAD_RAMP_MS ? -(int32_t)(sim->load_ma * on_ms / SIM_LOAD_RAMP_MS) : -sim->load_ma;
+	}
+	if ((sim_regs[SYS_CTRL2] & 0x01) && sim_charger(ms)) {
+		//Constant current until the highest cell reaches the charger's voltage, then tapering off.
+		int32_t current = SIM_CHARGE_MA;
+		for (int i=0; i<NUM_CELLS; ++i) {
+			int32_t limit = (SIM_CHARGE_CELL_MV - sim_cell_ocv(&sim_cells[i])) * 1000 / sim_cells[i].resistance_mohm;
+			if (limit < current) {
+				current = limit;
+			}
+		}
+		return current > 0 ? current : 0;
+	}
+	return 0;
+}
+
+static int sim_cell_mv(int cell, int32_t current) {
+	return sim_cell_ocv(&sim_cells[cell]) + current * sim_cells[cell].resistance_mohm / 1000;
+}
+
+static void sim_event(uint8_t channel) {
+	if (sim_event_count == SIM_EVENTS) {
+		return;
+	}
+	struct host_event *event = &sim_events[(sim_event_head + sim_event_count++) % SIM_EVENTS];
+	event->type = HOST_EVENT_EXTINT;
+	event->time_ms = sim_ms;
+	event->channel = channel;
+}
+
+static void sim_set_stat(uint8_t bits) {
+	//ALERT goes high with the first bit set, and stays high until they're all cleared.
+	if (!sim_sys_stat && bits) {
+		sim_event(8);
+	}
+	sim_sys_stat |= bits;
+}
+
+static void sim_step(void) {
+	//One millisecond of the pack.
+	sim_ms++;
+	if (sim_trigger(sim_ms) && !sim_trigger(sim_ms - 1)) {
+		sim_powered_ms = sim_ms;
+		sim_event(4);
+	}
+
+	int32_t current = sim_current(sim_ms);
+	for (int i=0; i<NUM_CELLS; ++i) {
+		sim_cells[i].mah += current / 3600000.0;
+	}
+	if (current < 0) {
+		sim_delivered_mah -= current / 3600000.0;
+	}
+
+	int min_mv = 5000, min_ocv = 5000, max_mv = 0;
+	for (int i=0; i<NUM_CELLS; ++i) {
+		int mv = sim_cell_mv(i, current);
+		int ocv = sim_cell_ocv(&sim_cells[i]);
+		min_mv = mv < min_mv ? mv : min_mv;
+		max_mv = mv > max_mv ? mv : max_mv;
+		min_ocv = ocv < min_ocv ? ocv : min_ocv;
+	}
+
+	if (current < 0) {
+		if (sim_loaded_cutoff_mah < 0 && min_mv < CELL_LOWEST_DISCHARGE_VOLTAGE) {
+			sim_loaded_cutoff_mah = sim_delivered_mah;
+		}
+		if (sim_resting_cutoff_mah < 0 && min_ocv < CELL_LOWEST_DISCHARGE_VOLTAGE) {
+			sim_resting_cutoff_mah = sim_delivered_mah;
+		}
+	}
+
+	//The BQ7693's own protection, on the loaded voltages.
+	sim_uv_ms = min_mv < sim_uv_trip_mv ? sim_uv_ms + 1 : 0;
+	sim_ov_ms = max_mv > sim_ov_trip_mv ? sim_ov_ms + 1 : 0;
+	if (sim_uv_ms >= SIM_TRIP_DELAY_MS && !(sim_sys_stat & STAT_UV)) {
+		sim_uv_tripped = true;
+		sim_regs[SYS_CTRL2] &= ~0x02;
+		sim_set_stat(STAT_UV);
+	}
+	if (sim_ov_ms >= SIM_TRIP_DELAY_MS && !(sim_sys_stat & STAT_OV)) {
+		sim_regs[SYS_CTRL2] &= ~0x01;
+		sim_set_stat(STAT_OV);
+	}
+
+	//Coulomb counter - continuous, or a single reading, averaging the current over 250mS.
+	if (sim_regs[SYS_CTRL2] & 0x60) {
+		sim_cc_sum += current;
+		if (++sim_cc_ms == SIM_CC_PERIOD_MS) {
+			//8.44uV per LSB across a 1mOhm sense resistor.
+			sim_cc = (int16_t)(sim_cc_sum / SIM_CC_PERIOD_MS * 25 / 211);
+			sim_cc_sum = 0;
+			sim_cc_ms = 0;
+			sim_regs[SYS_CTRL2] &= ~0x20;
+			sim_set_stat(STAT_CC_READY);
+		}
+	}
+
+	if (sim->stop_on_cutoff && !sim_stopped_ms && sim_trigger(sim_ms) && current == 0 && sim_delivered_mah > 0) {
+		sim_stopped_ms = sim_ms;
+		sim_stopped_mah = sim_delivered_mah;
+		sim_stopped_min_mv = min_ocv;
+	}
+}
+
+static void sim_advance(void) {
+	while ((int32_t)(host_now_ms() - sim_ms) > 0) {
+		sim_step();
+	}
+}
+
+static void sim_put16(uint8_t *buf, size_t len, uint16_t value) {
+	//High byte, CRC, low byte - the CRC isn't checked.
+	buf[0] = value >> 8;
+	if (len >= 3) {
+		buf[1] = 0;
+		buf[2] = value & 0xFF;
+	}
+	else if (len == 2) {
+		buf[1] = value & 0xFF;
+	}
+}
+
+static bool sim_i2c_read(uint8_t reg, uint8_t *buf, size_t len) {
+	sim_advance();
+	memset(buf, 0, len);
+	int32_t current = sim_current(sim_ms);
+
+	if (reg >= VC1_HI_BYTE && reg <= VC15_HI_BYTE && !(reg & 1)) {
+		//Cells on VC1, 2, 3, 4, 6, 7 and 10 - see bq7693.c
+		static const int8_t cell_on_input[15] = { 0, 1, 2, 3, -1, 4, 5, -1, -1, 6, -1, -1, -1, -1, -1 };
+		int cell = cell_on_input[(reg - VC1_HI_BYTE) / 2];
+		int mv = cell >= 0 ? sim_cell_mv(cell, current) : 0;
+		sim_put16(buf, len, (uint16_t)(mv * 1000 / SIM_ADC_GAIN_UV));
+	}
+	else if (reg == BAT_HI_BYTE) {
+		int mv = 0;
+		for (int i=0; i<NUM_CELLS; ++i) {
+			mv += sim_cell_mv(i, current);
+		}
+		sim_put16(buf, len, (uint16_t)(mv * 1000 / (4 * SIM_ADC_GAIN_UV)));
+	}
+	else if (reg == TS1_HI_BYTE || reg == TS2_HI_BYTE || reg == TS3_HI_BYTE) {
+		sim_put16(buf, len, SIM_TS_25C);
+	}
+	else if (reg == CC_HI_BYTE) {
+		sim_put16(buf, len, (uint16_t)sim_cc);
+	}
+	else if (reg == SYS_STAT) {
+		buf[0] = sim_sys_stat;
+	}
+	else if (reg == ADCGAIN1 || reg == ADCGAIN2 || reg == ADCOFFSET) {
+		buf[0] = 0;
+	}
+	else {
+		buf[0] = sim_regs[reg];
+	}
+	return true;
+}
+
+static void sim_i2c_write(uint8_t reg, uint8_t value) {
+	sim_advance();
+
+	switch (reg) {
+		case SYS_STAT:
+			//Write 1 to clear.
+			sim_sys_stat &= ~value;
+			return;
+		case SYS_CTRL2:
+			if ((value & 0x20) || ((value & 0x40) && !(sim_regs[SYS_CTRL2] & 0x60))) {
+				//One-shot, or continuous starting - a fresh conversion either way.
+				sim_cc_sum = 0;
+				sim_cc_ms = 0;
+			}
+			//The FETs stay off while the fault that turned them off is still flagged.
+			if (sim_sys_stat & (STAT_UV | STAT_SCD | STAT_OCD)) {
+				value &= ~0x02;
+			}
+			if (sim_sys_stat & STAT_OV) {
+				value &= ~0x01;
+			}
+			if ((value & 0x02) && !(sim_regs[SYS_CTRL2] & 0x02)) {
+				sim_powered_ms = sim_ms;
+			}
+			break;
+		case UV_TRIP:
+			//Bits 11:4 of the ADC code - 13:12 are 01, and the rest 0.
+			sim_uv_trip_mv = (uint16_t)(((0x1000 | (value << 4)) * SIM_ADC_GAIN_UV) / 1000);
+			break;
+		case OV_TRIP:
+			//Bits 11:4 of the ADC code - 13:12 are 10, and 3:0 are 1000.
+			sim_ov_trip_mv = (uint16_t)(((0x2008 | (value << 4)) * SIM_ADC_GAIN_UV) / 1000);
+			break;
+	}
+	sim_regs[reg] = value;
+}
+
+static bool sim_pin_input(uint8_t pin) {
+	sim_advance();
+	switch (pin) {
+		case TRIGGER_PRESSED_PIN:
+			return sim_trigger(sim_ms);
+		case CHARGER_CONNECTED_PIN:
+			return sim_charger(sim_ms);
+		case BQ7693_ALERT_PIN:
+			return sim_sys_stat != 0;
+		case PIN_PA11:
+			//Debug adapter attached.
+			return true;
+	}
+	return false;
+}
+
+static bool sim_next_event(bool before_read, bool extint_masked, struct host_event *event) {
+	//Everything here is in real time, so before_read makes no difference.
+	sim_advance();
+	if (!sim_event_count || extint_masked) {
+		return false;
+	}
+	*event = sim_events[sim_event_head];
+	sim_event_head = (sim_event_head + 1) % SIM_EVENTS;
+	sim_event_count--;
+	return true;
+}
+
+static bool sim_eeprom_page(uint8_t page, uint8_t *data) {
+	//A new chip.
+	return false;
+}
+
+static enum system_reset_cause sim_reset_cause(void) {
+	return SYSTEM_RESET_CAUSE_POR;
+}
+
+static bool sim_finished(void) {
+	if (sim->stop_on_cutoff && sim_stopped_ms && sim_ms > sim_stopped_ms + 3000) {
+		return true;
+	}
+	return sim_ms >= sim->end_ms;
+}
+
+static const struct host_hw sim_hw = {
+	.i2c_read = sim_i2c_read,
+	.i2c_write = sim_i2c_write,
+	.pin_input = sim_pin_input,
+	.next_event = sim_next_event,
+	.eeprom_page = sim_eeprom_page,
+	.reset_cause = sim_reset_cause,
+	.finished = sim_finished,
+};
+
+const struct host_hw *pack_sim_hw(const char *scenario) {
+	for (size_t i=0; i<sizeof(sim_scenarios) / sizeof(sim_scenarios[0]); ++i) {
+		if (!strcmp(sim_scenarios[i].name, scenario)) {
+			sim = &sim_scenarios[i];
+			for (int j=0; j<NUM_CELLS; ++j) {
+				sim_cells[j].mah = sim->start_mah;
+			}
+			return &sim_hw;
+		}
+	}
+	return NULL;
+}
+
+const char *pack_sim_scenarios() {
+	return "basic|rundown";
+}
+
+void pack_sim_report() {
+	printf("After %" PRIu32 " ms: %.1f mAh delivered\n", sim_ms, sim_delivered_mah);
+	for (int i=0; i<NUM_CELLS; ++i) {
+		printf("  cell %d: %4d mV resting, %7.1f mAh left of %u, %u mOhm\n", i, sim_cell_ocv(&sim_cells[i]), sim_cells[i].mah,
+			sim_cells[i].capacity_mah, sim_cells[i].resistance_mohm);
+	}
+	if (!sim->stop_on_cutoff) {
+		return;
+	}
+	if (sim_loaded_cutoff_mah >= 0) {
+		printf("Weakest cell below %d mV loaded after %.1f mAh\n", CELL_LOWEST_DISCHARGE_VOLTAGE, sim_loaded_cutoff_mah);
+	}
+	if (sim_resting_cutoff_mah >= 0) {
+		printf("Weakest cell below %d mV resting after %.1f mAh\n", CELL_LOWEST_DISCHARGE_VOLTAGE, sim_resting_cutoff_mah);
+	}
+	if (sim_stopped_ms) {
+		printf("Discharge stopped at %" PRIu32 " ms, after %.1f mAh (weakest cell %u mV resting), by %s\n", sim_stopped_ms, sim_stopped_mah,
+			sim_stopped_min_mv, sim_uv_tripped ? "the BQ7693's UV trip" : "the BMS");
+	}
+	else {
+		printf("Discharge never stopped\n");
+	}
+}
@@ -0,0 +1,33 @@
+/*
+ * pack_sim.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+
+#ifndef PACK_SIM_H_
+#define PACK_SIM_H_
+
+#include "shim/host_hw.h"
+
+/* A simulated pack for the firmware to run against on a PC - 7 cells with their own capacity and resistance, a
+BQ7693 (cell/pack voltages, temperature, coulomb counter, CC_READY and UV/OV trips on the ALERT line, and the FETs),
+and the trigger and charger pins driven by a scenario:
+
+	basic	- trigger pulled for 10s, then on the charger for 30s. trace_replay's self-test replays its capture.
+	rundown	- a nearly flat pack in boost mode until the BMS (or the BQ7693) stops it - shows how much charge the
+			  IR-compensated cutoff gets out of the pack over one on the loaded voltage.
+
+Being a capture of a real (if simulated) run, what the firmware streams can be fed to trace_replay.
+*/
+
+//NULL if there's no scenario by that name.
+const struct host_hw *pack_sim_hw(const char *scenario);
+//The scenario names, for the usage message.
+const char *pack_sim_scenarios(void);
+//What happened to the cells - printed once the run has ended.
+void pack_sim_report(void);
+
+#endif /* PACK_SIM_H_ */
@@ -0,0 +1,470 @@
+/*
+ * host_asf.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include "host_hw.h"
+
+//BQ7693 registers the shim itself cares about (see bq7693.h).
+#define HOST_SYS_CTRL1 0x04
+
+//A loop that polls without ever waiting is given a millisecond every this many polls, as it would take on the chip.
+#define HOST_SPIN_POLLS 1000
+
+Port host_port;
+Sercom host_sercom[3] = { { 0 }, { 1 }, { 2 } };
+Nvmctrl host_nvmctrl = { .INTFLAG = { NVMCTRL_INTFLAG_READY } };
+uint32_t host_aux_row[2];
+
+static const struct host_hw *host_hw;
+static jmp_buf host_exit;
+static char host_message[256];
+
+static uint32_t host_ms = 0;
+static uint32_t host_us = 0;		//Towards the next millisecond
+static uint32_t host_polls = 0;
+
+//Interrupt masking - a critical section masks everything, and the EIC can be masked on its own.
+static int host_critical = 0;
+static bool host_eic_masked = false;
+static bool host_in_isr = false;
+
+static extint_callback_t host_extint_callbacks[16];
+static uint16_t host_extint_enabled = 0;
+
+static struct usart_module *host_usarts[3];
+
+static uint8_t host_i2c_reg = 0;
+static bool host_i2c_failed = false;
+static uint8_t host_sys_ctrl1 = 0;
+
+static uint8_t host_eeprom[HOST_EEPROM_PAGES][EEPROM_PAGE_SIZE];
+
+static uint8_t *host_output = NULL;
+static size_t host_output_len = 0;
+static size_t host_output_size = 0;
+
+void host_end(enum HOST_END reason, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(host_message, sizeof(host_message), fmt, args);
+	va_end(args);
+	longjmp(host_exit, reason + 1);
+}
+
+const char *host_end_message() {
+	return host_message;
+}
+
+uint32_t host_now_ms() {
+	return host_ms;
+}
+
+void host_clock_catch_up(uint32_t ms) {
+	if ((int32_t)(ms - host_ms) > 0) {
+		host_ms = ms;
+		host_us = 0;
+		host_polls = 0;
+	}
+}
+
+const uint8_t *host_debug_output(size_t *len) {
+	*len = host_output_len;
+	return host_output;
+}
+
+static void host_output_append(const uint8_t *data, size_t len) {
+	if (host_output_len + len > host_output_size) {
+		host_output_size = (host_output_len + len) * 2 + 4096;
+		host_output = realloc(host_output, host_output_size);
+		if (!host_output) {
+			fprintf(stderr, "Out of memory\n");
+			exit(2);
+		}
+	}
+	memcpy(&host_output[host_output_len], data, len);
+	host_output_len += len;
+}
+
+static bool host_can_interrupt(void) {
+	return !host_in_isr && host_critical == 0;
+}
+
+static void host_fire(const struct host_event *event) {
+	host_clock_catch_up(event->time_ms);
+	host_in_isr = true;
+
+	if (event->type == HOST_EVENT_EXTINT) {
+		if (event->channel < 16 && (host_extint_enabled & (1 << event->channel)) && host_extint_callbacks[event->channel]) {
+			host_extint_callbacks[event->channel]();
+		}
+	}
+	else if (event->type == HOST_EVENT_UART_RX) {
+		//Completes the read job running on that SERCOM - if there isn't one, the bytes are lost, as they would be.
+		struct usart_module *module = event->channel < 3 ? host_usarts[event->channel] : NULL;
+		if (module && module->enabled && module->rx_buffer) {
+			uint8_t *buffer = module->rx_buffer;
+			size_t len = event->len < module->rx_length ? event->len : module->rx_length;
+			module->rx_buffer = NULL;
+			memcpy(buffer, event->data, len);
+			if ((module->callback_enabled & (1 << USART_CALLBACK_BUFFER_RECEIVED)) && module->callback[USART_CALLBACK_BUFFER_RECEIVED]) {
+				module->callback[USART_CALLBACK_BUFFER_RECEIVED](module);
+			}
+		}
+	}
+	host_in_isr = false;
+}
+
+static struct usart_module *host_tx_done(void) {
+	for (int i=0; i<3; ++i) {
+		if (host_usarts[i] && host_usarts[i]->tx_done_pending) {
+			return host_usarts[i];
+		}
+	}
+	return NULL;
+}
+
+static void host_interrupts(void) {
+	//Run everything that's due and not masked.
+	while (host_can_interrupt()) {
+		struct usart_module *module = host_tx_done();
+		if (module) {
+			module->tx_done_pending = false;
+			if ((module->callback_enabled & (1 << USART_CALLBACK_BUFFER_TRANSMITTED)) && module->callback[USART_CALLBACK_BUFFER_TRANSMITTED]) {
+				host_in_isr = true;
+				module->callback[USART_CALLBACK_BUFFER_TRANSMITTED](module);
+				host_in_isr = false;
+			}
+			continue;
+		}
+
+		struct host_event event;
+		if (!host_hw->next_event(false, host_eic_masked, &event)) {
+			break;
+		}
+		host_fire(&event);
+	}
+
+	if (host_can_interrupt() && host_hw->finished()) {
+		host_end(HOST_END_FINISHED, "finished at %" PRIu32 " ms", host_ms);
+	}
+}
+
+static void host_tick(void) {
+	host_ms++;
+	host_polls = 0;
+	host_interrupts();
+}
+
+void host_poll() {
+	//Every call from the firmware that could be in a polling loop comes through here.
+	if (++host_polls >= HOST_SPIN_POLLS) {
+		host_tick();
+	}
+	else {
+		host_interrupts();
+	}
+}
+
+enum HOST_END host_run(const struct host_hw *hw, void (*firmware)(void)) {
+	host_hw = hw;
+
+	int result = setjmp(host_exit);
+	if (result == 0) {
+		firmware();
+		host_end(HOST_END_FINISHED, "firmware returned");
+	}
+
+	//Let the trace send whatever it still has queued up.
+	host_in_isr = false;
+	host_critical = 0;
+	for (int i=0; i<1000; ++i) {
+		struct usart_module *module = host_tx_done();
+		if (!module) {
+			break;
+		}
+		module->tx_done_pending = false;
+		if (module->callback[USART_CALLBACK_BUFFER_TRANSMITTED]) {
+			module->callback[USART_CALLBACK_BUFFER_TRANSMITTED](module);
+		}
+	}
+	return (enum HOST_END)(result - 1);
+}
+
+//Port
+void port_get_config_defaults(struct port_config *const config) {
+	config->direction = PORT_PIN_DIR_INPUT;
+	config->input_pull = PORT_PIN_PULL_UP;
+	config->powersave = false;
+}
+
+void port_pin_set_config(const uint8_t gpio_pin, const struct port_config *const config) {
+}
+
+void port_pin_set_output_level(const uint8_t gpio_pin, const bool level) {
+}
+
+bool port_pin_get_input_level(const uint8_t gpio_pin) {
+	host_poll();
+	return host_hw->pin_input(gpio_pin);
+}
+
+//System
+void system_init() {
+}
+
+void system_interrupt_enable(enum system_interrupt_vector vector) {
+	if (vector == SYSTEM_INTERRUPT_MODULE_EIC) {
+		host_eic_masked = false;
+		host_interrupts();
+	}
+}
+
+void system_interrupt_disable(enum system_interrupt_vector vector) {
+	if (vector == SYSTEM_INTERRUPT_MODULE_EIC) {
+		host_eic_masked = true;
+	}
+}
+
+void system_interrupt_enter_critical_section() {
+	host_critical++;
+}
+
+void system_interrupt_leave_critical_section() {
+	if (--host_critical == 0) {
+		host_interrupts();
+	}
+}
+
+void system_interrupt_enable_global() {
+	host_interrupts();
+}
+
+void system_set_sleepmode(enum system_sleepmode sleep_mode) {
+}
+
+void system_sleep() {
+	//Until the next SysTick.
+	host_tick();
+}
+
+enum system_reset_cause system_get_reset_cause() {
+	return host_hw->reset_cause();
+}
+
+uint32_t system_cpu_clock_get_hz() {
+	return 8000000UL;
+}
+
+void NVIC_SystemReset() {
+	host_end(HOST_END_RESET, "NVIC_SystemReset() at %" PRIu32 " ms", host_ms);
+}
+
+void delay_init() {
+}
+
+void delay_ms(uint32_t ms) {
+	while (ms--) {
+		host_tick();
+	}
+}
+
+void delay_us(uint32_t us) {
+	host_us += us;
+	while (host_us >= 1000) {
+		host_us -= 1000;
+		host_tick();
+	}
+	host_interrupts();
+}
+
+//EXTINT
+void extint_chan_get_config_defaults(struct extint_chan_conf *const config) {
+	memset(config, 0, sizeof(*config));
+	config->gpio_pin_pull = EXTINT_PULL_UP;
+	config->detection_criteria = EXTINT_DETECT_FALLING;
+}
+
+void extint_chan_set_config(const uint8_t channel, const struct extint_chan_conf *const config) {
+}
+
+enum status_code extint_register_callback(const extint_callback_t callback, const uint8_t channel, const enum extint_callback_type type) {
+	host_extint_callbacks[channel & 0x0F] = callback;
+	return STATUS_OK;
+}
+
+enum status_code extint_chan_enable_callback(const uint8_t channel, const enum extint_callback_type type) {
+	host_extint_enabled |= 1 << (channel & 0x0F);
+	return STATUS_OK;
+}
+
+//I2C - only the BQ7693 is on it.
+void i2c_master_get_config_defaults(struct i2c_master_config *const config) {
+	config->baud_rate = 100;
+	config->buffer_timeout = 65535;
+}
+
+enum status_code i2c_master_init(struct i2c_master_module *const module, Sercom *const hw, const struct i2c_master_config *const config) {
+	module->hw = hw;
+	return STATUS_OK;
+}
+
+void i2c_master_enable(const struct i2c_master_module *const module) {
+}
+
+enum status_code i2c_master_write_packet_wait(struct i2c_master_module *const module, struct i2c_master_packet *const packet) {
+	if (packet->data_length == 1) {
+		//Register address, for a read. bq7693_read_register() has just masked the EIC - anything the hardware
+		//says came before this read arrived before that, so run it now.
+		if (host_can_interrupt()) {
+			bool masked = host_eic_masked;
+			struct host_event event;
+			host_eic_masked = false;
+			while (host_hw->next_event(true, false, &event)) {
+				host_fire(&event);
+			}
+			host_eic_masked = masked;
+		}
+		host_i2c_reg = packet->data[0];
+		host_i2c_failed = false;
+		return STATUS_OK;
+	}
+
+	//Register address, value, CRC.
+	uint8_t reg = packet->data[0];
+	uint8_t value = packet->data[1];
+	host_hw->i2c_write(reg, value);
+
+	if (reg == HOST_SYS_CTRL1) {
+		//SHUT_A then SHUT_B - the BQ7693 goes into ship mode and takes our power with it.
+		if (host_sys_ctrl1 == 0x01 && value == 0x02) {
+			host_end(HOST_END_POWER_OFF, "ship mode at %" PRIu32 " ms", host_ms);
+		}
+		host_sys_ctrl1 = value;
+	}
+	return STATUS_OK;
+}
+
+enum status_code i2c_master_read_packet_wait(struct i2c_master_module *const module, struct i2c_master_packet *const packet) {
+	//A failed read keeps failing until the next transaction, as bq7693_read_register() retries it.
+	if (host_i2c_failed || !host_hw->i2c_read(host_i2c_reg, packet->data, packet->data_length)) {
+		host_i2c_failed = true;
+		return STATUS_ERR_TIMEOUT;
+	}
+	return STATUS_OK;
+}
+
+//USART - SERCOM0 is the debug port, where the trace goes, and SERCOM2 the vacuum.
+void usart_get_config_defaults(struct usart_config *const config) {
+	memset(config, 0, sizeof(*config));
+	config->baudrate = 9600;
+}
+
+enum status_code usart_init(struct usart_module *const module, Sercom *const hw, const struct usart_config *const config) {
+	memset(module, 0, sizeof(*module));
+	module->hw = hw;
+	host_usarts[hw->id] = module;
+	return STATUS_OK;
+}
+
+void usart_enable(const struct usart_module *const module) {
+	((struct usart_module *)module)->enabled = true;
+}
+
+void usart_disable(const struct usart_module *const module) {
+	((struct usart_module *)module)->enabled = false;
+}
+
+void usart_register_callback(struct usart_module *const module, usart_callback_t callback_func, enum usart_callback callback_type) {
+	module->callback[callback_type] = callback_func;
+}
+
+void usart_enable_callback(struct usart_module *const module, enum usart_callback callback_type) {
+	module->callback_enabled |= 1 << callback_type;
+}
+
+enum status_code usart_read_buffer_job(struct usart_module *const module, uint8_t *rx_data, uint16_t length) {
+	if (module->rx_buffer) {
+		return STATUS_BUSY;
+	}
+	module->rx_buffer = rx_data;
+	module->rx_length = length;
+	return STATUS_OK;
+}
+
+enum status_code usart_write_buffer_job(struct usart_module *const module, uint8_t *tx_data, uint16_t length) {
+	if (module->tx_done_pending) {
+		return STATUS_BUSY;
+	}
+	if (module->hw == SERCOM0) {
+		host_output_append(tx_data, length);
+	}
+	//Sent straight away - the callback runs as soon as interrupts allow.
+	module->tx_done_pending = true;
+	return STATUS_OK;
+}
+
+enum status_code usart_write_buffer_wait(struct usart_module *const module, const uint8_t *tx_data, uint16_t length) {
+	if (module->hw == SERCOM0) {
+		host_output_append(tx_data, length);
+	}
+	return STATUS_OK;
+}
+
+enum status_code usart_read_wait(struct usart_module *const module, uint16_t *const rx_data) {
+	//Nothing typed on the debug port.
+	return STATUS_BUSY;
+}
+
+//EEPROM emulator - page 0 as it was at boot, from the hardware.
+enum status_code eeprom_emulator_init() {
+	for (uint8_t page=0; page<HOST_EEPROM_PAGES; ++page) {
+		if (!host_hw->eeprom_page(page, host_eeprom[page])) {
+			if (page == 0) {
+				//Nothing stored - as on a new chip, the firmware formats it.
+				return STATUS_ERR_BAD_FORMAT;
+			}
+			memset(host_eeprom[page], 0xFF, EEPROM_PAGE_SIZE);
+		}
+	}
+	return STATUS_OK;
+}
+
+enum status_code eeprom_emulator_erase_memory() {
+	memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+	return STATUS_OK;
+}
+
+enum status_code eeprom_emulator_read_page(const uint8_t logical_page, uint8_t *const data) {
+	if (logical_page >= HOST_EEPROM_PAGES) {
+		return STATUS_ERR_BAD_FORMAT;
+	}
+	memcpy(data, host_eeprom[logical_page], EEPROM_PAGE_SIZE);
+	return STATUS_OK;
+}
+
+enum status_code eeprom_emulator_write_page(const uint8_t logical_page, const uint8_t *const data) {
+	if (logical_page >= HOST_EEPROM_PAGES) {
+		return STATUS_ERR_BAD_FORMAT;
+	}
+	memcpy(host_eeprom[logical_page], data, EEPROM_PAGE_SIZE);
+	return STATUS_OK;
+}
+
+enum status_code eeprom_emulator_commit_page_buffer() {
+	return STATUS_OK;
+}
+
+void nvm_get_config_defaults(struct nvm_config *const config) {
+	config->manual_page_write = true;
+}
+
+enum status_code nvm_set_config(const struct nvm_config *const config) {
+	return STATUS_OK;
+}
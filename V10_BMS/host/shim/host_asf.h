@@ -0,0 +1,298 @@
+/*
+ * host_asf.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+
+#ifndef HOST_ASF_H_
+#define HOST_ASF_H_
+
+/* Just enough of the ASF API for the firmware sources to build and run on a PC.
+
+src/asf.h includes the ASF headers with <>, and host/CMakeLists.txt generates each of those as a one line
+header that includes this one. The functions are in host_asf.c, where the BQ7693, pins, EEPROM and interrupts
+are played back from a trace captured on the pack - see host_hw.h.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+enum status_code {
+	STATUS_OK = 0x00,
+	STATUS_BUSY = 0x19,
+	STATUS_ERR_IO = -1,
+	STATUS_ERR_TIMEOUT = -3,
+	STATUS_ERR_INVALID_ARG = -8,
+	STATUS_ERR_BAD_FORMAT = -10,
+	STATUS_ERR_NO_MEMORY = -23,
+};
+
+#define UNUSED(v) (void)(v)
+#define __DMB() __sync_synchronize()
+
+//Pins - PORTA only on the SAMD20E.
+#define PIN_PA00 0
+#define PIN_PA01 1
+#define PIN_PA02 2
+#define PIN_PA04 4
+#define PIN_PA06 6
+#define PIN_PA10 10
+#define PIN_PA11 11
+#define PIN_PA18 18
+#define PIN_PA19 19
+#define PIN_PA24 24
+#define PIN_PA25 25
+#define PIN_PA28 28
+
+//Pin number in the top half, mux setting in the bottom.
+#define PINMUX_PA10C_SERCOM0_PAD2 ((10UL << 16) | 2)
+#define PINMUX_PA11C_SERCOM0_PAD3 ((11UL << 16) | 2)
+#define PINMUX_PA14C_SERCOM2_PAD2 ((14UL << 16) | 2)
+#define PINMUX_PA15C_SERCOM2_PAD3 ((15UL << 16) | 2)
+#define PINMUX_PA16C_SERCOM1_PAD0 ((16UL << 16) | 2)
+#define PINMUX_PA17C_SERCOM1_PAD1 ((17UL << 16) | 2)
+#define PIN_PA04A_EIC_EXTINT4 4
+#define MUX_PA04A_EIC_EXTINT4 0
+#define PIN_PA28A_EIC_EXTINT8 28
+#define MUX_PA28A_EIC_EXTINT8 0
+
+typedef struct {
+	struct {
+		union {
+			struct {
+				uint8_t PMUXEN:1;
+			} bit;
+			uint8_t reg;
+		} PINCFG[32];
+		struct {
+			uint8_t reg;
+		} PMUX[16];
+	} Group[1];
+} Port;
+
+extern Port host_port;
+#define PORT (&host_port)
+
+enum port_pin_dir {
+	PORT_PIN_DIR_INPUT,
+	PORT_PIN_DIR_OUTPUT,
+	PORT_PIN_DIR_OUTPUT_WTH_READBACK,
+};
+
+enum port_pin_pull {
+	PORT_PIN_PULL_NONE,
+	PORT_PIN_PULL_UP,
+	PORT_PIN_PULL_DOWN,
+};
+
+struct port_config {
+	enum port_pin_dir direction;
+	enum port_pin_pull input_pull;
+	bool powersave;
+};
+
+void port_get_config_defaults(struct port_config *const config);
+void port_pin_set_config(const uint8_t gpio_pin, const struct port_config *const config);
+void port_pin_set_output_level(const uint8_t gpio_pin, const bool level);
+bool port_pin_get_input_level(const uint8_t gpio_pin);
+
+//System
+enum system_interrupt_vector {
+	SYSTEM_INTERRUPT_MODULE_EIC = 4,
+};
+
+enum system_sleepmode {
+	SYSTEM_SLEEPMODE_IDLE_0,
+	SYSTEM_SLEEPMODE_IDLE_1,
+	SYSTEM_SLEEPMODE_IDLE_2,
+	SYSTEM_SLEEPMODE_STANDBY,
+};
+
+enum system_reset_cause {
+	SYSTEM_RESET_CAUSE_POR = 0x01,
+	SYSTEM_RESET_CAUSE_BOD12 = 0x02,
+	SYSTEM_RESET_CAUSE_BOD33 = 0x04,
+	SYSTEM_RESET_CAUSE_EXTERNAL_RESET = 0x10,
+	SYSTEM_RESET_CAUSE_WDT = 0x20,
+	SYSTEM_RESET_CAUSE_SOFTWARE = 0x40,
+};
+
+void system_init(void);
+void system_interrupt_enable(enum system_interrupt_vector vector);
+void system_interrupt_disable(enum system_interrupt_vector vector);
+void system_interrupt_enter_critical_section(void);
+void system_interrupt_leave_critical_section(void);
+void system_interrupt_enable_global(void);
+void system_set_sleepmode(enum system_sleepmode sleep_mode);
+void system_sleep(void);
+enum system_reset_cause system_get_reset_cause(void);
+uint32_t system_cpu_clock_get_hz(void);
+void NVIC_SystemReset(void) __attribute__((noreturn));
+
+void delay_init(void);
+void delay_ms(uint32_t ms);
+void delay_us(uint32_t us);
+
+//EXTINT
+enum extint_pull {
+	EXTINT_PULL_NONE,
+	EXTINT_PULL_UP,
+	EXTINT_PULL_DOWN,
+};
+
+enum extint_detect {
+	EXTINT_DETECT_NONE,
+	EXTINT_DETECT_RISING,
+	EXTINT_DETECT_FALLING,
+	EXTINT_DETECT_BOTH,
+};
+
+enum extint_callback_type {
+	EXTINT_CALLBACK_TYPE_DETECT,
+};
+
+struct extint_chan_conf {
+	uint32_t gpio_pin;
+	uint32_t gpio_pin_mux;
+	enum extint_pull gpio_pin_pull;
+	bool wake_if_sleeping;
+	bool filter_input_signal;
+	enum extint_detect detection_criteria;
+};
+
+typedef void (*extint_callback_t)(void);
+
+void extint_chan_get_config_defaults(struct extint_chan_conf *const config);
+void extint_chan_set_config(const uint8_t channel, const struct extint_chan_conf *const config);
+enum status_code extint_register_callback(const extint_callback_t callback, const uint8_t channel, const enum extint_callback_type type);
+enum status_code extint_chan_enable_callback(const uint8_t channel, const enum extint_callback_type type);
+
+//SERCOM
+typedef struct {
+	uint8_t id;
+} Sercom;
+
+extern Sercom host_sercom[3];
+#define SERCOM0 (&host_sercom[0])
+#define SERCOM1 (&host_sercom[1])
+#define SERCOM2 (&host_sercom[2])
+
+struct i2c_master_module {
+	Sercom *hw;
+};
+
+struct i2c_master_config {
+	uint32_t baud_rate;
+	uint16_t buffer_timeout;
+};
+
+struct i2c_master_packet {
+	uint16_t address;
+	uint16_t data_length;
+	uint8_t *data;
+	bool ten_bit_address;
+	bool high_speed;
+	uint8_t hs_master_code;
+};
+
+void i2c_master_get_config_defaults(struct i2c_master_config *const config);
+enum status_code i2c_master_init(struct i2c_master_module *const module, Sercom *const hw, const struct i2c_master_config *const config);
+void i2c_master_enable(const struct i2c_master_module *const module);
+enum status_code i2c_master_write_packet_wait(struct i2c_master_module *const module, struct i2c_master_packet *const packet);
+enum status_code i2c_master_read_packet_wait(struct i2c_master_module *const module, struct i2c_master_packet *const packet);
+
+enum usart_signal_mux_settings {
+	USART_RX_3_TX_2_XCK_3,
+};
+
+enum usart_parity {
+	USART_PARITY_NONE,
+	USART_PARITY_ODD,
+	USART_PARITY_EVEN,
+};
+
+enum usart_callback {
+	USART_CALLBACK_BUFFER_TRANSMITTED,
+	USART_CALLBACK_BUFFER_RECEIVED,
+	USART_CALLBACK_N,
+};
+
+struct usart_module;
+typedef void (*usart_callback_t)(struct usart_module *const module);
+
+struct usart_module {
+	Sercom *hw;
+	bool enabled;
+	usart_callback_t callback[USART_CALLBACK_N];
+	uint8_t callback_enabled;
+	uint8_t *rx_buffer;				//Read job in progress
+	uint16_t rx_length;
+	bool tx_done_pending;			//Write job finished, callback not run yet
+};
+
+struct usart_config {
+	uint32_t baudrate;
+	enum usart_signal_mux_settings mux_setting;
+	enum usart_parity parity;
+	uint32_t pinmux_pad0;
+	uint32_t pinmux_pad1;
+	uint32_t pinmux_pad2;
+	uint32_t pinmux_pad3;
+};
+
+void usart_get_config_defaults(struct usart_config *const config);
+enum status_code usart_init(struct usart_module *const module, Sercom *const hw, const struct usart_config *const config);
+void usart_enable(const struct usart_module *const module);
+void usart_disable(const struct usart_module *const module);
+void usart_register_callback(struct usart_module *const module, usart_callback_t callback_func, enum usart_callback callback_type);
+void usart_enable_callback(struct usart_module *const module, enum usart_callback callback_type);
+enum status_code usart_read_buffer_job(struct usart_module *const module, uint8_t *rx_data, uint16_t length);
+enum status_code usart_write_buffer_job(struct usart_module *const module, uint8_t *tx_data, uint16_t length);
+enum status_code usart_write_buffer_wait(struct usart_module *const module, const uint8_t *tx_data, uint16_t length);
+enum status_code usart_read_wait(struct usart_module *const module, uint16_t *const rx_data);
+
+//EEPROM emulator and NVM
+#define EEPROM_PAGE_SIZE 60
+#define HOST_EEPROM_PAGES 16
+
+enum status_code eeprom_emulator_init(void);
+enum status_code eeprom_emulator_erase_memory(void);
+enum status_code eeprom_emulator_read_page(const uint8_t logical_page, uint8_t *const data);
+enum status_code eeprom_emulator_write_page(const uint8_t logical_page, const uint8_t *const data);
+enum status_code eeprom_emulator_commit_page_buffer(void);
+
+struct nvm_config {
+	bool manual_page_write;
+};
+
+void nvm_get_config_defaults(struct nvm_config *const config);
+enum status_code nvm_set_config(const struct nvm_config *const config);
+
+typedef struct {
+	struct { uint32_t reg; } CTRLA;
+	struct { uint32_t reg; } CTRLB;
+	struct { uint8_t reg; } INTFLAG;
+	struct { uint16_t reg; } STATUS;
+	struct { uint32_t reg; } ADDR;
+} Nvmctrl;
+
+extern Nvmctrl host_nvmctrl;
+extern uint32_t host_aux_row[2];
+#define NVMCTRL (&host_nvmctrl)
+#define NVMCTRL_AUX0_ADDRESS ((uintptr_t)host_aux_row)
+#define NVMCTRL_INTFLAG_READY 0x01
+#define NVMCTRL_STATUS_MASK 0x1F
+#define NVMCTRL_CTRLA_CMDEX_KEY 0xA500
+#define NVMCTRL_CTRLB_CACHEDIS 0x40000
+#define NVM_COMMAND_ERASE_AUX_ROW 0x05
+#define NVM_COMMAND_PAGE_BUFFER_CLEAR 0x44
+#define NVM_COMMAND_WRITE_AUX_ROW 0x06
+
+#endif /* HOST_ASF_H_ */
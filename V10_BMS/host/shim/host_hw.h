@@ -0,0 +1,76 @@
+/*
+ * host_hw.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+
+#ifndef HOST_HW_H_
+#define HOST_HW_H_
+
+#include "host_asf.h"
+
+/* The hardware behind the ASF shim - either a trace captured on a pack being played back (trace_replay.c),
+or a simulated pack (pack_sim.c).
+
+host_asf.c keeps the clock, the interrupt masking and the registered callbacks. Time only moves when the
+firmware waits for it - delay_ms(), system_sleep() (one SysTick) - or when a BQ7693 read is answered by a
+later record of the trace. Interrupts are raised at the first point after they're due where the firmware
+has them unmasked, as on the chip.
+*/
+
+enum HOST_EVENT {
+	HOST_EVENT_NONE,
+	HOST_EVENT_EXTINT,		//channel
+	HOST_EVENT_UART_RX,		//sercom, data, len - completes the read job running on that SERCOM
+};
+
+struct host_event {
+	enum HOST_EVENT type;
+	uint32_t time_ms;
+	uint8_t channel;
+	const uint8_t *data;
+	size_t len;
+};
+
+struct host_hw {
+	//BQ7693 register access. Return false for a failed (NAKed) read.
+	bool (*i2c_read)(uint8_t reg, uint8_t *buf, size_t len);
+	void (*i2c_write)(uint8_t reg, uint8_t value);
+	bool (*pin_input)(uint8_t pin);
+	//The next interrupt, if it's due by now - or, with before_read set, if it has to come before the BQ7693
+	//read about to be made, whatever the time. Consumes it. An EXTINT while extint_masked holds back
+	//everything behind it.
+	bool (*next_event)(bool before_read, bool extint_masked, struct host_event *event);
+	//Page 0 of the EEPROM as it was at boot - false if there's nothing stored.
+	bool (*eeprom_page)(uint8_t page, uint8_t *data);
+	enum system_reset_cause (*reset_cause)(void);
+	//Nothing more will happen - the run ends at the next chance.
+	bool (*finished)(void);
+};
+
+enum HOST_END {
+	HOST_END_FINISHED,		//Ran to the end of the trace or simulation
+	HOST_END_POWER_OFF,		//The BQ7693 was put into ship mode
+	HOST_END_RESET,			//NVIC_SystemReset()
+	HOST_END_DIVERGED,		//The firmware asked for something the hardware can't give it - see host_end_message()
+};
+
+//Run the firmware (bms_init(), then bms_mainloop()) against hw until it ends.
+enum HOST_END host_run(const struct host_hw *hw, void (*firmware)(void));
+//Stop the run from inside the firmware.
+void host_end(enum HOST_END reason, const char *fmt, ...) __attribute__((noreturn, format(printf, 2, 3)));
+const char *host_end_message(void);
+
+uint32_t host_now_ms(void);
+//Called by anything the firmware might poll in a loop - runs due interrupts, and moves the clock on if it's spinning.
+void host_poll(void);
+//For a read answered by a record from later on - the firmware has been running that long.
+void host_clock_catch_up(uint32_t ms);
+
+//Everything written to the debug USART during the run - the binary trace, as TRACE_CAPTURE is on.
+const uint8_t *host_debug_output(size_t *len);
+
+#endif /* HOST_HW_H_ */
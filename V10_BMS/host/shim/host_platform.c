@@ -0,0 +1,92 @@
+/*
+ * host_platform.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include "host_hw.h"
+#include "../../src/systime.h"
+#include "../../src/clocks.h"
+#include "../../src/watchdog.h"
+#include "../../src/crash.h"
+#include "../../src/stack.h"
+
+/* The firmware modules that are all registers (SysTick, GCLK, WDT, the stack and HardFault handler) - these
+replace them on the PC. Everything else is built from src/ unchanged.
+*/
+
+#define HOST_CYCLES_PER_MS 8000
+
+//systime.c
+void systime_init() {
+}
+
+void systime_clock_changed() {
+}
+
+uint32_t systime_ms() {
+	host_poll();
+	return host_now_ms();
+}
+
+uint32_t systime_cycles() {
+	return host_now_ms() * HOST_CYCLES_PER_MS;
+}
+
+uint32_t systime_cycles_per_ms() {
+	return HOST_CYCLES_PER_MS;
+}
+
+//clocks.c
+static enum CLOCK_PROFILE clocks_current = CLOCK_PROFILE_FULL;
+
+void clocks_init() {
+}
+
+void clocks_set_profile(enum CLOCK_PROFILE profile) {
+	clocks_current = profile;
+}
+
+enum CLOCK_PROFILE clocks_profile() {
+	return clocks_current;
+}
+
+void clocks_sercom_enable(uint8_t sercom, bool enable) {
+}
+
+//watchdog.c - nothing to reset us.
+void watchdog_init() {
+}
+
+void watchdog_checkin(enum WATCHDOG_TASK task) {
+}
+
+void watchdog_set_task_active(enum WATCHDOG_TASK task, bool active) {
+}
+
+void watchdog_feed() {
+}
+
+void watchdog_report_reset() {
+}
+
+//crash.c - a crash on the PC is the sanitizer's to report.
+void crash_report() {
+}
+
+void crash_print() {
+}
+
+//stack.c
+void stack_paint() {
+}
+
+uint16_t stack_high_water() {
+	return 0;
+}
+
+uint16_t stack_size() {
+	return 1024;
+}
@@ -0,0 +1,436 @@
+/*
+ * trace_replay.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */
+
+#include <stdlib.h>
+#include "shim/host_hw.h"
+#include "../src/bms.h"
+#include "../src/trace.h"
+#include "pack_sim.h"
+
+/* Replays a trace captured with TRACE_CAPTURE (see src/trace.h) through the unmodified firmware, built for the PC.
+
+Usage:
+	trace_replay capture.bin [-o replay.bin] [-v]
+		The BQ7693 reads, trigger/charger pins, bytes from the vacuum and interrupts are fed back from the
+		capture, and the state transitions, LED/charge pins and FET (SYS_CTRL2) writes the firmware makes are
+		compared against the ones it captured. -o writes the trace the replay produced, for
+		tools/trace_decode.py --diff. -v prints the firmware's debug messages.
+	trace_replay --simulate capture.bin [scenario]
+		Runs the firmware against a simulated pack instead (see pack_sim.h), and writes what it streamed.
+
+Exits with 0 if the firmware did the same as in the capture.
+*/
+
+struct trace_rec {
+	uint32_t time_ms;
+	uint8_t type;
+	uint8_t len;
+	const uint8_t *payload;
+};
+
+//A trace, split into records.
+struct trace {
+	uint8_t *data;
+	struct trace_rec *recs;
+	size_t count;
+	uint16_t dropped;
+};
+
+//How long after its last record a capture is taken to have stopped, if nothing else has ended the run.
+#define REPLAY_TAIL_MS 1000
+
+static bool replay_verbose = false;
+
+static struct trace replay_capture;
+static size_t replay_next = 0;			//Next record to feed in
+static uint32_t replay_pins = 0;		//Input pin levels, one bit per PORTA pin
+static uint32_t replay_end_ms = 0;
+
+static void trace_split(struct trace *trace, uint8_t *data, size_t len) {
+	//Same as records() in tools/trace_decode.py - skip anything that isn't a record.
+	trace->data = data;
+	trace->recs = calloc(len / TRACE_HEADER_LEN + 1, sizeof(struct trace_rec));
+	trace->count = 0;
+	trace->dropped = 0;
+
+	uint32_t now = 0;
+	size_t i = 0;
+	while (i + TRACE_HEADER_LEN <= len) {
+		if (data[i] != TRACE_SYNC_CHAR) {
+			i++;
+			continue;
+		}
+		struct trace_rec *rec = &trace->recs[trace->count];
+		rec->type = data[i + 1];
+		rec->len = data[i + 2];
+		rec->payload = &data[i + TRACE_HEADER_LEN];
+		if (i + TRACE_HEADER_LEN + rec->len > len) {
+			break;
+		}
+		if (rec->type == TRACE_REC_TIME && rec->len == 4) {
+			memcpy(&now, rec->payload, 4);
+		}
+		else {
+			now += data[i + 3] | (data[i + 4] << 8);
+		}
+		if (rec->type == TRACE_REC_DROPPED && rec->len == 2) {
+			trace->dropped += rec->payload[0] | (rec->payload[1] << 8);
+		}
+		rec->time_ms = now;
+		trace->count++;
+		i += TRACE_HEADER_LEN + rec->len;
+	}
+}
+
+static bool trace_load(struct trace *trace, const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return false;
+	}
+	size_t size = 0, len = 0;
+	uint8_t *data = NULL;
+	for (;;) {
+		if (len == size) {
+			size = size * 2 + 65536;
+			data = realloc(data, size);
+		}
+		size_t n = fread(&data[len], 1, size - len, file);
+		if (n == 0) {
+			break;
+		}
+		len += n;
+	}
+	fclose(file);
+	trace_split(trace, data, len);
+	return true;
+}
+
+static bool trace_is_output(const struct trace_rec *rec) {
+	//What trace_decode.py --diff compares.
+	return rec->type == TRACE_REC_STATE || rec->type == TRACE_REC_PIN_OUT || (rec->type == TRACE_REC_I2C_WRITE && rec->len == 2 && rec->payload[0] == SYS_CTRL2);
+}
+
+static bool trace_is_input(const struct trace_rec *rec) {
+	return rec->type == TRACE_REC_I2C_READ || rec->type == TRACE_REC_PIN_IN || rec->type == TRACE_REC_UART_RX || rec->type == TRACE_REC_IRQ;
+}
+
+static const struct trace_rec *replay_head(void) {
+	while (replay_next < replay_capture.count && !trace_is_input(&replay_capture.recs[replay_next])) {
+		replay_next++;
+	}
+	return replay_next < replay_capture.count ? &replay_capture.recs[replay_next] : NULL;
+}
+
+static void replay_pin_record(const struct trace_rec *rec) {
+	if (rec->len == 2) {
+		uint32_t mask = 1UL << (rec->payload[0] & 0x1F);
+		replay_pins = rec->payload[1] ? replay_pins | mask : replay_pins & ~mask;
+	}
+}
+
+static void replay_skip_pins(void) {
+	//Pin reads the capture made before this point - the firmware made them too, or will have the level next time it looks.
+	const struct trace_rec *rec;
+	while ((rec = replay_head()) && rec->type == TRACE_REC_PIN_IN) {
+		replay_pin_record(rec);
+		replay_next++;
+	}
+}
+
+static bool replay_i2c_read(uint8_t reg, uint8_t *buf, size_t len) {
+	replay_skip_pins();
+
+	const struct trace_rec *rec = replay_head();
+	if (!rec) {
+		host_end(HOST_END_FINISHED, "end of capture at %" PRIu32 " ms", host_now_ms());
+	}
+	if (rec->type != TRACE_REC_I2C_READ || rec->len == 0 || rec->payload[0] != reg) {
+		host_end(HOST_END_DIVERGED, "firmware read BQ7693 register 0x%02X at %" PRIu32 " ms, the capture has record type %u at %" PRIu32 " ms",
+			reg, host_now_ms(), rec->type, rec->time_ms);
+	}
+	if (rec->len > 1 && rec->len - 1 != len) {
+		host_end(HOST_END_DIVERGED, "firmware read %zu bytes of BQ7693 register 0x%02X at %" PRIu32 " ms, the capture has %u",
+			len, reg, host_now_ms(), rec->len - 1);
+	}
+
+	host_clock_catch_up(rec->time_ms);
+	replay_next++;
+	if (rec->len == 1) {
+		//Failed in the capture.
+		return false;
+	}
+	memcpy(buf, &rec->payload[1], len);
+	return true;
+}
+
+static void replay_i2c_write(uint8_t reg, uint8_t value) {
+	//Written into the replay's own trace by bq7693_write_register(), to be compared at the end.
+}
+
+static bool replay_pin_input(uint8_t pin) {
+	const struct trace_rec *rec;
+	while ((rec = replay_head()) && rec->type == TRACE_REC_PIN_IN && rec->time_ms <= host_now_ms()) {
+		replay_pin_record(rec);
+		replay_next++;
+	}
+	return (replay_pins >> (pin & 0x1F)) & 1;
+}
+
+static bool replay_next_event(bool before_read, bool extint_masked, struct host_event *event) {
+	if (before_read) {
+		replay_skip_pins();
+	}
+
+	const struct trace_rec *rec = replay_head();
+	if (!rec || (rec->type != TRACE_REC_IRQ && rec->type != TRACE_REC_UART_RX)) {
+		return false;
+	}
+	if (!before_read && rec->time_ms > host_now_ms()) {
+		return false;
+	}
+	if (rec->type == TRACE_REC_IRQ && extint_masked) {
+		return false;
+	}
+
+	event->time_ms = rec->time_ms;
+	if (rec->type == TRACE_REC_IRQ) {
+		event->type = HOST_EVENT_EXTINT;
+		event->channel = rec->len ? rec->payload[0] : 0;
+	}
+	else {
+		//Only the vacuum's USART is recorded.
+		event->type = HOST_EVENT_UART_RX;
+		event->channel = 2;
+		event->data = rec->payload;
+		event->len = rec->len;
+	}
+	replay_next++;
+	return true;
+}
+
+static bool replay_eeprom_page(uint8_t page, uint8_t *data) {
+	for (size_t i=0; i<replay_capture.count; ++i) {
+		const struct trace_rec *rec = &replay_capture.recs[i];
+		if (rec->type == TRACE_REC_EEPROM && rec->len > 1 && rec->payload[0] == page) {
+			memset(data, 0xFF, EEPROM_PAGE_SIZE);
+			memcpy(data, &rec->payload[1], rec->len - 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+static enum system_reset_cause replay_reset_cause(void) {
+	for (size_t i=0; i<replay_capture.count; ++i) {
+		const struct trace_rec *rec = &replay_capture.recs[i];
+		if (rec->type == TRACE_REC_RESET && rec->len == 1) {
+			return (enum system_reset_cause)rec->payload[0];
+		}
+	}
+	return SYSTEM_RESET_CAUSE_POR;
+}
+
+static bool replay_finished(void) {
+	return !replay_head() && host_now_ms() > replay_end_ms;
+}
+
+static const struct host_hw replay_hw = {
+	.i2c_read = replay_i2c_read,
+	.i2c_write = replay_i2c_write,
+	.pin_input = replay_pin_input,
+	.next_event = replay_next_event,
+	.eeprom_page = replay_eeprom_page,
+	.reset_cause = replay_reset_cause,
+	.finished = replay_finished,
+};
+
+static void replay_firmware(void) {
+	bms_init();
+	bms_mainloop();
+}
+
+static void replay_start(void) {
+	//Each input pin starts at the level it was first seen at.
+	uint32_t seen = 0;
+	for (size_t i=0; i<replay_capture.count; ++i) {
+		const struct trace_rec *rec = &replay_capture.recs[i];
+		if (rec->type == TRACE_REC_PIN_IN && rec->len == 2 && !(seen & (1UL << (rec->payload[0] & 0x1F)))) {
+			seen |= 1UL << (rec->payload[0] & 0x1F);
+			replay_pin_record(rec);
+		}
+	}
+	//The debug adapter was attached (PA11 held high), or there'd be no capture.
+	replay_pins |= 1UL << PIN_PA11;
+
+	if (replay_capture.count) {
+		replay_end_ms = replay_capture.recs[replay_capture.count - 1].time_ms + REPLAY_TAIL_MS;
+	}
+}
+
+static void print_record(const char *prefix, const struct trace_rec *rec) {
+	printf("%s%8" PRIu32 " ms  type %u:", prefix, rec->time_ms, rec->type);
+	for (int i=0; i<rec->len; ++i) {
+		printf(" %02X", rec->payload[i]);
+	}
+	printf("\n");
+}
+
+static void print_logs(const struct trace *trace) {
+	for (size_t i=0; i<trace->count; ++i) {
+		const struct trace_rec *rec = &trace->recs[i];
+		if (rec->type == TRACE_REC_LOG) {
+			printf("%8" PRIu32 " ms  %.*s", rec->time_ms, rec->len, (const char *)rec->payload);
+			if (rec->len == 0 || rec->payload[rec->len - 1] != '\n') {
+				printf("\n");
+			}
+		}
+	}
+}
+
+static bool compare_outputs(const struct trace *capture, const struct trace *replay) {
+	//Step through the outputs of each in order - the times will differ a little, the outputs mustn't.
+	size_t c = 0, r = 0, count = 0;
+	for (;;) {
+		while (c < capture->count && !trace_is_output(&capture->recs[c])) {
+			c++;
+		}
+		while (r < replay->count && !trace_is_output(&replay->recs[r])) {
+			r++;
+		}
+		if (c == capture->count || r == replay->count) {
+			break;
+		}
+		const struct trace_rec *a = &capture->recs[c], *b = &replay->recs[r];
+		if (a->type != b->type || a->len != b->len || memcmp(a->payload, b->payload, a->len)) {
+			printf("Outputs differ after %zu matching:\n", count);
+			print_record("  capture ", a);
+			print_record("  replay  ", b);
+			return false;
+		}
+		count++;
+		c++;
+		r++;
+	}
+
+	if (c < capture->count) {
+		printf("Outputs match for %zu, but the replay stopped before the capture's:\n", count);
+		print_record("  capture ", &capture->recs[c]);
+		return false;
+	}
+	if (r < replay->count) {
+		printf("Outputs match for %zu, but the replay went on to:\n", count);
+		print_record("  replay  ", &replay->recs[r]);
+		return false;
+	}
+	printf("Outputs match (%zu state transitions, pin changes and FET writes)\n", count);
+	return true;
+}
+
+static bool write_file(const char *path, const uint8_t *data, size_t len) {
+	FILE *file = fopen(path, "wb");
+	if (!file || fwrite(data, 1, len, file) != len) {
+		perror(path);
+		if (file) {
+			fclose(file);
+		}
+		return false;
+	}
+	fclose(file);
+	return true;
+}
+
+static const char *end_names[] = { "finished", "power off", "reset", "diverged" };
+
+static int simulate(const char *path, const char *scenario) {
+	const struct host_hw *hw = pack_sim_hw(scenario);
+	if (!hw) {
+		fprintf(stderr, "Unknown scenario %s\n", scenario);
+		return 2;
+	}
+	enum HOST_END end = host_run(hw, replay_firmware);
+	printf("Simulation %s: %s\n", end_names[end], host_end_message());
+	pack_sim_report();
+
+	size_t len;
+	const uint8_t *output = host_debug_output(&len);
+	if (replay_verbose) {
+		struct trace out;
+		trace_split(&out, (uint8_t *)output, len);
+		print_logs(&out);
+		free(out.recs);
+	}
+	if (!write_file(path, output, len)) {
+		return 2;
+	}
+	return end == HOST_END_DIVERGED;
+}
+
+int main(int argc, char **argv) {
+	const char *capture_path = NULL, *output_path = NULL, *simulate_path = NULL, *scenario = NULL;
+
+	for (int i=1; i<argc; ++i) {
+		if (!strcmp(argv[i], "-v")) {
+			replay_verbose = true;
+		}
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			output_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--simulate") && i + 1 < argc) {
+			simulate_path = argv[++i];
+		}
+		else if (argv[i][0] != '-' && simulate_path && !scenario) {
+			scenario = argv[i];
+		}
+		else if (argv[i][0] != '-' && !capture_path) {
+			capture_path = argv[i];
+		}
+		else {
+			capture_path = NULL;
+			simulate_path = NULL;
+			break;
+		}
+	}
+
+	if (simulate_path) {
+		return simulate(simulate_path, scenario ? scenario : "basic");
+	}
+	if (!capture_path) {
+		fprintf(stderr, "Usage: %s capture.bin [-o replay.bin] [-v]\n"
+			"       %s --simulate capture.bin [%s] [-v]\n", argv[0], argv[0], pack_sim_scenarios());
+		return 2;
+	}
+
+	if (!trace_load(&replay_capture, capture_path)) {
+		return 2;
+	}
+	if (replay_capture.dropped) {
+		printf("Warning: the capture lost %u records - the replay will probably diverge where it did\n", replay_capture.dropped);
+	}
+
+	replay_start();
+	enum HOST_END end = host_run(&replay_hw, replay_firmware);
+	printf("Replay %s: %s\n", end_names[end], host_end_message());
+
+	size_t len;
+	const uint8_t *output = host_debug_output(&len);
+	struct trace replay;
+	trace_split(&replay, (uint8_t *)output, len);
+	if (replay_verbose) {
+		print_logs(&replay);
+	}
+	if (output_path && !write_file(output_path, output, len)) {
+		return 2;
+	}
+
+	bool match = compare_outputs(&replay_capture, &replay);
+	free(replay.recs);
+	free(replay_capture.recs);
+	free(replay_capture.data);
+	return (end == HOST_END_DIVERGED || !match) ? 1 : 0;
+}
@@ -50,11 +50,19 @@ static uint32_t cycles_per_us = 8000000UL / 1000000;
  */
 void delay_init(void)
 {
-	cycles_per_ms = system_gclk_gen_get_hz(0);
+	/* SysTick counts CPU clock cycles, which the CPU divider may slow below
+	 * the main clock. */
+	cycles_per_ms = system_cpu_clock_get_hz();
 	cycles_per_ms /= 1000;
 	cycles_per_us = cycles_per_ms / 1000;
 
-	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+	/* Once running, SysTick belongs to the time base - leave it alone when
+	 * called again after a clock change. */
+	if (!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)) {
+		SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+		SysTick->VAL = 0;
+		SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+	}
 }
 
 /**
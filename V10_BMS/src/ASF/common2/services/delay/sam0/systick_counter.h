@@ -58,12 +58,18 @@ extern "C" {
 static inline void delay_cycles(
 		const uint32_t n)
 {
+	/* SysTick is left free-running (it also provides the application time
+	 * base), so measure elapsed cycles from VAL rather than reloading it. */
 	if (n > 0) {
-		SysTick->LOAD = n;
-		SysTick->VAL = 0;
+		uint32_t reload = SysTick->LOAD + 1;
+		uint32_t last = SysTick->VAL;
+		uint32_t elapsed = 0;
 
-		while (!(SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)) {
-		};
+		while (elapsed < n) {
+			uint32_t now = SysTick->VAL;
+			elapsed += (last >= now) ? (last - now) : (last + reload - now);
+			last = now;
+		}
 	}
 }
 
@@ -0,0 +1,116 @@
+/*
+ * balance.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "balance.h"
+#include "serial_debug.h"
+
+static uint32_t balance_bleed_total_ms[NUM_CELLS];
+
+static bool balance_active = false;
+static uint8_t balance_slice = 0;
+static uint8_t balance_candidates = 0;	//Cells chosen at the last clean sample
+static uint8_t balance_mask = 0;		//Cells bleeding right now
+static uint32_t balance_mask_since_ms = 0;
+
+//Alternate groups - cells 0,2,4,6 and 1,3,5 are never on adjacent BQ7693 inputs.
+#define BALANCE_EVEN_CELLS 0x55
+#define BALANCE_ODD_CELLS 0x2A
+
+static void balance_set(uint8_t mask, uint32_t now) {
+	//Account the time the outgoing mask was bleeding.
+	for (int i=0; i<NUM_CELLS; ++i) {
+		if (balance_mask & (1 << i)) {
+			balance_bleed_total_ms[i] += now - balance_mask_since_ms;
+		}
+	}
+	balance_mask_since_ms = now;
+	
+	if (mask != balance_mask) {
+		if (!bq7693_set_balancing(mask)) {
+			mask = 0;
+		}
+		balance_mask = mask;
+	}
+}
+
+static uint8_t balance_choose(const struct telemetry *sample) {
+	uint16_t lowest = sample->cell_voltages[0];
+	for (int i=1; i<NUM_CELLS; ++i) {
+		if (sample->cell_voltages[i] < lowest) {
+			lowest = sample->cell_voltages[i];
+		}
+	}
+	
+	//Only near the top of charge - lower down the curve, voltage differences don't say much about charge differences.
+	uint8_t mask = 0;
+	for (int i=0; i<NUM_CELLS; ++i) {
+		if (sample->cell_voltages[i] >= BALANCE_MIN_CELL_VOLTAGE && sample->cell_voltages[i] > lowest + BALANCE_THRESHOLD_MV) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
+uint8_t balance_update(const struct telemetry *sample, bool allowed) {
+	if (!allowed) {
+		balance_stop();
+		return 0;
+	}
+	
+	if (!balance_active) {
+		//Start with a clean slice - the current sample may have been taken while charging was paused etc, which is fine.
+		balance_active = true;
+		balance_slice = 0;
+		balance_mask_since_ms = sample->time_ms;
+	}
+	
+	uint8_t mask = 0;
+	if (balance_slice == 0) {
+		//Balancing was off for the whole of the last ADC cycle - these voltages are clean.
+		balance_candidates = balance_choose(sample);
+	}
+	if (balance_slice < BALANCE_SLICES) {
+		mask = balance_candidates & ((balance_slice & 0x01) ? BALANCE_ODD_CELLS : BALANCE_EVEN_CELLS);
+		balance_slice++;
+	}
+	else {
+		//Off for the next cycle, so the sample after is clean.
+		balance_slice = 0;
+	}
+	
+	balance_set(mask, sample->time_ms);
+	return balance_mask;
+}
+
+void balance_stop() {
+	if (!balance_active) {
+		return;
+	}
+	balance_set(0, systime_ms());
+	//Make sure it's really off, even if a write failed along the way.
+	bq7693_set_balancing(0);
+	balance_active = false;
+	
+#ifdef SERIAL_DEBUG
+	balance_print();
+#endif
+}
+
+uint32_t balance_bleed_ms(uint8_t cell) {
+	return cell < NUM_CELLS ? balance_bleed_total_ms[cell] : 0;
+}
+
+void balance_print() {
+#ifdef SERIAL_DEBUG
+	serial_debug_send_message("Cell balancing bleed time:\r\n");
+	for (int i=0; i<NUM_CELLS; ++i) {
+		sprintf(debug_msg_buffer, "Cell %d: %" PRIu32 " s\r\n", i, balance_bleed_total_ms[i] / 1000);
+		serial_debug_send_message(debug_msg_buffer);
+	}
+#endif
+}
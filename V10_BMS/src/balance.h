@@ -0,0 +1,38 @@
+/*
+ * balance.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef BALANCE_H_
+#define BALANCE_H_
+
+#include "asf.h"
+#include "config.h"
+#include "bq7693.h"
+#include "telemetry.h"
+#include "systime.h"
+
+/* Passive cell balancing, using the BQ7693's bleed resistors (CELLBAL1/2).
+
+Runs in slices of one ADC cycle (250mS), driven by the sampler. Every BALANCE_SLICES slices, balancing
+is switched off for one whole cycle so the next sample's cell voltages aren't pulled down by the bleed
+current - only those clean samples are used to choose which cells to bleed. In between, the chosen
+cells are bled in two alternating groups (even and odd numbered cells), as the BQ7693 won't balance
+adjacent cells at the same time.
+*/
+
+//Call with each new sample - allowed says whether the state machine wants balancing (charging / charged idle).
+//Returns the cells that will be bleeding during the next ADC cycle.
+uint8_t balance_update(const struct telemetry *sample, bool allowed);
+
+void balance_stop(void);
+
+//Total time each cell has been bled for, in ms.
+uint32_t balance_bleed_ms(uint8_t cell);
+void balance_print(void);
+
+#endif /* BALANCE_H_ */
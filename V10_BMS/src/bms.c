@@ -7,6 +7,7 @@
  */ 
 
 #include "bms.h"
+#include "crash.h"
 
 //We start off idle.
 enum BMS_STATE bms_state = BMS_IDLE;
@@ -19,7 +20,7 @@ char *bms_state_names[] = {
 	"BMS_IDLE",
 	"BMS_CHARGER_CONNECTED",
 	"BMS_CHARGING",
-	"BMS_CHARGER_CONNECTED_NOT_CHARGING"
+	"BMS_CHARGER_CONNECTED_NOT_CHARGING",
 	"BMS_CHARGER_UNPLUGGED",
 	"BMS_TRIGGER_PULLED",
 	"BMS_DISCHARGING",
@@ -30,6 +31,30 @@ char *bms_state_names[] = {
 
 extern volatile struct eeprom_data eeprom_data;
 
+//Discharge safety verdict, refreshed in the background while idle, so a trigger pull can switch
+//the discharge FET on straight from the trigger interrupt.
+static volatile bool bms_discharge_verdict = false;
+static volatile uint32_t bms_discharge_verdict_ms = 0;
+//bq7693_prepare_discharge() done since the verdict was last invalidated - it's only armed after that.
+static bool bms_discharge_prepared = false;
+
+//Set by the trigger interrupt once it has turned the discharge FET on.
+static volatile bool bms_trigger_fast_enabled = false;
+static volatile uint32_t bms_trigger_fast_ms = 0;
+
+//Timeout for the current state's wait - cancelled on every state change.
+static struct timer bms_state_timer;
+static bool bms_state_timed_out = false;
+
+static void bms_state_timeout(struct timer *timer) {
+	bms_state_timed_out = true;
+}
+
+static void bms_start_state_timer(uint32_t ms) {
+	bms_state_timed_out = false;
+	timer_start(&bms_state_timer, ms, bms_state_timeout);
+}
+
 void pins_init() {
 	//Set up the output charge pin
 	struct port_config charge_pin_config;
@@ -47,46 +72,381 @@ void pins_init() {
 	port_pin_set_config(TRIGGER_PRESSED_PIN, &sense_pin_config);
 }
 
+//Reads of the trigger/charger pins go via here, so they can be captured by the trace.
+static bool bms_read_pin(uint8_t pin) {
+	bool level = port_pin_get_input_level(pin);
+	trace_pin_input(pin, level);
+	return level;
+}
+
+static void bms_set_charge_enable(bool enable) {
+	port_pin_set_output_level(ENABLE_CHARGE_PIN, enable);
+	trace_pin_output(ENABLE_CHARGE_PIN, enable);
+}
+
 volatile int32_t currentmA;
+
+//Last raw coulomb counter reading, for the offset calibration.
+static volatile int16_t bms_cc_raw = 0;
+//Charge not yet counted into eeprom_data.current_charge_level, in 1/BMS_CC_UAH_DIVISOR uAh.
+static int32_t bms_charge_remainder = 0;
+//uAh counted since the last sample - every CC reading, even when CC_READYs go by without a sample.
+static volatile int32_t bms_sample_uah = 0;
+static volatile uint32_t bms_cc_ready_ms = 0;
+
+//A one-shot CC reading in progress, started at a load step - see bms_cc_oneshot_at_step().
+//bq7693_cc_oneshot_active() says whether the BQ7693 is actually in one-shot mode.
+static volatile struct {
+	bool pending;
+	bool ready;			//The last CC reading was a one-shot - for the next sample
+	int32_t pre_step_current;
+	uint32_t step_ms;
+	uint32_t start_ms;
+} bms_cc_oneshot;
+
+//SYS_STAT fault bits seen by the ALERT interrupt, collected by the next bms_sample().
+static volatile uint8_t bms_sys_stat_latched = 0;
+
+//Set by the ALERT interrupt on CC_READY - the BQ7693 has a fresh set of readings (every 250mS).
+static volatile bool bms_sample_due = false;
+static uint32_t bms_last_sample_ms = 0;
+
+//Cells being bled since the last sample.
+static uint8_t bms_balancing = 0;
+
+//A fault raised by the BQ7693, posted by the ALERT interrupt for the state machine to pick up.
+static volatile struct {
+	bool pending;
+	enum BMS_ERROR_CODE error;
+	uint8_t sys_stat;
+	uint32_t time_ms;
+} bms_fault_event;
+
+//What the BMS draws from the cells in each state, awake and in timer_sleep() - on top of SELF_CONSUMPTION_BQ7693_UA.
+#ifdef CLOCK_GATING
+#define BMS_SLOW_UA SELF_CONSUMPTION_SLOW_UA
+#else
+#define BMS_SLOW_UA SELF_CONSUMPTION_FULL_UA
+#endif
+
+static const struct {
+	uint16_t awake_ua;
+	uint16_t asleep_ua;
+} bms_self_consumption[] = {
+	[BMS_IDLE] = { BMS_SLOW_UA, SELF_CONSUMPTION_ASLEEP_UA },
+	[BMS_CHARGER_CONNECTED] = { SELF_CONSUMPTION_FULL_UA, SELF_CONSUMPTION_ASLEEP_UA },
+	[BMS_CHARGING] = { BMS_SLOW_UA + SELF_CONSUMPTION_LEDS_UA, SELF_CONSUMPTION_ASLEEP_UA + SELF_CONSUMPTION_LEDS_UA },
+	[BMS_CHARGER_CONNECTED_NOT_CHARGING] = { BMS_SLOW_UA, SELF_CONSUMPTION_ASLEEP_UA },
+	[BMS_CHARGER_UNPLUGGED] = { BMS_SLOW_UA, SELF_CONSUMPTION_ASLEEP_UA },
+	[BMS_TRIGGER_PULLED] = { SELF_CONSUMPTION_FULL_UA, SELF_CONSUMPTION_ASLEEP_UA },
+	[BMS_DISCHARGING] = { SELF_CONSUMPTION_FULL_UA + SELF_CONSUMPTION_LEDS_UA, SELF_CONSUMPTION_ASLEEP_UA + SELF_CONSUMPTION_LEDS_UA },
+	[BMS_FAULT] = { BMS_SLOW_UA, SELF_CONSUMPTION_ASLEEP_UA },
+	[BMS_SLEEP] = { BMS_SLOW_UA, SELF_CONSUMPTION_ASLEEP_UA },
+};
+
+//Self-consumption bookkeeping, all kept by the ALERT interrupt on each CC reading.
+static uint32_t bms_self_last_ms = 0;
+static uint32_t bms_self_last_asleep_us = 0;
+static uint32_t bms_self_ua_ms = 0;
+static volatile uint32_t bms_self_uah = 0;
+static uint32_t bms_self_charge_carry = 0;
+static uint32_t bms_state_asleep_ms[BMS_SLEEP + 1];
+
+//uA * mS drawn by the BMS itself since the last call, charged to the current state.
+static uint32_t bms_self_consumption_ua_ms(void) {
+	uint32_t now = systime_ms();
+	uint32_t elapsed_ms = now - bms_self_last_ms;
+	bms_self_last_ms = now;
+	
+	//Whole milliseconds asleep - the rest carries over to next time.
+	uint32_t asleep_ms = (timer_asleep_us() - bms_self_last_asleep_us) / 1000;
+	bms_self_last_asleep_us += asleep_ms * 1000;
+	if (asleep_ms > elapsed_ms) {
+		asleep_ms = elapsed_ms;
+	}
+	bms_state_asleep_ms[bms_state] += asleep_ms;
+	
+	uint32_t ua_ms = elapsed_ms * SELF_CONSUMPTION_BQ7693_UA
+		+ (elapsed_ms - asleep_ms) * bms_self_consumption[bms_state].awake_ua
+		+ asleep_ms * bms_self_consumption[bms_state].asleep_ua;
+	
+	bms_self_ua_ms += ua_ms;
+	while (bms_self_ua_ms >= 3600000UL) {
+		bms_self_ua_ms -= 3600000UL;
+		bms_self_uah++;
+	}
+	return ua_ms;
+}
+
+static void bms_count_charge(void) {
+	int32_t uah = bms_charge_remainder / BMS_CC_UAH_DIVISOR;
+	bms_charge_remainder -= uah * BMS_CC_UAH_DIVISOR;
+	eeprom_data.current_charge_level += uah;
+	bms_sample_uah += uah;
+					
+	//We thought the pack was full, but it's still charging, so we need to update its' size.		
+	if (eeprom_data.current_charge_level > eeprom_data.total_pack_capacity) {
+		eeprom_data.total_pack_capacity = eeprom_data.current_charge_level;
+	}
+	
+	//We thought the pack was empty, but it isn't, so again, we need to update our estimate of what it can hold!
+	if (eeprom_data.current_charge_level < 0) {
+		//subtracting negative numbers will increment the pack capacity.
+		eeprom_data.total_pack_capacity -= eeprom_data.current_charge_level;
+		eeprom_data.current_charge_level = 0;
+	}
+}
+
+//The BMS draws from the cells without going through the sense resistor, so take its own draw since last time off
+//the count too - uA * mS / 3600000 = uAh, so / 625 in remainder units. From the ALERT interrupt, or with it masked.
+static void bms_count_self_consumption(void) {
+	bms_self_charge_carry += bms_self_consumption_ua_ms();
+	bms_charge_remainder -= bms_self_charge_carry / 625;
+	bms_self_charge_carry %= 625;
+}
+
+static void bms_update_charge_count(void) {
+	//Got a coulomb charger count ready.
+	int16_t raw = bq7693_read_cc();
+	bms_cc_raw = raw;
+	
+	//Offset corrected, in 1/16ths of an LSB - the calibrated offset replaces the old +/-2 LSB deadband.
+	int32_t cc = (int32_t)raw * (1 << CC_CAL_SHIFT) - cc_cal_offset();
 	
+	//8.44microVolts per LSB.
+	//i = V/R
+	//sense resistor = 1mOhm
+	//microV / milliOhms gives current in mA.
+	//So mA = cc * 8.44 / 16 = cc * 211 / 400
+	currentmA = (cc * 211) / 400;
+	
+	//There are 14400 250mS periods in 1 hr, so uAH = mA / 14.4 = cc * 211 / 5760.
+	//Kept as an integer remainder, so small currents still add up.
+	bms_charge_remainder += cc * 211;
+	bms_count_self_consumption();
+	bms_count_charge();
+}
+
+static void bms_count_charge_ma_ms(int32_t ma_ms) {
+	//mA * mS / 3600 = uAh, so mA * mS * 5760 / 3600 in remainder units.
+	bms_charge_remainder += (ma_ms * 8) / 5;
+	bms_count_charge();
+}
+
+static void bms_finish_cc_oneshot(void) {
+	//Called once the one-shot reading has been counted. Back to continuous, then account for what the CC missed:
+	//the continuous reading that was abandoned when the one-shot started (current from before the step up to the
+	//step, and the one-shot's current after it), and the moment between the one-shot finishing and now.
+	bq7693_resume_cc_continuous();
+	
+	uint32_t now = systime_ms();
+	uint32_t last_ready = bms_cc_ready_ms;
+	uint32_t step = bms_cc_oneshot.step_ms;
+	if ((int32_t)(step - last_ready) < 0) {
+		step = last_ready;
+	}
+	uint32_t oneshot_end = bms_cc_oneshot.start_ms + 250;
+	
+	bms_count_charge_ma_ms(bms_cc_oneshot.pre_step_current * (int32_t)(step - last_ready));
+	bms_count_charge_ma_ms(currentmA * (int32_t)(bms_cc_oneshot.start_ms - step));
+	if ((int32_t)(now - oneshot_end) > 0) {
+		bms_count_charge_ma_ms(currentmA * (int32_t)(now - oneshot_end));
+	}
+	
+	bms_cc_oneshot.pending = false;
+	bms_cc_oneshot.ready = true;
+}
+
+void bms_cc_oneshot_at_step(uint32_t step_ms) {
+	//Take a one-shot CC reading now, so the first current reading after a load step covers only the new load,
+	//rather than waiting up to 500mS for a continuous reading that doesn't straddle it.
+	//Set up before the write - the one-shot can't complete for another 250mS.
+	system_interrupt_disable(SYSTEM_INTERRUPT_MODULE_EIC);
+	if (!bms_cc_oneshot.pending) {
+		//Back to back steps - keep the current from before the first.
+		bms_cc_oneshot.pre_step_current = currentmA;
+	}
+	bms_cc_oneshot.step_ms = step_ms;
+	bms_cc_oneshot.start_ms = systime_ms();
+	bms_cc_oneshot.pending = true;
+	system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_EIC);
+	
+	bq7693_start_cc_oneshot();
+}
+
+static bool bms_post_fault(uint8_t sys_stat) {
+	enum BMS_ERROR_CODE error;
+	
+	if (sys_stat & STAT_SCD) {
+		error = BMS_ERR_SHORTCIRCUIT;
+	}
+	else if (sys_stat & STAT_OCD) {
+		error = BMS_ERR_OVERCURRENT;
+	}
+	else if (sys_stat & STAT_OV) {
+		error = BMS_ERR_OVERVOLTAGE;
+	}
+	else if (sys_stat & STAT_UV) {
+		error = BMS_ERR_UNDERVOLTAGE;
+	}
+	else if (sys_stat & STAT_DEVICE_XREADY) {
+		error = BMS_ERR_DEVICE_FAULT;
+	}
+	else {
+		//Only OVRD_ALERT - nothing has tripped.
+		return false;
+	}
+	
+	//The BQ7693 will have switched off the relevant FET itself - make sure both are off, and the charger input too.
+	bq7693_disable_fets();
+	bms_set_charge_enable(false);
+	
+	//Keep the first fault if the state machine hasn't picked it up yet - that's the root cause.
+	if (!bms_fault_event.pending) {
+		bms_fault_event.error = error;
+		bms_fault_event.sys_stat = sys_stat;
+		bms_fault_event.time_ms = systime_ms();
+		bms_fault_event.pending = true;
+	}
+	return true;
+}
+
 void bms_interrupt_callback(void) {
+	PERF_TIMESTAMP(isr_start);
+	trace_irq(8);
 	uint8_t sys_stat;
-	bq7693_read_register(SYS_STAT, 1, &sys_stat);
-	if (sys_stat & 0x80) {
-		//Got a coulomb charger count ready.
-		int32_t ccVal = bq7693_read_cc();
-		
-		//This needs better handling....
-		currentmA = ccVal*8.44f;
-			
-		//Ignore tiny values.
-		if ( (ccVal > 0 && ccVal > 2)  || (ccVal < 0 && ccVal < -2) )  {
-			ccVal *= 8.44f; //8.44microVolts per LSB.
-			//i = V/R
-			//sense resistor = 1mOhm
-			//microV / milliOhms gives current in mA.   
-			//so ccVal has current in mA.
-			//Dividing by 14400 would give mAH. (number of 250mS periods in 1 hr.
-			//Dividing by 14.4 will give microAH (what we want)
-			ccVal /= 14.4f;
+	
+	//ALERT stays high while any SYS_STAT bit is set, so deal with everything that's set,
+	//or we'd never see another rising edge.
+	for (int i=0; i<3; ++i) {
+		if (!bq7693_read_register(SYS_STAT, 1, &sys_stat) || sys_stat == 0) {
+			break;
+		}
+		bms_sys_stat_latched |= sys_stat & STAT_FLAGS;
 		
-			eeprom_data.current_charge_level += ccVal;
-						
-			//We thought the pack was full, but it's still charging, so we need to update its' size.		
-			if (eeprom_data.current_charge_level > eeprom_data.total_pack_capacity) {
-				eeprom_data.total_pack_capacity = eeprom_data.current_charge_level;
-			}
+		if ((sys_stat & STAT_FLAGS) && bms_post_fault(sys_stat)) {
+			leds_set_error_led(true);
+			PERF_TRACK_CYCLES(fault_to_led_cycles, isr_start);
+		}
 		
-			//We thought the pack was empty, but it isn't, so again, we need to update our estimate of what it can hold!
-			if (eeprom_data.current_charge_level < 0) {
-				//subtracting negative numbers will increment the pack capacity.
-				eeprom_data.total_pack_capacity -= eeprom_data.current_charge_level;
-				eeprom_data.current_charge_level = 0;
+		if (sys_stat & STAT_CC_READY) {
+			bms_sample_due = true;
+			bms_update_charge_count();
+			if (bq7693_cc_oneshot_active()) {
+				bms_finish_cc_oneshot();
 			}
+			bms_cc_ready_ms = systime_ms();
+			PERF_TRACK_CYCLES(cc_isr_cycles, isr_start);
 		}
-		//Update the CC bit so it'll refire in another 250mS as per datasheet.
-		bq7693_write_register(SYS_STAT, 0x80);//Clear CC bit.
-	}	
+		
+		//Clear everything we've handled by writing it back - clearing CC_READY means it'll refire in another 250mS as per datasheet.
+		bq7693_write_register(SYS_STAT, sys_stat);
+	}
+}
+
+void bms_sample() {
+	struct telemetry sample;
+	
+	//The I2C reads first - these leave the EIC enabled between transactions.
+	bq7693_get_cell_voltages(sample.cell_voltages);
+	sample.pack_voltage = bq7693_get_pack_voltage();
+	sample.temperature = bq7693_read_temperature();
+	
+	//Then the values the ALERT interrupt keeps up to date, with it masked so they all come from the same CC reading.
+	system_interrupt_disable(SYSTEM_INTERRUPT_MODULE_EIC);
+	sample.current = currentmA;
+	sample.cc_raw = bms_cc_raw;
+	sample.cc_oneshot = bms_cc_oneshot.ready;
+	bms_cc_oneshot.ready = false;
+	sample.charge_level = eeprom_data.current_charge_level;
+	sample.charge_uah = bms_sample_uah;
+	bms_sample_uah = 0;
+	sample.pack_capacity = eeprom_data.total_pack_capacity;
+	sample.sys_stat = bms_sys_stat_latched;
+	bms_sys_stat_latched = 0;
+	sample.self_uah = bms_self_uah;
+	system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_EIC);
+	
+	sample.time_ms = systime_ms();
+	sample.fets_on = bq7693_fets_on();
+	sample.balancing = bms_balancing;
+	energy_update(&sample);
+	sample.energy_level = energy_level_mwh();
+	sample.runtime_minutes = energy_runtime_minutes();
+	sample.soc = soc_update(&sample);
+	telemetry_publish(&sample);
+	bms_last_sample_ms = sample.time_ms;
+	PERF_INC(samples);
+	watchdog_checkin(WATCHDOG_TASK_SAMPLER);
+	
+	resistance_update(&sample);
+	cc_cal_update(&sample);
+	
+	//Balancing is slotted in between samples, while charging or sat on the charger once full.
+	bms_balancing = balance_update(&sample, bms_state == BMS_CHARGING || bms_state == BMS_CHARGER_CONNECTED_NOT_CHARGING);
+}
+
+bool bms_service_sampler() {
+	//One snapshot per CC_READY, which is as often as the BQ7693 has anything new to say.
+	//If CC_READY goes quiet, don't let the snapshot go stale.
+	//Every state handler's loop comes through here, so it's where the state machine checks in and the WDT is fed.
+	watchdog_checkin(WATCHDOG_TASK_STATE_MACHINE);
+	watchdog_feed();
+	if (!bms_sample_due && systime_ms() - bms_last_sample_ms < BMS_SAMPLE_MAX_AGE_MS) {
+		return false;
+	}
+	bms_sample_due = false;
+	bms_sample();
+	return true;
+}
+
+static bool bms_fault_pending(void) {
+	return bms_fault_event.pending;
+}
+
+static void bms_process_fault_event(void) {
+	//Pick up a fault posted by the ALERT interrupt - the fault event that follows takes us to the fault state.
+	if (!bms_fault_event.pending) {
+		return;
+	}
+	
+	system_interrupt_enter_critical_section();
+	enum BMS_ERROR_CODE error = bms_fault_event.error;
+	uint8_t sys_stat = bms_fault_event.sys_stat;
+	uint32_t time_ms = bms_fault_event.time_ms;
+	bms_fault_event.pending = false;
+	system_interrupt_leave_critical_section();
+	
+	bms_error = error;
+	
+#ifdef SERIAL_DEBUG
+	sprintf(debug_msg_buffer, "%s: BMS IC fault %d, SYS_STAT 0x%02X at %" PRIu32 " ms\r\n", __FUNCTION__, error, sys_stat, time_ms);
+	serial_debug_send_message(debug_msg_buffer);
+#endif
+	PERF_TRACK_MS(fault_to_log_ms, time_ms);
+}
+
+void bms_trigger_callback(void) {
+	PERF_TIMESTAMP(edge);
+	trace_irq(4);
+	//Only take the fast path from idle, with a recent verdict that says it's safe.
+	//Otherwise the idle loop will see the trigger and go through the full check as before.
+	if (bms_state != BMS_IDLE || bms_trigger_fast_enabled || !bms_discharge_verdict || bms_fault_event.pending) {
+		return;
+	}
+	if (systime_ms() - bms_discharge_verdict_ms > BMS_VERDICT_MAX_AGE_MS) {
+		return;
+	}
+	//Never discharge with the charger plugged in - the idle loop will be on its way to charging.
+	if (bms_read_pin(CHARGER_CONNECTED_PIN)) {
+		return;
+	}
+	if (bq7693_enable_discharge_fast()) {
+		PERF_TRACK_CYCLES(trigger_to_dsg_cycles, edge);
+		bq7693_finish_discharge_enable();
+		bms_trigger_fast_ms = systime_ms();
+		bms_trigger_fast_enabled = true;
+	}
 }
 	
 void interrupts_init() {
@@ -104,15 +464,77 @@ void interrupts_init() {
 	extint_chan_set_config(8, &config_extint_chan);
 	extint_register_callback(bms_interrupt_callback, 8, EXTINT_CALLBACK_TYPE_DETECT);
 	extint_chan_enable_callback(8, EXTINT_CALLBACK_TYPE_DETECT);
+	
+	//Trigger (PA04) is on EXTINT 4 - rising edge when the trigger is pulled.
+	extint_chan_get_config_defaults(&config_extint_chan);	
+	config_extint_chan.gpio_pin        = 	PIN_PA04A_EIC_EXTINT4;
+	config_extint_chan.gpio_pin_mux =       MUX_PA04A_EIC_EXTINT4;
+	config_extint_chan.gpio_pin_pull      = EXTINT_PULL_NONE;
+	config_extint_chan.detection_criteria = EXTINT_DETECT_RISING;
+	config_extint_chan.filter_input_signal = true;
+	
+	extint_chan_set_config(4, &config_extint_chan);
+	extint_register_callback(bms_trigger_callback, 4, EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_enable_callback(4, EXTINT_CALLBACK_TYPE_DETECT);
 	//Enable interrupts.	
 	system_interrupt_enable_global();
 }
 
+static bool bms_wait_first_cc(void) {
+	//Interrupts aren't enabled yet, so poll for CC_READY - up to 250mS after bq7693_init().
+	uint32_t start = systime_ms();
+	uint8_t sys_stat;
+	while (systime_ms() - start < SOC_BOOT_CC_TIMEOUT_MS) {
+		if (bq7693_read_register(SYS_STAT, 1, &sys_stat) && (sys_stat & STAT_CC_READY)) {
+			bms_update_charge_count();
+			bq7693_write_register(SYS_STAT, STAT_CC_READY);
+			return true;
+		}
+		delay_ms(10);
+	}
+	return false;
+}
+
+static void bms_boot_resync(bool cc_valid) {
+	//Only on power up, ie waking from ship mode. After a reset for any other reason the pack may have been in use,
+	//and the cells won't be relaxed.
+	enum system_reset_cause cause = system_get_reset_cause();
+	if (!cc_valid || (cause != SYSTEM_RESET_CAUSE_POR && cause != SYSTEM_RESET_CAUSE_BOD33 && cause != SYSTEM_RESET_CAUSE_BOD12)) {
+		return;
+	}
+	
+	struct telemetry sample;
+	telemetry_read(&sample);
+	uint8_t ocv_percent;
+	if (!soc_resync(&sample, &ocv_percent)) {
+#ifdef SERIAL_DEBUG
+		sprintf(debug_msg_buffer, "%s: pack not relaxed (%" PRId32 " mA)\r\n", __FUNCTION__, sample.current);
+		serial_debug_send_message(debug_msg_buffer);
+#endif
+		return;
+	}
+	
+	//Re-anchor the coulomb count too - interrupts aren't on yet, so no need to mask the EIC.
+	eeprom_data.current_charge_level = soc_charge_level(eeprom_data.total_pack_capacity);
+	eeprom_data.energy_level = soc_charge_level(eeprom_data.energy_capacity);
+	bms_sample();
+	
+#ifdef SERIAL_DEBUG
+	sprintf(debug_msg_buffer, "%s: stored %d%%, OCV %d%%, now %d%%\r\n", __FUNCTION__, sample.soc, ocv_percent, soc_percent());
+	serial_debug_send_message(debug_msg_buffer);
+#endif
+}
+
 void bms_init() {
+	//Before anything has used much stack, so the high-water mark covers everything from here on.
+	stack_paint();
 	//sets up clocks/IRQ handlers etc.
 	system_init();
-	//Initialise the delay system
+	clocks_init();
+	//Initialise the delay system, and the millisecond time base that shares SysTick with it.
 	delay_init();
+	systime_init();
+	timer_init();
 	//Set up the pins
 	pins_init();
 	
@@ -122,12 +544,25 @@ void bms_init() {
 #ifdef SERIAL_DEBUG
 	serial_debug_init();
 #endif
+	watchdog_report_reset();
 	
 	//Init the LEDs
 	leds_init();
 	//Init eeprom emulator
 	eeprom_init();
 	eeprom_read();
+	crash_report();
+	soc_init(eeprom_data.current_charge_level, eeprom_data.total_pack_capacity);
+	energy_init();
+	cc_cal_init();
+	
+	//Wait for the BQ7693's first ADC/CC cycle, so the first snapshot is real, then check whether the SoC wants resyncing.
+	bool cc_valid = bms_wait_first_cc();
+	bms_sample();
+	bms_boot_resync(cc_valid);
+#ifdef SERIAL_DEBUG
+	serial_debug_send_cell_voltages();
+#endif
 	
 	//Initialise the USART we need to talk to the vacuum cleaner
 	serial_init();	
@@ -140,35 +575,57 @@ void bms_init() {
 
 }
 	
-bool bms_is_safe_to_discharge() {
+//Full discharge safety check. report=false keeps it quiet for the background verdict refresh while idle.
+static bool bms_check_discharge(bool report) {
 	//Clear error status.
 	bms_error = BMS_ERR_NONE;
 	
-	uint16_t *cell_voltages = bq7693_get_cell_voltages();
-	//Check any cells undervolt.
-	for (int i=0; i<7;++i) {
-		if (cell_voltages[i] < CELL_LOWEST_DISCHARGE_VOLTAGE) {
+	struct telemetry sample;
+	telemetry_read(&sample);
+	
+	//Check any cells undervolt. Under load, that's judged on the estimated resting voltage - the sag in boost mode
+	//would otherwise cut the pack off early. The BQ7693's UV_TRIP still acts on the loaded voltage, so stop short
+	//of that too, rather than leave it to fault the pack.
+	uint16_t cell_voltages[NUM_CELLS];
+	for (int i=0; i<NUM_CELLS;++i) {
+#ifdef CELL_IR_COMPENSATION
+		cell_voltages[i] = resistance_compensate(i, sample.cell_voltages[i], sample.current);
+#else
+		cell_voltages[i] = sample.cell_voltages[i];
+#endif
+	}
+	
+	for (int i=0; i<NUM_CELLS;++i) {
+		bool undervolt = cell_voltages[i] < CELL_LOWEST_DISCHARGE_VOLTAGE;
+#ifdef CELL_IR_COMPENSATION
+		undervolt |= sample.cell_voltages[i] < CELL_UNDERVOLTAGE_TRIP + CELL_UV_TRIP_MARGIN;
+#endif
+		if (undervolt) {
 			bms_error = BMS_ERR_PACK_DISCHARGED;
 			
 #ifdef SERIAL_DEBUG
-			sprintf(debug_msg_buffer, "%s: Cell voltages too low\r\n", __FUNCTION__);
-			serial_debug_send_message(debug_msg_buffer);
-				
-			for (int i=0; i<7; ++i) {
-				sprintf(debug_msg_buffer, "Cell %d: %d mV, min %d mV\r\n", i, cell_voltages[i], CELL_LOWEST_DISCHARGE_VOLTAGE);
+			if (report) {
+				sprintf(debug_msg_buffer, "%s: Cell voltages too low\r\n", __FUNCTION__);
 				serial_debug_send_message(debug_msg_buffer);
+					
+				for (int j=0; j<NUM_CELLS; ++j) {
+					sprintf(debug_msg_buffer, "Cell %d: %d mV (%d mV loaded), min %d mV\r\n", j, cell_voltages[j], sample.cell_voltages[j], CELL_LOWEST_DISCHARGE_VOLTAGE);
+					serial_debug_send_message(debug_msg_buffer);
+				}
 			}
 #endif		
 		}
 	}
 	//Check pack temperature remains in acceptable range	
-	int temp = bq7693_read_temperature();
+	int temp = sample.temperature;
 	if (temp/10  > MAX_PACK_TEMPERATURE) {
 		bms_error = BMS_ERR_PACK_OVERTEMP;
 		
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer, "%s : Pack overtemp %d 'C, max %d\r\n",__FUNCTION__ ,  temp/10, MAX_PACK_TEMPERATURE);
-		serial_debug_send_message(debug_msg_buffer);
+		if (report) {
+			sprintf(debug_msg_buffer, "%s : Pack overtemp %d 'C, max %d\r\n",__FUNCTION__ ,  temp/10, MAX_PACK_TEMPERATURE);
+			serial_debug_send_message(debug_msg_buffer);
+		}
 #endif
 
 	}
@@ -176,42 +633,46 @@ bool bms_is_safe_to_discharge() {
 		bms_error = BMS_ERR_PACK_UNDERTEMP;
 
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer, "%s: Pack undertemp %d 'C, min %d\r\n", __FUNCTION__ , temp/10, MIN_PACK_DISCHARGE_TEMP);
-		serial_debug_send_message(debug_msg_buffer);
+		if (report) {
+			sprintf(debug_msg_buffer, "%s: Pack undertemp %d 'C, min %d\r\n", __FUNCTION__ , temp/10, MIN_PACK_DISCHARGE_TEMP);
+			serial_debug_send_message(debug_msg_buffer);
+		}
 #endif
 	}
 	
-	//Check sys_stat	
-	uint8_t sys_stat;
-	bq7693_read_register(SYS_STAT, 1, &sys_stat);
+	//Check sys_stat - the bits the ALERT interrupt saw (and cleared) since the last sample.
+	uint8_t sys_stat = sample.sys_stat;
 
-	if (sys_stat & 0x01) 	{
+	if (sys_stat & STAT_OCD) 	{
 		bms_error = BMS_ERR_OVERCURRENT;
-		bq7693_write_register(SYS_STAT, 0x01);
 
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer, "%s: BMS IC Overcurrent Trip\r\n", __FUNCTION__);
-		serial_debug_send_message(debug_msg_buffer);
+		if (report) {
+			sprintf(debug_msg_buffer, "%s: BMS IC Overcurrent Trip\r\n", __FUNCTION__);
+			serial_debug_send_message(debug_msg_buffer);
+		}
 #endif
 
 	}
-	else if (sys_stat & 0x02) {
+	else if (sys_stat & STAT_SCD) {
 		bms_error = BMS_ERR_SHORTCIRCUIT;
-		bq7693_write_register(SYS_STAT, 0x02);
 
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer, "%s: BMS IC Short Circuit Trip\r\n", __FUNCTION__);
-		serial_debug_send_message(debug_msg_buffer);
+		if (report) {
+			sprintf(debug_msg_buffer, "%s: BMS IC Short Circuit Trip\r\n", __FUNCTION__);
+			serial_debug_send_message(debug_msg_buffer);
+		}
 #endif	
 
 	}
-	else if (sys_stat & 0x08) {
+	else if (sys_stat & STAT_UV) {
 		bms_error = BMS_ERR_UNDERVOLTAGE;
-		bq7693_write_register(SYS_STAT, 0x08);
 
 #ifdef SERIAL_DEBUG
-	sprintf(debug_msg_buffer, "%s: BMS IC Undervoltage Trip\r\n", __FUNCTION__);
-	serial_debug_send_message(debug_msg_buffer);
+		if (report) {
+			sprintf(debug_msg_buffer, "%s: BMS IC Undervoltage Trip\r\n", __FUNCTION__);
+			serial_debug_send_message(debug_msg_buffer);
+		}
 #endif
 
 	}	
@@ -223,19 +684,55 @@ bool bms_is_safe_to_discharge() {
 	
 }
 
+bool bms_is_safe_to_discharge() {
+	return bms_check_discharge(true);
+}
+
+void bms_refresh_discharge_verdict() {
+	bool safe = bms_check_discharge(false);
+	
+	//The trigger interrupt's single write relies on the BQ7693 having been prepared since discharge last stopped.
+	if (safe && !bms_discharge_prepared) {
+		bq7693_prepare_discharge();
+		bms_discharge_prepared = true;
+	}
+	
+	//Invalidate before updating the timestamp, so the trigger interrupt never sees a fresh timestamp with a stale verdict.
+	bms_discharge_verdict = false;
+	bms_discharge_verdict_ms = systime_ms();
+	bms_discharge_verdict = safe;
+}
+
+static void bms_invalidate_discharge_verdict(void) {
+	//Disarm the trigger interrupt's fast path until the idle loop has prepared the BQ7693 and checked again.
+	bms_discharge_verdict = false;
+	bms_discharge_prepared = false;
+}
+
+//Idle is about to return - disarm the fast path before anything else happens. Returns true if the trigger
+//interrupt got in first and the discharge FET is already on, in which case that's the way out.
+static bool bms_idle_disarm(void) {
+	system_interrupt_disable(SYSTEM_INTERRUPT_MODULE_EIC);
+	bms_invalidate_discharge_verdict();
+	bool fired = bms_trigger_fast_enabled;
+	system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_EIC);
+	return fired;
+}
+
 bool bms_is_safe_to_charge() {
 	//Clear error status.
 	bms_error = BMS_ERR_NONE;
 	
-	uint16_t *cell_voltages = bq7693_get_cell_voltages();
+	struct telemetry sample;
+	telemetry_read(&sample);
 	
 	//Check no cells are so flat they cannot be charged.
-	for (int i=0; i<7;++i) {
-		if ( cell_voltages[i] < CELL_LOWEST_CHARGE_VOLTAGE ) {
+	for (int i=0; i<NUM_CELLS;++i) {
+		if ( sample.cell_voltages[i] < CELL_LOWEST_CHARGE_VOLTAGE ) {
 			bms_error = BMS_ERR_CELL_FAIL;	
 
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer, "%s: Cell %d below min charge voltage %d, min %d\r\n", __FUNCTION__, i, cell_voltages[i], CELL_LOWEST_CHARGE_VOLTAGE);
+		sprintf(debug_msg_buffer, "%s: Cell %d below min charge voltage %d, min %d\r\n", __FUNCTION__, i, sample.cell_voltages[i], CELL_LOWEST_CHARGE_VOLTAGE);
 		serial_debug_send_message(debug_msg_buffer);
 #endif
 
@@ -243,7 +740,7 @@ bool bms_is_safe_to_charge() {
 	}
 
 	//Check pack temperature acceptable (<=60'C)	
-	int temp = bq7693_read_temperature();
+	int temp = sample.temperature;
 	if (temp/10  > MAX_PACK_TEMPERATURE) {
 		bms_error = BMS_ERR_PACK_OVERTEMP;
 	}
@@ -251,16 +748,13 @@ bool bms_is_safe_to_charge() {
 		bms_error = BMS_ERR_PACK_UNDERTEMP;
 	}
 	
-	//Check sys_stat
-	uint8_t sys_stat;
-	bq7693_read_register(SYS_STAT, 1, &sys_stat);
-	if (sys_stat & 0x01) 	{
+	//Check sys_stat - as latched by the ALERT interrupt.
+	uint8_t sys_stat = sample.sys_stat;
+	if (sys_stat & STAT_OCD) 	{
 		bms_error = BMS_ERR_OVERCURRENT;
-		bq7693_write_register(SYS_STAT, 0x01);
 	}
-	else if (sys_stat & 0x04) {
+	else if (sys_stat & STAT_OV) {
 		bms_error = BMS_ERR_OVERVOLTAGE;
-		bq7693_write_register(SYS_STAT, 0x04);
 	}
 	
 	if (bms_error == BMS_ERR_NONE) {
@@ -270,18 +764,12 @@ bool bms_is_safe_to_charge() {
 }
 
 bool bms_is_pack_full() {
-	uint16_t *cell_voltages = bq7693_get_cell_voltages();
-
-#ifdef SERIAL_DEBUG
-	for (int i=0; i<7; ++i) {
-		char message[40];
-		sprintf(message, "Cell %d: %d mV, target %d mV\r\n", i, cell_voltages[i], CELL_FULL_CHARGE_VOLTAGE);
-	}
-#endif
+	struct telemetry sample;
+	telemetry_read(&sample);
 
 	//If any cells are at their full charge voltage, we are full.
-	for (int i=0; i<7;++i) {
-		if (cell_voltages[i] >= CELL_FULL_CHARGE_VOLTAGE ) {
+	for (int i=0; i<NUM_CELLS;++i) {
+		if (sample.cell_voltages[i] >= CELL_FULL_CHARGE_VOLTAGE ) {
 			return true;
 		}
 	}
@@ -289,89 +777,127 @@ bool bms_is_pack_full() {
 }
 
 
-void bms_handle_idle() {
+enum BMS_EVENT bms_handle_idle() {
+	//Get the BQ7693 ready so the trigger interrupt can turn the discharge FET on with a single write.
+	bms_refresh_discharge_verdict();
+	
 	//Three potential ways out of this state - someone pulls the trigger, plugs in a charger, or the IDLE_TIME is exceeded and we go to sleep.
-	for (int i=0; i<  (IDLE_TIME * 1000) / 50; ++i) {
-		if (port_pin_get_input_level(CHARGER_CONNECTED_PIN) == true) {
-			bms_state = BMS_CHARGER_CONNECTED;
-			return;
+	bms_start_state_timer(IDLE_TIME * 1000UL);
+	while (!bms_state_timed_out) {
+		PERF_STATE_ITERATION(BMS_IDLE);
+		serial_debug_service();
+		
+		if (bms_fault_pending()) {
+			//The BQ7693 has switched the FETs off, whether or not the trigger interrupt got in first.
+			bms_idle_disarm();
+			return BMS_EVT_FAULT;
+		}
+		if (bms_trigger_fast_enabled) {
+			//Trigger interrupt has already switched the power on.
+			bms_idle_disarm();
+			return BMS_EVT_TRIGGER_FAST;
+		}
+		if (bms_service_sampler()) {
+			//New readings, so a new verdict.
+			bms_refresh_discharge_verdict();
+		}
+		
+		if (bms_read_pin(CHARGER_CONNECTED_PIN) == true) {
+			if (bms_idle_disarm()) {
+				return BMS_EVT_TRIGGER_FAST;
+			}
+			return BMS_EVT_CHARGER_CONNECTED;
 		}
-		else if (port_pin_get_input_level(TRIGGER_PRESSED_PIN) == true) {
-			bms_state = BMS_TRIGGER_PULLED;
-			return;
+		else if (bms_read_pin(TRIGGER_PRESSED_PIN) == true) {
+			if (bms_idle_disarm()) {
+				return BMS_EVT_TRIGGER_FAST;
+			}
+			return BMS_EVT_TRIGGER_PULLED;
 		}
-		delay_ms(50);
+		timer_sleep();
 	}	
-	//Reached the end of our wait loop, with nobody pulling the trigger, or plugging in charger.
+	//Reached the end of our wait, with nobody pulling the trigger, or plugging in charger.
 	//Transit to sleep state
-	bms_state = BMS_SLEEP;
+	if (bms_idle_disarm()) {
+		return BMS_EVT_TRIGGER_FAST;
+	}
+	return BMS_EVT_TIMEOUT;
 }
 
-void bms_handle_trigger_pulled() {
-	//Check if it's safe to discharge or not.
-	if (bms_is_safe_to_discharge()) {
-		//All go - unleash the power!
-		bms_state = BMS_DISCHARGING;
-	}
-	else {
-		bms_state = BMS_FAULT;
-	}
+enum BMS_EVENT bms_handle_trigger_pulled() {
+	//Whether it's safe to discharge is the transition guard's call.
+	return BMS_EVT_DONE;
 }
 
-void bms_handle_sleep() {
+enum BMS_EVENT bms_handle_sleep() {
 	//Goodbye LED sequence
 	leds_sequence();
 	
 	//Store pack charge data to eeprom
 	eeprom_write();
 	
+	balance_stop();
 	bq7693_enter_sleep_mode();
 	
 	//We are about to get powered down.
 	while(1);
 }
 
-void bms_handle_discharging() {		
+enum BMS_EVENT bms_handle_discharging() {		
 	
 #ifdef SERIAL_DEBUG
 	serial_debug_send_message("Starting discharge\r\n");
 #endif
+	struct telemetry sample;
+	telemetry_read(&sample);
 	//Show the battery voltage on the LEDs.
-	leds_display_battery_soc((eeprom_data.current_charge_level*100) / eeprom_data.total_pack_capacity);
+	leds_display_battery_soc(sample.soc);
 	
-	if (bms_is_safe_to_discharge()) {
+	if (bms_trigger_fast_enabled) {
+		//FET already switched on by the trigger interrupt - the loop below does the full safety check straight away.
+		bms_trigger_fast_enabled = false;
+		bms_cc_oneshot_at_step(bms_trigger_fast_ms);
+		serial_reset_message_counter();
+	}
+	else if (bms_is_safe_to_discharge()) {
 		//Sanity check, hopefully already checked prior to here!
 		bq7693_enable_discharge();
+		bms_cc_oneshot_at_step(systime_ms());
 		//Reset the UART message counter;
 		serial_reset_message_counter();
 		//Brief pause to allow vac to wake up before we start sending serial data at it.
 	}
 	
 	while (1) {
+		PERF_STATE_ITERATION(BMS_DISCHARGING);
+		serial_debug_service();
+		bms_service_sampler();
 		
+		telemetry_read(&sample);
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer,"Discharging at %d mA, %d mAH, capacity %d mAH, Temp %d'C\r\n", currentmA*-1, eeprom_data.current_charge_level/1000, eeprom_data.total_pack_capacity/1000,
-		bq7693_read_temperature()/10);
+		sprintf(debug_msg_buffer,"Discharging at %" PRId32 " mA, %" PRId32 " mAH, capacity %" PRId32 " mAH, Temp %d'C\r\n", sample.current*-1, sample.charge_level/1000, sample.pack_capacity/1000,
+		sample.temperature/10);
 		serial_debug_send_message(debug_msg_buffer);
 #endif
-		if (!port_pin_get_input_level(TRIGGER_PRESSED_PIN)) {
+		if (!bms_read_pin(TRIGGER_PRESSED_PIN)) {
 			//Trigger released.
-			bq7693_disable_discharge();
-			//Clear the battery status etc.
-			leds_off();
-			bms_state = BMS_IDLE;
-			return;
+			return BMS_EVT_TRIGGER_RELEASED;
 		}
-		if (!bms_is_safe_to_discharge()) {
+		if (bms_fault_pending() || !bms_is_safe_to_discharge()) {
 			//A fault has occurred.
-			bq7693_disable_discharge();
-			bms_state = BMS_FAULT;
-			return;
+			return BMS_EVT_FAULT;
 		}
 		
 		//No errors, and trigger pressed, so we continue to discharge.
 		//Show the battery voltage on the LEDs.
-		leds_display_battery_soc((eeprom_data.current_charge_level*100) / eeprom_data.total_pack_capacity);
+		telemetry_read(&sample);
+#ifdef RUNTIME_WARNING_MINUTES
+		if (sample.runtime_minutes < RUNTIME_WARNING_MINUTES) {
+			leds_show_low_runtime();
+		}
+		else
+#endif
+		leds_display_battery_soc(sample.soc);
 		
 		//Send the USART traffic we need to supply to keep the cleaner running
 		serial_send_next_message();
@@ -379,21 +905,29 @@ void bms_handle_discharging() {
 	}
 }
 
-void bms_handle_fault() {
+enum BMS_EVENT bms_handle_fault() {
 	//Turn all the LEDs off.
 	leds_off();
 	
 	//Show the error status and continue to show it, until trigger released and charger unplugged.
 	do {
+		PERF_STATE_ITERATION(BMS_FAULT);
+		serial_debug_service();
+		bms_service_sampler();
+		
 		if (bms_error == BMS_ERR_PACK_DISCHARGED || bms_error == BMS_ERR_UNDERVOLTAGE ) {
 			//If the problem is just a flat pack, blink the lowest battery segment three times.
 			leds_show_pack_flat();
 
 			//We also need to update the pack capacity as it's flat at this point.
+			//The ALERT interrupt updates these too, so keep it out while we do.
+			system_interrupt_disable(SYSTEM_INTERRUPT_MODULE_EIC);
 			if (eeprom_data.current_charge_level > 0) {
 				eeprom_data.total_pack_capacity -= eeprom_data.current_charge_level;
 				eeprom_data.current_charge_level = 0;				
 			}
+			system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_EIC);
+			energy_set_empty();
 		}
 		else {
 			//Flash the red error led the number of times indicated by the fault code.
@@ -403,144 +937,205 @@ void bms_handle_fault() {
 			delay_ms(2000);
 		}
 	} 
-	while (port_pin_get_input_level(TRIGGER_PRESSED_PIN) || port_pin_get_input_level(CHARGER_CONNECTED_PIN));
+	while (bms_read_pin(TRIGGER_PRESSED_PIN) || bms_read_pin(CHARGER_CONNECTED_PIN));
 		
 	//Return to idle
-	bms_state = BMS_IDLE;	
+	return BMS_EVT_DONE;
 }
 
-void bms_handle_charger_connected() {
-	if (bms_is_pack_full()) {
-		//If the pack is full, transit to idle.
-		bms_state = BMS_IDLE;
-	}
-	else if (bms_is_safe_to_charge()) {
-		bms_state = BMS_CHARGING;
-	}
-	else {
-		bms_state = BMS_FAULT;
-	}
+enum BMS_EVENT bms_handle_charger_connected() {
+	//Full, safe to charge or not - the transition guards decide where we go.
+	return BMS_EVT_DONE;
 }
 
-void bms_handle_charger_connected_not_charging() {
-	//Wait up to 30 seconds to see if someone unplugs the charger.
+enum BMS_EVENT bms_handle_charger_connected_not_charging() {
+	//Wait up to BMS_CHARGER_IDLE_MS to see if someone unplugs the charger.
 	//If so, to idle.
 	//If not, to sleep.
-	for (int i=0; i<30; ++i) {
-		if (!port_pin_get_input_level(CHARGER_CONNECTED_PIN)) {
-			bms_state = BMS_IDLE;
-			return;
+	bms_start_state_timer(BMS_CHARGER_IDLE_MS);
+	while (!bms_state_timed_out) {
+		PERF_STATE_ITERATION(BMS_CHARGER_CONNECTED_NOT_CHARGING);
+		serial_debug_service();
+		bms_service_sampler();
+		
+		if (bms_fault_pending()) {
+			return BMS_EVT_FAULT;
+		}
+		if (!bms_read_pin(CHARGER_CONNECTED_PIN)) {
+			return BMS_EVT_CHARGER_UNPLUGGED;
 		}		
-		delay_ms(1000);
+		timer_sleep();
 	}
 	//Sleep then!
-	bms_state = BMS_SLEEP;
+	return BMS_EVT_TIMEOUT;
+}
+
+//Any cell at full charge voltage. Cells being bled while the sample was taken are left out - their readings are off.
+static bool bms_is_cell_full(const struct telemetry *sample) {
+	for (int i=0; i<NUM_CELLS; ++i) {
+		if (!(sample->balancing & (1 << i)) && sample->cell_voltages[i] >= CELL_FULL_CHARGE_VOLTAGE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifdef CHARGE_TAPER_TERMINATION
+//Full once the charger has brought the cells up to CHARGE_TAPER_CELL_VOLTAGE, and the current has tapered
+//below C/CHARGE_TAPER_C_DIVISOR for CHARGE_TAPER_HOLD_MS. *taper_start_ms is 0 while not tapering.
+static bool bms_is_charge_tapered(const struct telemetry *sample, uint32_t *taper_start_ms) {
+	uint16_t highest = 0;
+	for (int i=0; i<NUM_CELLS; ++i) {
+		if (sample->cell_voltages[i] > highest) {
+			highest = sample->cell_voltages[i];
+		}
+	}
+	int32_t taper_current = sample->pack_capacity / 1000 / CHARGE_TAPER_C_DIVISOR;
+	
+	if (highest < CHARGE_TAPER_CELL_VOLTAGE || sample->current > taper_current) {
+		*taper_start_ms = 0;
+		return false;
+	}
+	if (*taper_start_ms == 0) {
+		*taper_start_ms = sample->time_ms;
+	}
+	return sample->time_ms - *taper_start_ms >= CHARGE_TAPER_HOLD_MS;
 }
+#endif
 
-void bms_handle_charging() {
+enum BMS_EVENT bms_handle_charging() {
 	//Sanity check...
 	if (!bms_is_safe_to_charge()) {
-		bms_state = BMS_FAULT;
-		return;
+		return BMS_EVT_FAULT;
 	}
 	//Enable charging.
-	port_pin_set_output_level(ENABLE_CHARGE_PIN, true);
+	bms_set_charge_enable(true);
 	 //Enable the charge FET in the BQ7693.
 	bq7693_enable_charge();
 	
 	int charge_pause_counter = 0;
+	bool charge_tapered = false;
+#ifdef CHARGE_TAPER_TERMINATION
+	uint32_t taper_start_ms = 0;
+	uint32_t taper_sample_version = telemetry_version();
+#endif
+	struct telemetry sample;
 	while (1) {
+		PERF_STATE_ITERATION(BMS_CHARGING);
+		serial_debug_service();
+		bool new_sample = bms_service_sampler();
+		
 		//Charging now in progress.		
 		//Show flashing LED segment to indicate we are charging.
-		leds_flash_charging_segment((eeprom_data.current_charge_level*100) / eeprom_data.total_pack_capacity);
+		telemetry_read(&sample);
+		leds_show_charging_segment(sample.soc);
 	
 #ifdef SERIAL_DEBUG
-		sprintf(debug_msg_buffer,"Charging at %d mA, %d mAH, capacity %d mAH, Temp %d'C\r\n", currentmA, eeprom_data.current_charge_level/1000, eeprom_data.total_pack_capacity/1000, 
-		bq7693_read_temperature()/10);
-		serial_debug_send_message(debug_msg_buffer);	
+		if (new_sample) {
+			sprintf(debug_msg_buffer,"Charging at %" PRId32 " mA, %" PRId32 " mAH, capacity %" PRId32 " mAH, Temp %d'C\r\n", sample.current, sample.charge_level/1000, sample.pack_capacity/1000, 
+			sample.temperature/10);
+			serial_debug_send_message(debug_msg_buffer);
+		}
 #endif
-		if (!bms_is_safe_to_charge()) {
+		if (bms_fault_pending() || !bms_is_safe_to_charge()) {
 			//Safety error.
-			port_pin_set_output_level(ENABLE_CHARGE_PIN, false);
-			bq7693_disable_charge();
-
-			leds_off();
-			bms_state = BMS_FAULT;
-			return;
+			return BMS_EVT_FAULT;
 		}
 				
-		if ( !port_pin_get_input_level(CHARGER_CONNECTED_PIN)) {
+		if ( !bms_read_pin(CHARGER_CONNECTED_PIN)) {
 			//Charger unplugged.
-			//Turn off charging
-			port_pin_set_output_level(ENABLE_CHARGE_PIN, false);
-			bq7693_disable_charge();
-
-			leds_off();
-			bms_state = BMS_CHARGER_UNPLUGGED;
-			return;
+			return BMS_EVT_CHARGER_UNPLUGGED;
+		}
+		
+#ifdef CHARGE_TAPER_TERMINATION
+		//Only judge the taper on samples taken since charging was (re)enabled - they're the ones with charge current flowing.
+		uint32_t sample_version = telemetry_read(&sample);
+		if (sample_version != taper_sample_version) {
+			taper_sample_version = sample_version;
+			charge_tapered = bms_is_charge_tapered(&sample, &taper_start_ms);
 		}
+#endif
 				
-		if (bms_is_pack_full()) {
+		//Fallback, should the current never taper (eg a cell running ahead of the rest) - pause and retry
+		//each time a cell reaches full voltage, and call it full after FULL_CHARGE_PAUSE_COUNT attempts.
+		//Not while a taper is being timed, which needs the charge left running.
+#ifdef CHARGE_TAPER_TERMINATION
+		bool taper_in_progress = taper_start_ms != 0;
+#else
+		bool taper_in_progress = false;
+#endif
+		if (!charge_tapered && !taper_in_progress && bms_is_cell_full(&sample)) {
 #ifdef SERIAL_DEBUG
 			sprintf(debug_msg_buffer, "Charging paused - cell full, attempt %d of %d\r\n", charge_pause_counter, FULL_CHARGE_PAUSE_COUNT);
 			serial_debug_send_message(debug_msg_buffer);			
 			serial_debug_send_cell_voltages();
 #endif
 			//Pause the charging.
-			port_pin_set_output_level(ENABLE_CHARGE_PIN, false);
+			bms_set_charge_enable(false);
 			bq7693_disable_charge();
 		
-			//Delay for 30 seconds, then go and try again.	
-			for (int i=0; i<30; ++i) {
-				//This function takes a second.
-				leds_flash_charging_segment((eeprom_data.current_charge_level*100) / eeprom_data.total_pack_capacity);
+			//Wait for BMS_CHARGE_PAUSE_MS, then go and try again.	
+			bms_start_state_timer(BMS_CHARGE_PAUSE_MS);
+			while (!bms_state_timed_out) {
+				bms_service_sampler();
+				telemetry_read(&sample);
+				leds_show_charging_segment(sample.soc);
+				if (bms_fault_pending()) {
+					return BMS_EVT_FAULT;
+				}
 				//Check the charger hasn't been unplugged while we're waiting
 				//If it has, abandon the charge process and return to main loop
-				if (!port_pin_get_input_level(CHARGER_CONNECTED_PIN)) {
+				if (!bms_read_pin(CHARGER_CONNECTED_PIN)) {
 					//Charger's been unplugged.
-					leds_off();
-					bms_state = BMS_CHARGER_UNPLUGGED;
-					return;
+					return BMS_EVT_CHARGER_UNPLUGGED;
 				}
+				timer_sleep();
 			}			
 			charge_pause_counter++;	
 			//Restart charging	
-			port_pin_set_output_level(ENABLE_CHARGE_PIN, true);
+			bms_set_charge_enable(true);
 			bq7693_enable_charge();
+#ifdef CHARGE_TAPER_TERMINATION
+			taper_start_ms = 0;
+			taper_sample_version = telemetry_version();
+#endif
 		}
 		
-		if (charge_pause_counter == FULL_CHARGE_PAUSE_COUNT) {
-			//After FULL_CHARGE_PAUSE_COUNT pauses, we are full.
-			//Disable the charging
-			port_pin_set_output_level(ENABLE_CHARGE_PIN, false);
+		if (charge_tapered || charge_pause_counter == FULL_CHARGE_PAUSE_COUNT) {
+			//Current has tapered off, or after FULL_CHARGE_PAUSE_COUNT pauses, we are full.
+			//Disable the charging - the transition does the rest.
+			bms_set_charge_enable(false);
 			bq7693_disable_charge();
-			
-			leds_off();
-
-			bms_state = BMS_CHARGER_CONNECTED_NOT_CHARGING;
 
 			//Set charge level to equal capacity.
+			system_interrupt_disable(SYSTEM_INTERRUPT_MODULE_EIC);
 			eeprom_data.total_pack_capacity = eeprom_data.current_charge_level;
+			system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_EIC);
+			energy_set_full();
 
 #ifdef SERIAL_DEBUG
-			serial_debug_send_message("Charging stopped - cells at capacity\r\n");
+			serial_debug_send_message(charge_tapered ? "Charging stopped - current tapered\r\n" : "Charging stopped - cells at capacity\r\n");
 			char message[40];
 			sprintf(message, "Total pack capacity %dmAh\r\n", eeprom_data.total_pack_capacity/1000);
 			serial_debug_send_message(message);
 #endif
-			return;	
-		}			
+			return BMS_EVT_CHARGE_COMPLETE;
+		}
+		//Until the next CC reading or timer tick.
+		timer_sleep();
 	}
 }
 
-void bms_handle_charger_unplugged() {
+enum BMS_EVENT bms_handle_charger_unplugged() {
 	//Do a little flash to show how out of sync the pack is, then go to idle.
-	uint16_t *cell_voltages = bq7693_get_cell_voltages();
+	struct telemetry sample;
+	telemetry_read(&sample);
+	uint16_t *cell_voltages = sample.cell_voltages;
 		
 	uint8_t highest_cell = 0;
 	uint8_t lowest_cell = 0;
 		
-	for (int i=0; i<7;++i) {
+	for (int i=0; i<NUM_CELLS;++i) {
 		if (cell_voltages[i] > cell_voltages[highest_cell]) {
 			highest_cell = i;
 		}
@@ -561,48 +1156,287 @@ void bms_handle_charger_unplugged() {
 	serial_debug_send_cell_voltages();
 #endif
 
-	bms_state = BMS_IDLE;
+	return BMS_EVT_DONE;
 }
 
 
+//Transition actions - run on the way out of a state, whichever of its events took us out.
+static void bms_stop_charging(void) {
+	bms_set_charge_enable(false);
+	bq7693_disable_charge();
+	leds_off();
+}
+
+static void bms_stop_discharging(void) {
+	bq7693_disable_discharge();
+	bms_invalidate_discharge_verdict();
+	bms_cc_oneshot_at_step(systime_ms());
+	//Clear the battery status etc.
+	leds_off();
+}
+
+static enum BMS_EVENT (* const bms_state_handlers[])(void) = {
+	[BMS_IDLE] = bms_handle_idle,
+	[BMS_CHARGER_CONNECTED] = bms_handle_charger_connected,
+	[BMS_CHARGING] = bms_handle_charging,
+	[BMS_CHARGER_CONNECTED_NOT_CHARGING] = bms_handle_charger_connected_not_charging,
+	[BMS_CHARGER_UNPLUGGED] = bms_handle_charger_unplugged,
+	[BMS_TRIGGER_PULLED] = bms_handle_trigger_pulled,
+	[BMS_DISCHARGING] = bms_handle_discharging,
+	[BMS_FAULT] = bms_handle_fault,
+	[BMS_SLEEP] = bms_handle_sleep,
+};
+
+struct bms_transition {
+	uint8_t event;			//enum BMS_EVENT
+	uint8_t next;			//enum BMS_STATE
+	bool (*guard)(void);	//Row only applies if this returns true (NULL = always)
+	void (*action)(void);	//Run on the way out (NULL = nothing)
+};
+
+struct bms_transition_rows {
+	const struct bms_transition *rows;
+	uint8_t count;
+};
+#define BMS_TRANSITION_ROWS(rows) { rows, sizeof(rows) / sizeof(rows[0]) }
+
+//Each state's rows - first matching row wins, so guarded rows go before their fallback.
+static const struct bms_transition bms_idle_transitions[] = {
+	{ BMS_EVT_TRIGGER_FAST,			BMS_DISCHARGING,						NULL,						NULL },
+	{ BMS_EVT_TRIGGER_PULLED,		BMS_TRIGGER_PULLED,						NULL,						NULL },
+	{ BMS_EVT_CHARGER_CONNECTED,	BMS_CHARGER_CONNECTED,					NULL,						NULL },
+	{ BMS_EVT_TIMEOUT,				BMS_SLEEP,								NULL,						NULL },
+};
+
+static const struct bms_transition bms_trigger_pulled_transitions[] = {
+	//All go - unleash the power!
+	{ BMS_EVT_DONE,					BMS_DISCHARGING,						bms_is_safe_to_discharge,	NULL },
+	{ BMS_EVT_DONE,					BMS_FAULT,								NULL,						NULL },
+};
+
+static const struct bms_transition bms_discharging_transitions[] = {
+	{ BMS_EVT_TRIGGER_RELEASED,		BMS_IDLE,								NULL,						bms_stop_discharging },
+	{ BMS_EVT_FAULT,				BMS_FAULT,								NULL,						bms_stop_discharging },
+};
+
+static const struct bms_transition bms_charger_connected_transitions[] = {
+	//If the pack is full, transit to idle.
+	{ BMS_EVT_DONE,					BMS_IDLE,								bms_is_pack_full,			NULL },
+	{ BMS_EVT_DONE,					BMS_CHARGING,							bms_is_safe_to_charge,		NULL },
+	{ BMS_EVT_DONE,					BMS_FAULT,								NULL,						NULL },
+};
+
+static const struct bms_transition bms_charging_transitions[] = {
+	{ BMS_EVT_CHARGER_UNPLUGGED,	BMS_CHARGER_UNPLUGGED,					NULL,						bms_stop_charging },
+	{ BMS_EVT_CHARGE_COMPLETE,		BMS_CHARGER_CONNECTED_NOT_CHARGING,		NULL,						bms_stop_charging },
+	{ BMS_EVT_FAULT,				BMS_FAULT,								NULL,						bms_stop_charging },
+};
+
+static const struct bms_transition bms_charger_connected_not_charging_transitions[] = {
+	{ BMS_EVT_CHARGER_UNPLUGGED,	BMS_IDLE,								NULL,						NULL },
+	{ BMS_EVT_TIMEOUT,				BMS_SLEEP,								NULL,						NULL },
+};
+
+static const struct bms_transition bms_charger_unplugged_transitions[] = {
+	{ BMS_EVT_DONE,					BMS_IDLE,								NULL,						NULL },
+};
+
+static const struct bms_transition bms_fault_transitions[] = {
+	{ BMS_EVT_DONE,					BMS_IDLE,								NULL,						NULL },
+};
+
+//Indexed by state, so a dispatch only looks through the current state's rows. Sleep never comes back.
+static const struct bms_transition_rows bms_transitions[] = {
+	[BMS_IDLE] = BMS_TRANSITION_ROWS(bms_idle_transitions),
+	[BMS_CHARGER_CONNECTED] = BMS_TRANSITION_ROWS(bms_charger_connected_transitions),
+	[BMS_CHARGING] = BMS_TRANSITION_ROWS(bms_charging_transitions),
+	[BMS_CHARGER_CONNECTED_NOT_CHARGING] = BMS_TRANSITION_ROWS(bms_charger_connected_not_charging_transitions),
+	[BMS_CHARGER_UNPLUGGED] = BMS_TRANSITION_ROWS(bms_charger_unplugged_transitions),
+	[BMS_TRIGGER_PULLED] = BMS_TRANSITION_ROWS(bms_trigger_pulled_transitions),
+	[BMS_DISCHARGING] = BMS_TRANSITION_ROWS(bms_discharging_transitions),
+	[BMS_FAULT] = BMS_TRANSITION_ROWS(bms_fault_transitions),
+	[BMS_SLEEP] = { NULL, 0 },
+};
+
+//Tried in any state, once its own rows haven't matched.
+static const struct bms_transition bms_any_state_transitions[] = {
+	//Anything else can fault straight to the fault state.
+	{ BMS_EVT_FAULT,				BMS_FAULT,								NULL,						NULL },
+};
+static const struct bms_transition_rows bms_transitions_any = BMS_TRANSITION_ROWS(bms_any_state_transitions);
+
+//Recent transitions, oldest overwritten first.
+static struct bms_transition_record bms_transition_trace[BMS_TRANSITION_TRACE_LEN];
+static uint8_t bms_transition_trace_head = 0;
+
+//Time spent in, and number of entries to, each state since boot.
+static uint32_t bms_state_time_ms[BMS_SLEEP + 1];
+static uint16_t bms_state_entries[BMS_SLEEP + 1];
+static uint32_t bms_state_entered_ms = 0;
+
+#ifdef CLOCK_GATING
+//Full speed to discharge (and through the short states that lead there), slow where there's mostly waiting.
+static const uint8_t bms_state_clock_profiles[] = {
+	[BMS_IDLE] = CLOCK_PROFILE_SLOW,
+	[BMS_CHARGER_CONNECTED] = CLOCK_PROFILE_FULL,
+	[BMS_CHARGING] = CLOCK_PROFILE_SLOW,
+	[BMS_CHARGER_CONNECTED_NOT_CHARGING] = CLOCK_PROFILE_SLOW,
+	[BMS_CHARGER_UNPLUGGED] = CLOCK_PROFILE_SLOW,
+	[BMS_TRIGGER_PULLED] = CLOCK_PROFILE_FULL,
+	[BMS_DISCHARGING] = CLOCK_PROFILE_FULL,
+	[BMS_FAULT] = CLOCK_PROFILE_SLOW,
+	[BMS_SLEEP] = CLOCK_PROFILE_SLOW,
+};
+
+static void bms_apply_clock_policy(enum BMS_STATE from, enum BMS_STATE to) {
+	clocks_set_profile(bms_state_clock_profiles[to]);
+	if ((from == BMS_DISCHARGING) != (to == BMS_DISCHARGING)) {
+		serial_set_enabled(to == BMS_DISCHARGING);
+	}
+}
+#endif
+
+static void bms_enter_state(enum BMS_STATE next, enum BMS_EVENT event, bool unhandled) {
+	uint32_t now = systime_ms();
+	
+	struct bms_transition_record *record = &bms_transition_trace[bms_transition_trace_head];
+	record->time_ms = now;
+	record->from = bms_state;
+	record->to = next;
+	record->event = event | (unhandled ? BMS_TRANSITION_UNHANDLED : 0);
+	record->error = bms_error;
+	bms_transition_trace_head = (bms_transition_trace_head + 1) % BMS_TRANSITION_TRACE_LEN;
+	
+	bms_state_time_ms[bms_state] += now - bms_state_entered_ms;
+	bms_state_entered_ms = now;
+	bms_state_entries[next]++;
+	
+	//Charge the BMS's own draw so far to the state being left, rather than whichever the next CC reading finds.
+	system_interrupt_disable(SYSTEM_INTERRUPT_MODULE_EIC);
+	bms_count_self_consumption();
+	bms_count_charge();
+	system_interrupt_enable(SYSTEM_INTERRUPT_MODULE_EIC);
+	
+	timer_cancel(&bms_state_timer);
+	if (bms_state == BMS_IDLE && next != BMS_IDLE) {
+		//Whatever happens next may leave the BQ7693 unprepared - the verdict is refreshed when we're back in idle.
+		bms_invalidate_discharge_verdict();
+	}
+	watchdog_set_task_active(WATCHDOG_TASK_DYSON_UART, next == BMS_DISCHARGING);
+#ifdef CLOCK_GATING
+	bms_apply_clock_policy(bms_state, next);
+#endif
+	bms_state = next;
+}
+
+static const struct bms_transition *bms_find_transition(const struct bms_transition_rows *table, enum BMS_EVENT event) {
+	for (uint8_t i=0; i<table->count; ++i) {
+		const struct bms_transition *transition = &table->rows[i];
+		if (transition->event == event && (!transition->guard || transition->guard())) {
+			return transition;
+		}
+	}
+	return NULL;
+}
+
+static void bms_dispatch(enum BMS_EVENT event) {
+	if (event == BMS_EVT_FAULT) {
+		//Collect the error code if it was the BQ7693 that raised it.
+		bms_process_fault_event();
+	}
+	
+	const struct bms_transition *transition = bms_find_transition(&bms_transitions[bms_state], event);
+	if (!transition) {
+		transition = bms_find_transition(&bms_transitions_any, event);
+	}
+	if (!transition) {
+		//Nothing in the table for this - stay where we are, but record it so it can be found later.
+		bms_enter_state(bms_state, event, true);
+		return;
+	}
+	if (transition->action) {
+		transition->action();
+	}
+	bms_enter_state(transition->next, event, false);
+}
+
+uint8_t bms_transition_trace_copy(struct bms_transition_record *records, uint8_t max) {
+	//The most recent max, oldest first. Unused slots (time 0, nothing entered yet) are skipped.
+	uint8_t count = 0;
+	for (uint8_t i = max < BMS_TRANSITION_TRACE_LEN ? BMS_TRANSITION_TRACE_LEN - max : 0; i<BMS_TRANSITION_TRACE_LEN; ++i) {
+		const struct bms_transition_record *record = &bms_transition_trace[(bms_transition_trace_head + i) % BMS_TRANSITION_TRACE_LEN];
+		if (record->time_ms != 0) {
+			records[count++] = *record;
+		}
+	}
+	return count;
+}
+
+void bms_state_machine_print() {
+#ifdef SERIAL_DEBUG
+	uint32_t now = systime_ms();
+	for (uint8_t i=0; i<=BMS_SLEEP; ++i) {
+		uint32_t time_ms = bms_state_time_ms[i] + (i == bms_state ? now - bms_state_entered_ms : 0);
+		sprintf(debug_msg_buffer, "%s: %" PRIu32 " ms, %u entries\r\n", bms_state_names[i], time_ms, bms_state_entries[i]);
+		serial_debug_send_message(debug_msg_buffer);
+		
+		//What the self-consumption table says the BMS drew in this state - compare against the bench.
+		uint32_t asleep_ms = bms_state_asleep_ms[i] < time_ms ? bms_state_asleep_ms[i] : time_ms;
+		uint64_t ua_ms = (uint64_t)time_ms * SELF_CONSUMPTION_BQ7693_UA
+			+ (uint64_t)(time_ms - asleep_ms) * bms_self_consumption[i].awake_ua
+			+ (uint64_t)asleep_ms * bms_self_consumption[i].asleep_ua;
+		sprintf(debug_msg_buffer, "  %" PRIu32 " ms asleep, ~%" PRIu32 " uAh drawn\r\n", asleep_ms, (uint32_t)(ua_ms / 3600000UL));
+		serial_debug_send_message(debug_msg_buffer);
+	}
+	sprintf(debug_msg_buffer, "Self-consumption since boot: %" PRIu32 " uAh\r\n", bms_self_uah);
+	serial_debug_send_message(debug_msg_buffer);
+	
+	struct bms_transition_record records[BMS_TRANSITION_TRACE_LEN];
+	uint8_t count = bms_transition_trace_copy(records, BMS_TRANSITION_TRACE_LEN);
+	for (uint8_t i=0; i<count; ++i) {
+		sprintf(debug_msg_buffer, "%" PRIu32 " ms: %d -> %d, event %d%s, error %d\r\n", records[i].time_ms, records[i].from, records[i].to,
+			records[i].event & ~BMS_TRANSITION_UNHANDLED, (records[i].event & BMS_TRANSITION_UNHANDLED) ? " (unhandled)" : "", records[i].error);
+		serial_debug_send_message(debug_msg_buffer);
+	}
+#endif
+}
+
 void bms_mainloop() {
+	bms_state_entered_ms = systime_ms();
+	bms_state_entries[bms_state]++;
+#ifdef CLOCK_GATING
+	//Gating starts with the state machine, so anything run after bms_init() without it (eg the benchmark
+	//firmware) finds everything clocked. The vacuum's USART is only clocked while discharging.
+	clocks_set_profile(bms_state_clock_profiles[bms_state]);
+	serial_set_enabled(bms_state == BMS_DISCHARGING);
+#endif
+	//From here on, everything is in the state machine - hand over to the watchdog.
+	watchdog_init();
+	
 	//Handle the state machinery.
 	while (1) {
+		//A fault from the BQ7693 takes priority over whatever we were about to do.
+		if (bms_fault_pending()) {
+			bms_dispatch(BMS_EVT_FAULT);
+		}
+		bms_service_sampler();
 		
 #ifdef SERIAL_DEBUG
 		sprintf(debug_msg_buffer, "%s: Entering state %s\r\n", __FUNCTION__, bms_state_names[bms_state]);
 		serial_debug_send_message(debug_msg_buffer);
 #endif
+		trace_state(bms_state, bms_error);
 		
-		switch (bms_state) {
-			case BMS_IDLE:
-				bms_handle_idle();
-				break;
-			case BMS_SLEEP:
-				bms_handle_sleep();
-				break;	
-			case BMS_TRIGGER_PULLED:
-				bms_handle_trigger_pulled();
-				break;
-			case BMS_CHARGER_CONNECTED:
-				bms_handle_charger_connected();
-				break;	
-			case BMS_CHARGING:
-				bms_handle_charging();
-				break;
-			case BMS_CHARGER_CONNECTED_NOT_CHARGING:
-				bms_handle_charger_connected_not_charging();
-				break;
-			case BMS_CHARGER_UNPLUGGED:
-				bms_handle_charger_unplugged();
-				break;
-			case BMS_DISCHARGING:
-				bms_handle_discharging();
-				break;
-			case BMS_FAULT:
-				bms_handle_fault();
-				break;
-		}
+#ifdef PERF_COUNTERS
+		enum BMS_STATE handled_state = bms_state;
+		uint32_t handler_start = systime_ms();
+#endif
+		
+		enum BMS_EVENT event = bms_state_handlers[bms_state]();
+		
+#ifdef PERF_COUNTERS
+		perf_track(&perf.state_handler_ms[handled_state], systime_ms() - handler_start);
+#endif
+		bms_dispatch(event);
 	}
 }
-
@@ -18,28 +18,21 @@
 #include "leds.h"
 #include "eeprom_handler.h"
 #include "serial_debug.h"
+#include "systime.h"
+#include "timer.h"
+#include "clocks.h"
+#include "watchdog.h"
+#include "stack.h"
+#include "telemetry.h"
+#include "soc.h"
+#include "balance.h"
+#include "resistance.h"
+#include "energy.h"
+#include "cc_cal.h"
+#include "trace.h"
+#include "perf.h"
 #include "config.h"
 
-void pins_init(void);
-
-void bms_init(void);
-void bms_mainloop(void);
-
-void bms_handle_idle(void);
-void bms_handle_sleep(void);
-void bms_handle_trigger_pulled(void);
-void bms_handle_discharging(void);
-void bms_handle_fault(void);
-void bms_handle_charger_connected(void);
-void bms_handle_charger_connected_not_charging(void);
-void bms_handle_charging(void);
-void bms_handle_charger_unplugged(void);
-
-
-bool bms_is_pack_full(void);
-bool bms_is_safe_to_discharge(void);
-bool bms_is_safe_to_charge(void);
-
 enum BMS_STATE {
 	BMS_IDLE,
 	BMS_CHARGER_CONNECTED,
@@ -63,8 +56,80 @@ enum BMS_ERROR_CODE {
 	BMS_ERR_I2C_FAIL,		//Unable to talk to the BQ7693 IC - very bad!
 	BMS_ERR_PACK_DISCHARGED,//Pack is flat - not really a bad error....
 	BMS_ERR_UNDERVOLTAGE,	//BMS detected undervoltage state - flat pack, but detected by the BQ.
+	BMS_ERR_DEVICE_FAULT,	//BQ7693 reported an internal fault (DEVICE_XREADY)
+};
+
+//Handlers return one of these, and the transition table in bms.c decides which state it leads to.
+enum BMS_EVENT {
+	BMS_EVT_NONE,
+	BMS_EVT_DONE,				//Handler has finished - the table's guards decide where next
+	BMS_EVT_FAULT,				//BQ7693 ALERT fault, or a safety check failed
+	BMS_EVT_TRIGGER_PULLED,
+	BMS_EVT_TRIGGER_FAST,		//Trigger interrupt has already switched the discharge FET on
+	BMS_EVT_TRIGGER_RELEASED,
+	BMS_EVT_CHARGER_CONNECTED,
+	BMS_EVT_CHARGER_UNPLUGGED,
+	BMS_EVT_CHARGE_COMPLETE,
+	BMS_EVT_TIMEOUT,			//Waited long enough with nothing happening
+};
+
+//One state change (or an event the table had no row for).
+struct bms_transition_record {
+	uint32_t time_ms;
+	uint8_t from;
+	uint8_t to;
+	uint8_t event;				//enum BMS_EVENT, with BMS_TRANSITION_UNHANDLED set if nothing matched
+	uint8_t error;				//bms_error at the time
 };
 
+#define BMS_TRANSITION_UNHANDLED 0x80
+#define BMS_TRANSITION_TRACE_LEN 16
+
+void pins_init(void);
+
+void bms_init(void);
+void bms_mainloop(void);
+
+enum BMS_EVENT bms_handle_idle(void);
+enum BMS_EVENT bms_handle_sleep(void);
+enum BMS_EVENT bms_handle_trigger_pulled(void);
+enum BMS_EVENT bms_handle_discharging(void);
+enum BMS_EVENT bms_handle_fault(void);
+enum BMS_EVENT bms_handle_charger_connected(void);
+enum BMS_EVENT bms_handle_charger_connected_not_charging(void);
+enum BMS_EVENT bms_handle_charging(void);
+enum BMS_EVENT bms_handle_charger_unplugged(void);
+
+
+bool bms_is_pack_full(void);
+bool bms_is_safe_to_discharge(void);
+bool bms_is_safe_to_charge(void);
+void bms_refresh_discharge_verdict(void);
+
+//Read everything from the BQ7693 and publish it as the latest telemetry snapshot.
+void bms_sample(void);
+//Called from the state handlers' loops - takes a sample if one is due. Returns true if it did.
+bool bms_service_sampler(void);
+//Call just after switching a load on or off - the next CC reading then covers only the new load.
+void bms_cc_oneshot_at_step(uint32_t step_ms);
+
+//Copy out up to max of the most recent transitions, oldest first. Returns how many.
+uint8_t bms_transition_trace_copy(struct bms_transition_record *records, uint8_t max);
+//Time in each state (and how much of it asleep), the estimated self-consumption, and the recent transitions, over the debug serial port.
+void bms_state_machine_print(void);
+
+//How old the discharge safety verdict may be for the trigger interrupt to act on it - it's refreshed with every sample.
+#define BMS_VERDICT_MAX_AGE_MS 500
+
+//uAh = CC reading (1/16 LSB) * 211 / BMS_CC_UAH_DIVISOR - see bms_update_charge_count()
+#define BMS_CC_UAH_DIVISOR 5760
+
+//The sampler runs on each CC_READY (250mS) - this is how long it waits if they stop arriving.
+#define BMS_SAMPLE_MAX_AGE_MS 1000
 
+//How long to wait, with the charger still connected after charging, before going to sleep.
+#define BMS_CHARGER_IDLE_MS 30000
+//How long to pause charging each time a cell reaches full voltage.
+#define BMS_CHARGE_PAUSE_MS 30000
 
 #endif /* BMS_H_ */
\ No newline at end of file
@@ -16,7 +16,11 @@ int bq7693_read_block(uint8_t start_addr, size_t len, uint8_t* buf);
 int bq7693_write_block(uint8_t start_addr, size_t len, uint8_t *buf);
 uint8_t bq7693_calc_checksum(uint8_t inCrc, uint8_t data);
 
-volatile uint16_t bq7693_cell_voltages[7];
+//The cells are connected to these BQ7693 inputs (VC1 = 0) on these packs...
+static const uint8_t bq7693_cell_inputs[NUM_CELLS] = { 0,1,2,3,5,6,9};
+
+//Last value written to SYS_CTRL2, to know whether the FETs are on without an I2C read.
+static volatile uint8_t bq7693_sys_ctrl2 = 0;
 
 volatile int bq7693_adc_gain = 0;   // in uV/LSB
 volatile int8_t bq7693_adc_offset = 0; //in mV
@@ -102,6 +106,7 @@ bool bq7693_read_register(uint8_t addr, size_t len, uint8_t *buf) {
 	//Disable interrupts from the EIC - we don't want to end up trying to read the
 	//charge counter half way through an existing i2c op. Re-enable at the end.
 	system_interrupt_disable(4);
+	PERF_TIMESTAMP(masked_at);
 	
 	uint16_t timeout = 0;
 	bool result = true;
@@ -131,7 +136,13 @@ bool bq7693_read_register(uint8_t addr, size_t len, uint8_t *buf) {
 			break;
 		}
 	}
+	trace_i2c_read(addr, buf, len, result);
 	
+	PERF_INC(i2c_transactions);
+	PERF_ADD(i2c_bytes, 1 + len);
+	PERF_ADD(i2c_retries, timeout);
+	PERF_ADD(i2c_timeouts, !result);
+	PERF_EIC_UNMASKED(masked_at);
 	system_interrupt_enable(4);
 	return result;
 }
@@ -140,6 +151,7 @@ bool bq7693_write_register(uint8_t addr, uint8_t value) {
 	//Disable interrupts from the EIC - we don't want to end up trying to read the
 	//charge counter half way through an existing i2c op. Re-enable at the end.
 	system_interrupt_disable(4);
+	PERF_TIMESTAMP(masked_at);
 	
 	uint16_t timeout = 0;
 	bool result = true;
@@ -168,6 +180,16 @@ bool bq7693_write_register(uint8_t addr, uint8_t value) {
 			break;
 		}
 	}	
+	trace_i2c_write(addr, value);
+	if (addr == SYS_CTRL2 && result) {
+		bq7693_sys_ctrl2 = value;
+	}
+	
+	PERF_INC(i2c_transactions);
+	PERF_ADD(i2c_bytes, 3);
+	PERF_ADD(i2c_retries, timeout);
+	PERF_ADD(i2c_timeouts, !result);
+	PERF_EIC_UNMASKED(masked_at);
 	system_interrupt_enable(4);
 	return result;
 }
@@ -187,38 +209,68 @@ uint8_t bq7693_calc_checksum(uint8_t inCrc, uint8_t inData) {
 	return data;
 }
 
+//Write SYS_CTRL2 with the FET bits (CHG_ON 0x01, DSG_ON 0x02) set to fets, keeping the coulomb counter's mode -
+//a plain CC_EN would cut short a one-shot reading that bms_cc_oneshot_at_step() is waiting on. Rewriting
+//CC_ONESHOT starts that reading over, which the one-shot's accounting absorbs.
+static bool bq7693_write_fets(uint8_t fets) {
+	//Masked from reading the shadow to the write, so the ALERT interrupt can't change the mode in between.
+	//bq7693_write_register() unmasks again once the write is done.
+	system_interrupt_disable(4);
+	uint8_t cc_mode = bq7693_sys_ctrl2 & 0x60;
+	return bq7693_write_register(SYS_CTRL2, (cc_mode ? cc_mode : 0x40) | fets);
+}
+
 void bq7693_enable_charge() {
 	uint8_t scratch;
 	//Clear any bits in the SYS_STAT error register
 	bq7693_read_register(SYS_STAT, 1, &scratch);
 	bq7693_write_register(SYS_STAT, scratch); //Explicitly clear any set bits in the SYS_STAT register by writing them back.
 	//CHG_ON enables the charge FET.
-	bq7693_write_register(SYS_CTRL2, 0x41); //CC_EN, CHG_ON
+	bq7693_write_fets(0x01); //CHG_ON
 }
 
 void bq7693_disable_charge() {
-	bq7693_write_register(SYS_CTRL2, 0x40); //CC_EN, CHG_ON = 0
+	bq7693_write_fets(0x00); //CHG_ON = 0
 }
 
-void bq7693_enable_discharge() {
-	bq7693_write_register(SYS_CTRL2, 0x40);  //CC_EN=1
+void bq7693_prepare_discharge() {
+	//Everything needed before the discharge FET goes on, so that turning it on is then a single write.
+	//Safe to leave in place while idle - the FETs stay off.
+	bq7693_write_fets(0x00);  //FETs off, CC running
 	bq7693_write_register(SYS_CTRL1, 0x18);  //ADC_EN=1, TEMP_SEL=1
 	
+	//Short circuit protection relaxed to the maximum while the vacuum's input capacitors charge.
 	bq7693_write_register(PROTECT1, 0x9F); 
 	bq7693_write_register(PROTECT2, 0x04);
 
 	uint8_t scratch;
 	bq7693_read_register(SYS_STAT, 1, &scratch);
 	bq7693_write_register(SYS_STAT, scratch); //Explicitly clear any set bits in the SYS_STAT register by writing them back.
-	
-	//DSG_ON turns the discharge FET on.
-	bq7693_write_register(SYS_CTRL2, 0x42);//CC_EN, DSG_ON
+}
+
+bool bq7693_enable_discharge_fast() {
+	//DSG_ON turns the discharge FET on - bq7693_prepare_discharge() must have been called first.
+	return bq7693_write_fets(0x02);//DSG_ON
+}
+
+void bq7693_finish_discharge_enable() {
+	//Inrush is over, restore the normal short circuit protection.
 	bq7693_write_register(PROTECT2, 0x04);
 	bq7693_write_register(PROTECT1, 0x82);
 }
 
+void bq7693_enable_discharge() {
+	bq7693_prepare_discharge();
+	bq7693_enable_discharge_fast();
+	bq7693_finish_discharge_enable();
+}
+
 void bq7693_disable_discharge() {
-	bq7693_write_register(SYS_CTRL2, 0x40);//CC_EN, DSG_OFF
+	bq7693_write_fets(0x00);//DSG_OFF
+}
+
+void bq7693_disable_fets() {
+	bq7693_write_fets(0x00);
 }
 
 int bq7693_read_temperature() {
@@ -247,20 +299,16 @@ int bq7693_read_temperature() {
 	return result;
 }
 
-uint16_t *bq7693_get_cell_voltages() {
+void bq7693_get_cell_voltages(uint16_t *cell_voltages) {
 	volatile uint8_t scratch[3];
 	volatile uint16_t tempval;
-	//Voltages for each cell
-	//The cells are connected as below on these packs...
-	int cellsToRead[] = { 0,1,2,3,5,6,9};
-	for (int i=0; i< 7; ++i) {
+	//Voltages for each cell, into the caller's buffer of NUM_CELLS entries
+	for (int i=0; i< NUM_CELLS; ++i) {
 		//Because CRC is enabled, we need to read 3 bytes (VCx_HI, the CRC byte (ignore), then VCx_Lo)
-		bq7693_read_register((VC1_HI_BYTE + 2*cellsToRead[i]), 3, scratch);
+		bq7693_read_register((VC1_HI_BYTE + 2*bq7693_cell_inputs[i]), 3, scratch);
 		tempval = ((scratch[0] & 0x3F) <<8) | scratch[2];
-		bq7693_cell_voltages[i] = tempval * bq7693_adc_gain/1000 + bq7693_adc_offset;
+		cell_voltages[i] = tempval * bq7693_adc_gain/1000 + bq7693_adc_offset;
 	}
-
-	return bq7693_cell_voltages;
 }
 
 int bq7693_get_pack_voltage() {
@@ -272,6 +320,42 @@ int bq7693_get_pack_voltage() {
 	return bq7693_pack_voltage;
 }
 
+bool bq7693_set_balancing(uint8_t cell_mask) {
+	//Map pack cells onto the BQ7693 inputs - CELLBAL1 covers VC1-5, CELLBAL2 VC6-10.
+	uint16_t inputs = 0;
+	for (int i=0; i<NUM_CELLS; ++i) {
+		if (cell_mask & (1 << i)) {
+			inputs |= 1 << bq7693_cell_inputs[i];
+		}
+	}
+	//Balancing two adjacent inputs at once isn't allowed - see datasheet.
+	bool refused = (inputs & (inputs >> 1)) != 0;
+	if (refused) {
+		inputs = 0;
+	}
+	bool result = bq7693_write_register(CELLBAL1, inputs & 0x1F);
+	result &= bq7693_write_register(CELLBAL2, (inputs >> 5) & 0x1F);
+	return result && !refused;
+}
+
+void bq7693_start_cc_oneshot() {
+	//CC_EN off, CC_ONESHOT on - a single 250mS reading starting now, rather than wherever the continuous cycle is.
+	//The FETs are left as they are.
+	bq7693_write_register(SYS_CTRL2, (bq7693_sys_ctrl2 & 0x03) | 0x20);
+}
+
+void bq7693_resume_cc_continuous() {
+	bq7693_write_register(SYS_CTRL2, (bq7693_sys_ctrl2 & 0x03) | 0x40);
+}
+
+bool bq7693_cc_oneshot_active() {
+	return (bq7693_sys_ctrl2 & 0x60) == 0x20;
+}
+
+bool bq7693_fets_on() {
+	return (bq7693_sys_ctrl2 & 0x03) != 0; //CHG_ON or DSG_ON
+}
+
 void bq7693_enter_sleep_mode() {
 	bq7693_write_register(SYS_CTRL1, 0x00);
 	bq7693_write_register(SYS_CTRL1, 0x01);
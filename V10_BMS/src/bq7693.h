@@ -16,6 +16,8 @@
 #include <inttypes.h>
 #include "asf.h"
 #include "config.h"
+#include "trace.h"
+#include "perf.h"
 
 //I2C address of the device
 #define BQ7693_ADDR 0x08
@@ -27,13 +29,32 @@ void bq7693_init(void);
 bool bq7693_read_register(uint8_t addr, size_t len, uint8_t *buf);
 bool bq7693_write_register(uint8_t addr, uint8_t data);
 
-uint16_t* bq7693_get_cell_voltages(void);
+void bq7693_get_cell_voltages(uint16_t *cell_voltages);
 int bq7693_get_pack_voltage(void);
 void bq7693_enable_charge(void);
 void bq7693_enable_discharge(void);
 
+//bq7693_enable_discharge() split up, so the FET can be switched on with one I2C write from the trigger interrupt.
+void bq7693_prepare_discharge(void);
+bool bq7693_enable_discharge_fast(void);
+void bq7693_finish_discharge_enable(void);
+
+//Bleed the cells in cell_mask (bit 0 = cell 0). Refuses (and clears balancing) if they'd include adjacent inputs.
+bool bq7693_set_balancing(uint8_t cell_mask);
+
 void bq7693_disable_charge(void);
 void bq7693_disable_discharge(void);
+//Both off - from the ALERT interrupt on a fault.
+void bq7693_disable_fets(void);
+
+//As last set by this firmware - the BQ7693 also turns them off itself on a fault.
+bool bq7693_fets_on(void);
+
+//Switch the coulomb counter to a single reading starting now, and back to continuous once it's done (CC_READY).
+//The FET functions leave the CC mode alone - a one-shot in progress is restarted rather than cancelled.
+void bq7693_start_cc_oneshot(void);
+void bq7693_resume_cc_continuous(void);
+bool bq7693_cc_oneshot_active(void);
 
 void bq7693_enter_sleep_mode(void);
 int bq7693_read_temperature(void);
@@ -0,0 +1,84 @@
+/*
+ * cc_cal.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "cc_cal.h"
+
+extern volatile struct eeprom_data eeprom_data;
+
+static volatile int16_t cc_cal_current_offset = 0;
+
+static int16_t cc_cal_samples[CC_CAL_SAMPLES];
+static uint8_t cc_cal_count = 0;
+static uint8_t cc_cal_settle = 0;
+
+static bool cc_cal_plausible(int32_t offset) {
+	return offset <= (CC_CAL_MAX_OFFSET << CC_CAL_SHIFT) && offset >= -(CC_CAL_MAX_OFFSET << CC_CAL_SHIFT);
+}
+
+void cc_cal_init() {
+	//eeprom_data has been read by now. A stored offset no calibration could have produced is garbage - start again.
+	if (!cc_cal_plausible(eeprom_data.cc_offset)) {
+		eeprom_data.cc_offset = 0;
+	}
+	cc_cal_current_offset = eeprom_data.cc_offset;
+	cc_cal_count = 0;
+	cc_cal_settle = 0;
+}
+
+static void cc_cal_finish(void) {
+	//Insertion sort - only a few dozen entries, and it's done once every few seconds.
+	for (int i=1; i<CC_CAL_SAMPLES; ++i) {
+		int16_t val = cc_cal_samples[i];
+		int j = i - 1;
+		while (j >= 0 && cc_cal_samples[j] > val) {
+			cc_cal_samples[j + 1] = cc_cal_samples[j];
+			j--;
+		}
+		cc_cal_samples[j + 1] = val;
+	}
+	
+	//Trimmed mean of the middle half - a stray reading (eg a charger being plugged in) doesn't skew it.
+	int32_t sum = 0;
+	for (int i=CC_CAL_SAMPLES / 4; i < CC_CAL_SAMPLES - CC_CAL_SAMPLES / 4; ++i) {
+		sum += cc_cal_samples[i];
+	}
+	int32_t offset = sum * (1 << CC_CAL_SHIFT) / (CC_CAL_SAMPLES / 2);
+	
+	if (!cc_cal_plausible(offset)) {
+		//Not an offset - something was flowing.
+		return;
+	}
+	
+	int16_t old = eeprom_data.cc_offset;
+	eeprom_data.cc_offset = old + (offset - old) / (1 << CC_CAL_FILTER_SHIFT);
+	cc_cal_current_offset = eeprom_data.cc_offset;
+}
+
+void cc_cal_update(const struct telemetry *sample) {
+	if (sample->fets_on) {
+		cc_cal_count = 0;
+		cc_cal_settle = 0;
+		return;
+	}
+	
+	//The first CC readings after the FETs go off can still include some load current.
+	if (cc_cal_settle < CC_CAL_SETTLE_SAMPLES) {
+		cc_cal_settle++;
+		return;
+	}
+	
+	cc_cal_samples[cc_cal_count++] = sample->cc_raw;
+	if (cc_cal_count == CC_CAL_SAMPLES) {
+		cc_cal_finish();
+		cc_cal_count = 0;
+	}
+}
+
+int16_t cc_cal_offset() {
+	return cc_cal_current_offset;
+}
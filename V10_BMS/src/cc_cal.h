@@ -0,0 +1,36 @@
+/*
+ * cc_cal.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef CC_CAL_H_
+#define CC_CAL_H_
+
+#include "asf.h"
+#include "config.h"
+#include "telemetry.h"
+#include "eeprom_handler.h"
+
+/* Coulomb counter zero offset calibration.
+
+With both FETs off, nothing flows through the sense resistor, so whatever the CC reads is its own
+offset. The sampler feeds in the raw CC readings taken while the FETs are off; once CC_CAL_SAMPLES have
+been collected, the middle half (sorted) is averaged and folded into the stored offset. The ALERT
+interrupt subtracts the offset from every CC reading, in place of the old +/-2 LSB deadband.
+
+The offset is in 1/16ths of a CC LSB (8.44uV), so the averaging gets below one LSB.
+*/
+
+#define CC_CAL_SHIFT 4
+
+void cc_cal_init(void);
+void cc_cal_update(const struct telemetry *sample);
+
+//Current offset, in 1/16 LSB - read from the ALERT interrupt.
+int16_t cc_cal_offset(void);
+
+#endif /* CC_CAL_H_ */
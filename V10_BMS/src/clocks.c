@@ -0,0 +1,71 @@
+/*
+ * clocks.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "clocks.h"
+
+static enum CLOCK_PROFILE clocks_current_profile = CLOCK_PROFILE_FULL;
+
+static void clocks_set_dividers(enum system_main_clock_div divider) {
+	//The APB buses must never run faster than the CPU.
+	system_apb_clock_set_divider(SYSTEM_CLOCK_APB_APBA, divider);
+	system_apb_clock_set_divider(SYSTEM_CLOCK_APB_APBB, divider);
+	system_apb_clock_set_divider(SYSTEM_CLOCK_APB_APBC, divider);
+}
+
+void clocks_init() {
+#ifdef CLOCK_GATING
+	//On from reset, but unused - no RTC, and the ADC isn't fitted to anything.
+	system_apb_clock_clear_mask(SYSTEM_CLOCK_APB_APBA, PM_APBAMASK_RTC);
+	system_apb_clock_clear_mask(SYSTEM_CLOCK_APB_APBC, PM_APBCMASK_ADC);
+#endif
+}
+
+void clocks_set_profile(enum CLOCK_PROFILE profile) {
+#ifdef CLOCK_GATING
+	if (profile == clocks_current_profile) {
+		return;
+	}
+	
+	if (profile == CLOCK_PROFILE_SLOW) {
+		//Slow the buses first, then the CPU.
+		clocks_set_dividers(CLOCK_SLOW_DIVIDER);
+		system_cpu_clock_set_divider(CLOCK_SLOW_DIVIDER);
+	}
+	else {
+		//Speed up the CPU first, then the buses.
+		system_cpu_clock_set_divider(SYSTEM_MAIN_CLOCK_DIV_1);
+		clocks_set_dividers(SYSTEM_MAIN_CLOCK_DIV_1);
+	}
+	clocks_current_profile = profile;
+	
+	//SysTick runs from the CPU clock.
+	systime_clock_changed();
+	delay_init();
+#endif
+}
+
+enum CLOCK_PROFILE clocks_profile() {
+	return clocks_current_profile;
+}
+
+void clocks_sercom_enable(uint8_t sercom, bool enable) {
+#ifdef CLOCK_GATING
+	//SERCOMn's APBC mask bits and GCLK channels are consecutive.
+	uint32_t apb_mask = PM_APBCMASK_SERCOM0 << sercom;
+	uint8_t gclk_channel = SERCOM0_GCLK_ID_CORE + sercom;
+	
+	if (enable) {
+		system_apb_clock_set_mask(SYSTEM_CLOCK_APB_APBC, apb_mask);
+		system_gclk_chan_enable(gclk_channel);
+	}
+	else {
+		system_gclk_chan_disable(gclk_channel);
+		system_apb_clock_clear_mask(SYSTEM_CLOCK_APB_APBC, apb_mask);
+	}
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ * clocks.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef CLOCKS_H_
+#define CLOCKS_H_
+
+#include "asf.h"
+#include "systime.h"
+#include "config.h"
+
+/* Clock profiles and peripheral clock gating.
+
+Everything runs from OSC8M on GCLK generator 0. The SERCOMs take their baud clocks from the generator,
+not the CPU, so the CPU (and APB buses) can be divided down without disturbing the USARTs or I2C.
+The state machine picks a profile for each state, and the serial drivers gate their own SERCOM.
+*/
+
+enum CLOCK_PROFILE {
+	CLOCK_PROFILE_FULL,		//8MHz - discharging, and the short states in between
+	CLOCK_PROFILE_SLOW,		//CLOCK_SLOW_DIVIDER - idle, charging, fault
+};
+
+//Gate the clocks of peripherals we never use.
+void clocks_init(void);
+
+void clocks_set_profile(enum CLOCK_PROFILE profile);
+enum CLOCK_PROFILE clocks_profile(void);
+
+//Turn a SERCOM's bus and core clocks on or off - disable the peripheral before gating it.
+void clocks_sercom_enable(uint8_t sercom, bool enable);
+
+#endif /* CLOCKS_H_ */
@@ -32,13 +32,20 @@
 
 //PA07 is attached to thermistor RT1
 
+#define NUM_CELLS 7 //Cells in the pack - see bq7693_get_cell_voltages() for which BQ7693 inputs they're on.
+
 //Some packs have Molicell INR18650P26a - datasheet https://www.molicel.com/wp-content/uploads/INR18650P26A-V2-80087.pdf
 #define CELL_LOWEST_DISCHARGE_VOLTAGE 2500	//mV - wont allow pack to discharge if any cells lower than this
+#define CELL_IR_COMPENSATION 1				//Compare the estimated resting voltage (from cell resistance and current) with the above, rather than the loaded voltage
+#define CELL_IR_COMP_MAX_MV 600				//mV - most the loaded voltage may be compensated by
 #define CELL_LOWEST_CHARGE_VOLTAGE 2000		//mV - won't try to charge the pack if any cells lower than this
 #define CELL_FULL_CHARGE_VOLTAGE 4200		//mV - fully charged cell voltage.
+#define CELL_NOMINAL_VOLTAGE 3600			//mV - only used for a first guess at the pack's energy capacity
 
 #define CELL_OVERVOLTAGE_TRIP  4250		//BMS will trip out at this voltage - NB DO NOT set outside of 3150mV - 4700mV or it wont' work! 
 #define CELL_UNDERVOLTAGE_TRIP 2450		//BMS will trip out at this voltage - NB DO NOT set outside of 1700mv - 3000mV or it wont' work!
+										//This is on the loaded voltage, so stays as the backstop when CELL_IR_COMPENSATION is on.
+#define CELL_UV_TRIP_MARGIN 25				//mV - with CELL_IR_COMPENSATION, the BMS stops discharge once a loaded cell is within this of the UV trip, rather than faulting on it
 
 //18650 cell temperature limits from Molicell datasheet.
 #define MAX_PACK_TEMPERATURE 60				//'C - if pack temperature greater than this, no charge/discharge allowed.
@@ -47,8 +54,64 @@
 
 #define IDLE_TIME 60 * 15 // Idle time in seconds. Pack will go into SHIP/deep sleep mode if nothing happens in this duration
 
+//State of charge estimator (see soc.h) - blends the coulomb count with the rested cell voltage.
+#define SOC_REST_CURRENT_MA 50			//mA - below this the pack counts as resting
+#define SOC_REST_MIN_MS 60000			//ms - rest needed before the cell voltage is used at all
+#define SOC_OCV_SETTLE_MS 1800000		//ms - rest after which the cell voltage is trusted fully
+#define SOC_OCV_UPDATE_MS 30000			//ms - how often a resting pack's voltage is fed in
+#define SOC_OCV_UNCERTAINTY_MV 15		//mV - error in the rested voltage vs the OCV table
+#define SOC_CC_VARIANCE 1				//(0.01%)^2 - uncertainty added by each coulomb counter sample, whatever the current
+#define SOC_CC_ERROR_PERMILLE 10		//per mille - coulomb counter error (1 sigma) as a share of the charge moved; added to the variance squared
+#define SOC_INITIAL_VARIANCE 1000000	//(0.01%)^2 - uncertainty of the stored charge level at power on (10%)
+#define SOC_BOOT_OCV_WEIGHT 75			//% - weight of the cell voltage vs the stored charge level when resyncing on wake from ship mode
+#define SOC_BOOT_CC_TIMEOUT_MS 1000		//ms - longest to wait for the BQ7693's first ADC/CC cycle at boot
+
+//Passive cell balancing (see balance.h) - while charging and once charged.
+#define BALANCE_MIN_CELL_VOLTAGE 3900	//mV - only bleed cells above this
+#define BALANCE_THRESHOLD_MV 15			//mV - bleed cells more than this above the lowest cell
+#define BALANCE_SLICES 8				//ADC cycles (250mS) of bleeding between each clean measurement
+
+#define CHARGE_TAPER_TERMINATION 1	//Stop charging once the current tapers off at full voltage (the pause/retry below remains as a fallback)
+#define CHARGE_TAPER_CELL_VOLTAGE 4150	//mV - highest cell must be at least this for the taper to count
+#define CHARGE_TAPER_C_DIVISOR 20		//Taper current is pack capacity / this, ie C/20
+#define CHARGE_TAPER_HOLD_MS 60000		//ms - current must stay below the taper current this long
+
+//Cell internal resistance, measured at load steps (see resistance.h).
+#define RESISTANCE_QUIET_MA 100			//mA - below this, no load
+#define RESISTANCE_MIN_STEP_MA 2000		//mA - smallest load step worth measuring
+#define RESISTANCE_MAX_GAP_MS 750		//ms - samples either side of the step must be this close
+#define RESISTANCE_MAX_UOHM 500000		//micro-ohms - anything higher is taken as a bad reading
+#define RESISTANCE_FILTER_SHIFT 3		//Each new reading moves the stored value 1/8 of the way
+
+#define ENERGY_POWER_EWMA_SHIFT 5		//Discharge power average for the runtime estimate - each sample counts 1/32 (~8s time constant)
+#define ENERGY_DISCHARGE_MIN_MA 500		//mA - only samples with the FETs on and at least this drawn count towards that average
+#define RUNTIME_WARNING_MINUTES 2		//Flash the lowest battery segment while discharging once the runtime left drops below this. Comment out to disable.
+
+//Coulomb counter (see cc_cal.h)
+#define CC_CAL_SAMPLES 32				//CC readings (250mS each) per offset calibration, taken with the FETs off
+#define CC_CAL_SETTLE_SAMPLES 4			//Readings ignored after the FETs go off
+#define CC_CAL_MAX_OFFSET 20			//LSBs - a bigger offset than this is assumed to be real current
+#define CC_CAL_FILTER_SHIFT 2			//Each calibration moves the stored offset 1/4 of the way
+
+//Self-consumption - drawn from the cells by the BQ7693, MCU and LEDs, which the CC doesn't see (see bms_self_consumption[]).
+//Estimates from the datasheets - replace with bench measurements of each clock profile.
+#define SELF_CONSUMPTION_BQ7693_UA 50	//uA - BQ7693 with the ADC and CC running, all the time
+#define SELF_CONSUMPTION_FULL_UA 1500	//uA - MCU awake at 8MHz
+#define SELF_CONSUMPTION_SLOW_UA 900	//uA - MCU awake in the slow clock profile
+#define SELF_CONSUMPTION_ASLEEP_UA 500	//uA - MCU in idle sleep
+#define SELF_CONSUMPTION_LEDS_UA 2000	//uA - battery LEDs, averaged over the states that show them
+
 #define FULL_CHARGE_PAUSE_COUNT 10 //Once a cell reaches max charge volts, pause for 30 seconds and retry, this many times.
 
+#define CLOCK_GATING 1 //Gate unused peripheral clocks, and slow the CPU in states with little to do (see clocks.h)
+#define CLOCK_SLOW_DIVIDER SYSTEM_MAIN_CLOCK_DIV_2 //CPU clock divider for the slow profile - 4MHz leaves time to stream the debug USART
+
+#define WATCHDOG 1 //Hardware watchdog, fed while the sampler, state machine and Dyson USART keep checking in (see watchdog.h)
+
 #define SERIAL_DEBUG 1 //Serial debug via the spare USART on the programming pins header
 
+#define PERF_COUNTERS 1 //Performance counters, printed by sending 'p' on the debug USART (see perf.h)
+
+//#define TRACE_CAPTURE 1 //Stream a binary trace of BQ7693 reads, pins and USART traffic over the debug USART instead of text (see trace.h)
+
 #endif /* CONFIG_H_ */
\ No newline at end of file
@@ -0,0 +1,103 @@
+/*
+ * crash.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "crash.h"
+
+extern enum BMS_STATE bms_state;
+
+//Left alone by the startup code, so it survives the reset.
+#define CRASH_DUMP_MAGIC 0x43524153
+static struct crash_dump crash_dump __attribute__((section(".noinit")));
+
+static void crash_capture(uint32_t *stacked) __attribute__((used, noreturn));
+static void crash_capture(uint32_t *stacked) {
+	crash_dump.time_ms = systime_ms();
+	crash_dump.bms_state = bms_state;
+	crash_dump.stack_high_water = stack_high_water();
+	
+	//If the stack pointer has run off the end of RAM, there's nothing to read.
+	uint32_t sp = (uint32_t)stacked;
+	for (uint8_t i=0; i<8; ++i) {
+		crash_dump.regs[i] = (sp >= HRAMC0_ADDR && sp + 32 <= HRAMC0_ADDR + HRAMC0_SIZE) ? stacked[i] : 0;
+	}
+	
+	memset(crash_dump.transitions, 0, sizeof(crash_dump.transitions));
+	bms_transition_trace_copy(crash_dump.transitions, CRASH_TRANSITIONS);
+	crash_dump.magic = CRASH_DUMP_MAGIC;
+	
+	//Make the pack safe before anything else can go wrong - the BQ7693 gets re-initialised on the way back up.
+	port_pin_set_output_level(ENABLE_CHARGE_PIN, false);
+	bq7693_write_register(SYS_CTRL2, 0x00);
+	
+	NVIC_SystemReset();
+	while (1);
+}
+
+//Replaces the startup code's spin-forever default. The core stacked R0-R3, R12, LR, PC and xPSR on whichever stack
+//was in use - bit 2 of EXC_RETURN in LR says which - so hand that to crash_capture().
+__attribute__((naked)) void HardFault_Handler(void) {
+	__asm volatile (
+		"movs r0, #4			\n"
+		"mov r1, lr				\n"
+		"tst r0, r1				\n"
+		"bne 1f					\n"
+		"mrs r0, msp			\n"
+		"b 2f					\n"
+		"1: mrs r0, psp			\n"
+		"2: ldr r1, =crash_capture	\n"
+		"bx r1					\n"
+	);
+}
+
+void crash_report() {
+	if (crash_dump.magic != CRASH_DUMP_MAGIC) {
+		return;
+	}
+	
+	//Keep a count of how many there have been alongside it.
+	struct crash_dump stored;
+	eeprom_read_page_data(EEPROM_CRASH_PAGE, &stored, sizeof(stored));
+	crash_dump.count = (stored.magic == CRASH_DUMP_MAGIC ? stored.count : 0) + 1;
+	
+	eeprom_write_page_data(EEPROM_CRASH_PAGE, &crash_dump, sizeof(crash_dump));
+	crash_dump.magic = 0;
+	
+#ifdef SERIAL_DEBUG
+	serial_debug_send_message("Recovered from a HardFault:\r\n");
+	crash_print();
+#endif
+}
+
+void crash_print() {
+#ifdef SERIAL_DEBUG
+	struct crash_dump dump;
+	eeprom_read_page_data(EEPROM_CRASH_PAGE, &dump, sizeof(dump));
+	if (dump.magic != CRASH_DUMP_MAGIC) {
+		serial_debug_send_message("No crash logged\r\n");
+		return;
+	}
+	
+	//tools/crash_decode.py looks for these lines.
+	sprintf(debug_msg_buffer, "Crash %d at %" PRIu32 " ms, state %d, stack high-water %d bytes\r\n", dump.count, dump.time_ms, dump.bms_state, dump.stack_high_water);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "PC 0x%08" PRIX32 " LR 0x%08" PRIX32 " xPSR 0x%08" PRIX32 "\r\n", dump.regs[6], dump.regs[5], dump.regs[7]);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "R0 0x%08" PRIX32 " R1 0x%08" PRIX32 " R2 0x%08" PRIX32 " R3 0x%08" PRIX32 "\r\n", dump.regs[0], dump.regs[1], dump.regs[2], dump.regs[3]);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "R12 0x%08" PRIX32 "\r\n", dump.regs[4]);
+	serial_debug_send_message(debug_msg_buffer);
+	for (uint8_t i=0; i<CRASH_TRANSITIONS; ++i) {
+		const struct bms_transition_record *record = &dump.transitions[i];
+		if (record->time_ms == 0) {
+			continue;
+		}
+		sprintf(debug_msg_buffer, "  %" PRIu32 " ms: %d -> %d, event %d, error %d\r\n", record->time_ms, record->from, record->to, record->event, record->error);
+		serial_debug_send_message(debug_msg_buffer);
+	}
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * crash.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef CRASH_H_
+#define CRASH_H_
+
+#include "asf.h"
+#include "bms.h"
+
+/* HardFault post-mortem.
+
+The HardFault handler saves the registers the core stacked, the state machine's state and last few transitions,
+and the stack high-water mark, into a dump in no-init RAM. Then it switches the FETs off and resets. On the next boot
+crash_report() copies the dump to its EEPROM page, so it survives a power cycle, and prints it - tools/crash_decode.py
+turns the printout into source lines using the ELF.
+
+Sized to fit one EEPROM page (EEPROM_PAGE_SIZE, 60 bytes).
+*/
+
+#define CRASH_TRANSITIONS 2
+
+struct crash_dump {
+	uint32_t magic;
+	uint32_t time_ms;
+	uint32_t regs[8];				//As stacked by the core: R0, R1, R2, R3, R12, LR, PC, xPSR
+	uint16_t stack_high_water;		//Most bytes of stack ever in use - all of it if the fault was an overflow
+	uint8_t bms_state;
+	uint8_t count;					//Crashes logged to EEPROM so far
+	struct bms_transition_record transitions[CRASH_TRANSITIONS];	//Most recent last
+};
+
+//Call once the EEPROM is up - logs and prints the dump if we've just come back from a HardFault.
+void crash_report(void);
+
+//Print the dump stored in EEPROM, if there is one.
+void crash_print(void);
+
+#endif /* CRASH_H_ */
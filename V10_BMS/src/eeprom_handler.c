@@ -10,6 +10,15 @@
 
 volatile struct eeprom_data eeprom_data;
 
+//How much of eeprom_data each layout version stored. Version 0 is firmware from before there was one - everything
+//after current_charge_level was whatever was on the stack.
+static const size_t eeprom_layout_end[EEPROM_LAYOUT_VERSION + 1] = {
+	offsetof(struct eeprom_data, layout_version),
+	offsetof(struct eeprom_data, energy_in),		//1 - cell resistances
+	offsetof(struct eeprom_data, cc_offset),		//2 - energy accounts
+	sizeof(struct eeprom_data),						//3 - coulomb counter offset
+};
+
 int eeprom_init() {
 	enum status_code error_code = eeprom_emulator_init();
 	if (error_code == STATUS_ERR_NO_MEMORY) {
@@ -29,6 +38,7 @@ int eeprom_init() {
 		//Write an initial guestimate of what a pack capacity might look like, we'll fine tune this by charging and discharging.
 		eeprom_data.total_pack_capacity = 2000000;  //in microAmpHours - equiv of 2000mAh.
 		eeprom_data.current_charge_level = 1000000; //half charged.
+		eeprom_data.layout_version = EEPROM_LAYOUT_TAG | EEPROM_LAYOUT_VERSION;
 		eeprom_write();
 		eeprom_emulator_commit_page_buffer();
 	}
@@ -39,18 +49,54 @@ int eeprom_init() {
 int eeprom_read() {
 	volatile uint8_t buffer[EEPROM_PAGE_SIZE];
 	eeprom_emulator_read_page(0, buffer);
+	trace_eeprom_read(0, (const uint8_t *)buffer, sizeof(eeprom_data));
 	memcpy(&eeprom_data, buffer, sizeof(eeprom_data));
+	
+	if (eeprom_data.layout_version != (EEPROM_LAYOUT_TAG | EEPROM_LAYOUT_VERSION)) {
+		//Written by older firmware - keep what that version stored, zero the fields added since.
+		//An untagged page, or a version we don't know, is treated as predating them all.
+		uint16_t version = eeprom_data.layout_version & 0x00FF;
+		if ((eeprom_data.layout_version & 0xFF00) != EEPROM_LAYOUT_TAG || version > EEPROM_LAYOUT_VERSION) {
+			version = 0;
+		}
+		size_t keep = eeprom_layout_end[version];
+		memset((uint8_t *)&eeprom_data + keep, 0, sizeof(eeprom_data) - keep);
+		eeprom_data.layout_version = EEPROM_LAYOUT_TAG | EEPROM_LAYOUT_VERSION;
+	}
 	return 0;
 }
 
 int eeprom_write() {
 	uint8_t buffer[EEPROM_PAGE_SIZE];
+	memset(buffer, 0, sizeof(buffer));
 	memcpy(buffer, &eeprom_data, sizeof(eeprom_data));
 	eeprom_emulator_write_page(0, buffer);	
 	eeprom_emulator_commit_page_buffer();
 	return 0;
 }
 
+int eeprom_read_page_data(uint8_t page, void *data, size_t len) {
+	if (len > EEPROM_PAGE_SIZE) {
+		return STATUS_ERR_INVALID_ARG;
+	}
+	uint8_t buffer[EEPROM_PAGE_SIZE];
+	enum status_code result = eeprom_emulator_read_page(page, buffer);
+	memcpy(data, buffer, len);
+	return result;
+}
+
+int eeprom_write_page_data(uint8_t page, const void *data, size_t len) {
+	if (len > EEPROM_PAGE_SIZE) {
+		return STATUS_ERR_INVALID_ARG;
+	}
+	uint8_t buffer[EEPROM_PAGE_SIZE];
+	memset(buffer, 0, sizeof(buffer));
+	memcpy(buffer, data, len);
+	eeprom_emulator_write_page(page, buffer);
+	eeprom_emulator_commit_page_buffer();
+	return 0;
+}
+
 int eeprom_fuses_set() {
 	//Set the the NVM
 	struct nvm_config config_nvm;
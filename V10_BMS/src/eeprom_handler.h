@@ -13,6 +13,7 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <string.h> //for memcpy
+#include <stddef.h> //for offsetof
  
 #include "eeprom.h"
 #include "nvm.h"
@@ -21,10 +22,27 @@
 #include "leds.h"
 #include "serial_debug.h"
 
+//Bump when fields are added below, and add where the new version ends to eeprom_layout_end[] - a page written
+//by older firmware keeps what it had, and only the fields added since are zeroed. Must fit in one page (EEPROM_PAGE_SIZE).
+#define EEPROM_LAYOUT_VERSION 3
+//Stored in the top byte of layout_version. Firmware from before there was a layout version only wrote the charge
+//data, leaving stack garbage where layout_version is - without the tag, that's taken as version 0.
+#define EEPROM_LAYOUT_TAG 0xB500
+
+//eeprom_data lives in page 0. Other pages hold their own records:
+#define EEPROM_CRASH_PAGE 1		//Last HardFault dump (see crash.h)
+
 //A struct to represent the stored eeprom data
 volatile struct eeprom_data {
 	int32_t total_pack_capacity; //micro-amp-hours
 	int32_t current_charge_level;	//micro-amp-hours
+	uint16_t layout_version;	//EEPROM_LAYOUT_TAG | version
+	uint16_t cell_resistance[NUM_CELLS];	//10s of micro-ohms, 0 = not measured yet
+	uint32_t energy_in;			//mWh, lifetime
+	uint32_t energy_out;		//mWh, lifetime
+	int32_t energy_level;		//mWh
+	int32_t energy_capacity;	//mWh
+	int16_t cc_offset;			//Coulomb counter zero offset, 1/16ths of an LSB
 };
 
 int eeprom_init(void);
@@ -32,6 +50,11 @@ int eeprom_init(void);
 int eeprom_read();
 int eeprom_write();
 
+//Read/write len (up to EEPROM_PAGE_SIZE) bytes at the start of one of the other pages. STATUS_ERR_INVALID_ARG,
+//and nothing copied, if len is more than that.
+int eeprom_read_page_data(uint8_t page, void *data, size_t len);
+int eeprom_write_page_data(uint8_t page, const void *data, size_t len);
+
 int eeprom_fuses_set(void);
 
 #endif /* EEPROM_H_ */
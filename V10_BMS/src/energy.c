@@ -0,0 +1,110 @@
+/*
+ * energy.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "energy.h"
+#include "serial_debug.h"
+
+extern volatile struct eeprom_data eeprom_data;
+
+//uW * ms in one mWh
+#define ENERGY_UW_MS_PER_MWH 3600000000LL
+
+static int64_t energy_remainder = 0;		//uW * ms not yet rolled up into eeprom_data.energy_level
+
+static int32_t energy_power_avg = 0;		//mW << ENERGY_POWER_EWMA_SHIFT, 0 = no discharge seen yet
+
+void energy_init() {
+	//Nothing learned yet - start from the charge figures at the nominal pack voltage.
+	if (eeprom_data.energy_capacity <= 0) {
+		eeprom_data.energy_capacity = ((int64_t)eeprom_data.total_pack_capacity * NUM_CELLS * CELL_NOMINAL_VOLTAGE) / 1000000;
+		eeprom_data.energy_level = ((int64_t)eeprom_data.current_charge_level * NUM_CELLS * CELL_NOMINAL_VOLTAGE) / 1000000;
+	}
+	energy_remainder = 0;
+}
+
+void energy_update(const struct telemetry *sample) {
+	//Only real use - CC noise at idle would otherwise drag the average down to nothing in a few seconds.
+	if (sample->fets_on && sample->current < -ENERGY_DISCHARGE_MIN_MA) {
+		//mV * mA = uW
+		int32_t power = ((int64_t)sample->pack_voltage * -sample->current) / 1000;
+		if (energy_power_avg == 0) {
+			energy_power_avg = power << ENERGY_POWER_EWMA_SHIFT;
+		}
+		else {
+			energy_power_avg += power - (energy_power_avg >> ENERGY_POWER_EWMA_SHIFT);
+		}
+	}
+	
+	//The charge counted since the last sample, however many CC readings that was. mV * uAh * 3600 = uW * ms
+	energy_remainder += (int64_t)sample->pack_voltage * sample->charge_uah * 3600;
+	int32_t mwh = energy_remainder / ENERGY_UW_MS_PER_MWH;
+	if (mwh == 0) {
+		return;
+	}
+	energy_remainder -= mwh * ENERGY_UW_MS_PER_MWH;
+	
+	if (mwh > 0) {
+		eeprom_data.energy_in += mwh;
+	}
+	else {
+		eeprom_data.energy_out -= mwh;
+	}
+	eeprom_data.energy_level += mwh;
+	
+	//Same as the charge count - if we've gone over full or under empty, the capacity estimate was out.
+	if (eeprom_data.energy_level > eeprom_data.energy_capacity) {
+		eeprom_data.energy_capacity = eeprom_data.energy_level;
+	}
+	if (eeprom_data.energy_level < 0) {
+		eeprom_data.energy_capacity -= eeprom_data.energy_level;
+		eeprom_data.energy_level = 0;
+	}
+}
+
+void energy_set_full() {
+	eeprom_data.energy_capacity = eeprom_data.energy_level;
+}
+
+void energy_set_empty() {
+	if (eeprom_data.energy_level > 0) {
+		eeprom_data.energy_capacity -= eeprom_data.energy_level;
+		eeprom_data.energy_level = 0;
+	}
+}
+
+int32_t energy_level_mwh() {
+	return eeprom_data.energy_level;
+}
+
+int32_t energy_capacity_mwh() {
+	return eeprom_data.energy_capacity;
+}
+
+uint16_t energy_runtime_minutes() {
+	int32_t power = energy_power_avg >> ENERGY_POWER_EWMA_SHIFT;
+	if (power <= 0) {
+		return ENERGY_RUNTIME_UNKNOWN;
+	}
+	int32_t minutes = (eeprom_data.energy_level * 60) / power;
+	return minutes < ENERGY_RUNTIME_UNKNOWN ? minutes : ENERGY_RUNTIME_UNKNOWN - 1;
+}
+
+void energy_print() {
+#ifdef SERIAL_DEBUG
+	sprintf(debug_msg_buffer, "Energy: %" PRId32 " of %" PRId32 " mWh\r\n", eeprom_data.energy_level, eeprom_data.energy_capacity);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "Energy in %" PRIu32 " mWh, out %" PRIu32 " mWh\r\n", eeprom_data.energy_in, eeprom_data.energy_out);
+	serial_debug_send_message(debug_msg_buffer);
+	
+	
+	if (energy_power_avg) {
+		sprintf(debug_msg_buffer, "Average draw %" PRId32 " mW, %u min left\r\n", energy_power_avg >> ENERGY_POWER_EWMA_SHIFT, energy_runtime_minutes());
+		serial_debug_send_message(debug_msg_buffer);
+	}
+#endif
+}
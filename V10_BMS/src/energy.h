@@ -0,0 +1,46 @@
+/*
+ * energy.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include "asf.h"
+#include "config.h"
+#include "telemetry.h"
+#include "eeprom_handler.h"
+
+/* Pack energy accounting, alongside the charge (uAh) count.
+
+Each sample adds pack voltage * the charge counted since the previous sample - so every CC reading is
+counted once, even if the sampler missed some, and the BMS's own draw along with it. The product is kept in
+64 bits (uW * ms) and rolled up into whole mWh, with the remainder carried over, so nothing is lost
+to rounding at low currents and nothing overflows at high ones.
+
+Kept in eeprom_data: lifetime energy in and out, the energy level now, and the learned energy
+capacity - learned the same way as the charge capacity, from full charges and flat packs.
+*/
+
+void energy_init(void);
+void energy_update(const struct telemetry *sample);
+
+//The pack has been charged to full / run flat - adjust the learned capacity.
+void energy_set_full(void);
+void energy_set_empty(void);
+
+int32_t energy_level_mwh(void);
+int32_t energy_capacity_mwh(void);
+
+//Remaining runtime in minutes at the average discharge power (an EWMA over samples taken while discharging, so
+//it carries the last use's draw through idle). ENERGY_RUNTIME_UNKNOWN until the pack has been used.
+#define ENERGY_RUNTIME_UNKNOWN 0xFFFF
+uint16_t energy_runtime_minutes(void);
+
+void energy_print(void);
+
+#endif /* ENERGY_H_ */
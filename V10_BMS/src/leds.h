@@ -12,13 +12,18 @@
 
 #include "asf.h"
 #include "config.h"
+#include "trace.h"
+#include "systime.h"
 
 void leds_init(void);
 void leds_sequence(void);
 void leds_display_battery_soc(int);
 void leds_flash_charging_segment(int);
 void leds_blink_error_led(int);
+void leds_set_error_led(bool);
 void leds_show_pack_flat(void);
+void leds_show_low_runtime(void);
+void leds_show_charging_segment(int);
 
 
 void leds_show_filter_err_status(bool);
@@ -0,0 +1,123 @@
+/*
+ * perf.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "perf.h"
+
+#ifdef PERF_COUNTERS
+
+#include <inttypes.h>
+#include <string.h>
+#include "serial_debug.h"
+#include "stack.h"
+
+struct perf_counters perf;
+
+static uint32_t perf_last_iteration_ms = 0;
+static uint8_t perf_last_iteration_state = 0xFF;
+
+void perf_reset() {
+	system_interrupt_enter_critical_section();
+	memset(&perf, 0, sizeof(perf));
+	perf_last_iteration_state = 0xFF;
+	system_interrupt_leave_critical_section();
+}
+
+void perf_track(struct perf_tracker *tracker, uint32_t value) {
+	//Trackers are updated from both ISRs and the main loop.
+	system_interrupt_enter_critical_section();
+	if (tracker->count == 0 || value < tracker->min) {
+		tracker->min = value;
+	}
+	if (value > tracker->max) {
+		tracker->max = value;
+	}
+	tracker->last = value;
+	tracker->count++;
+	system_interrupt_leave_critical_section();
+}
+
+void perf_eic_unmasked(uint32_t masked_at) {
+	uint32_t cycles = systime_cycles() - masked_at;
+	perf_track(&perf.eic_masked_cycles, cycles);
+	
+	//Keep the running total in ms, as it would overflow in cycles after a few minutes.
+	system_interrupt_enter_critical_section();
+	perf.eic_masked_remainder += cycles;
+	while (perf.eic_masked_remainder >= systime_cycles_per_ms()) {
+		perf.eic_masked_remainder -= systime_cycles_per_ms();
+		perf.eic_masked_total_ms++;
+	}
+	system_interrupt_leave_critical_section();
+}
+
+void perf_state_iteration(uint8_t state) {
+	//Called once per pass of a state handler's loop - time between consecutive calls from the same state.
+	uint32_t now = systime_ms();
+	if (state == perf_last_iteration_state && state < PERF_NUM_STATES) {
+		perf_track(&perf.state_iteration_ms[state], now - perf_last_iteration_ms);
+	}
+	perf_last_iteration_state = state;
+	perf_last_iteration_ms = now;
+}
+
+static void perf_print_tracker(const char *name, const struct perf_tracker *tracker) {
+	if (tracker->count == 0) {
+		return;
+	}
+	sprintf(debug_msg_buffer, "%s: %" PRIu32 "/%" PRIu32 "/%" PRIu32 " n=%" PRIu32 "\r\n", 
+		name, tracker->last, tracker->min, tracker->max, tracker->count);
+	serial_debug_send_message(debug_msg_buffer);
+}
+
+void perf_print() {
+	//Take a copy so the numbers are consistent with each other.
+	static struct perf_counters snapshot;
+	system_interrupt_enter_critical_section();
+	memcpy(&snapshot, &perf, sizeof(snapshot));
+	system_interrupt_leave_critical_section();
+	
+	sprintf(debug_msg_buffer, "Perf at %" PRIu32 " ms (trackers show last/min/max)\r\n", systime_ms());
+	serial_debug_send_message(debug_msg_buffer);
+	
+	sprintf(debug_msg_buffer, "I2C: %" PRIu32 " txns, %" PRIu32 " bytes\r\n", snapshot.i2c_transactions, snapshot.i2c_bytes);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "I2C: %" PRIu32 " retries, %" PRIu32 " timeouts\r\n", snapshot.i2c_retries, snapshot.i2c_timeouts);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "Samples: %" PRIu32 "\r\n", snapshot.samples);
+	serial_debug_send_message(debug_msg_buffer);
+	
+	sprintf(debug_msg_buffer, "EIC masked: %" PRIu32 " ms total\r\n", snapshot.eic_masked_total_ms);
+	serial_debug_send_message(debug_msg_buffer);
+	perf_print_tracker("EIC masked cycles", &snapshot.eic_masked_cycles);
+	perf_print_tracker("CC ISR cycles", &snapshot.cc_isr_cycles);
+	perf_print_tracker("Trigger to DSG cycles", &snapshot.trigger_to_dsg_cycles);
+	perf_print_tracker("Fault to LED cycles", &snapshot.fault_to_led_cycles);
+	perf_print_tracker("Fault to log ms", &snapshot.fault_to_log_ms);
+	
+	for (int i=0; i<PERF_NUM_STATES; ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "State %d handler ms", i);
+		perf_print_tracker(name, &snapshot.state_handler_ms[i]);
+		snprintf(name, sizeof(name), "State %d loop ms", i);
+		perf_print_tracker(name, &snapshot.state_iteration_ms[i]);
+	}
+	
+	sprintf(debug_msg_buffer, "Dyson tx: %" PRIu32 " frames, %" PRIu32 " errors\r\n", snapshot.dyson_tx_frames, snapshot.dyson_tx_errors);
+	serial_debug_send_message(debug_msg_buffer);
+	sprintf(debug_msg_buffer, "Dyson rx: %" PRIu32 " buffers, %" PRIu32 " frames, %" PRIu32 " bad\r\n",
+		snapshot.dyson_rx_buffers, snapshot.dyson_rx_frames, snapshot.dyson_rx_parse_failures);
+	serial_debug_send_message(debug_msg_buffer);
+	
+	sprintf(debug_msg_buffer, "Debug: %" PRIu32 " bytes, %" PRIu32 " dropped\r\n", snapshot.debug_bytes, snapshot.debug_drops);
+	serial_debug_send_message(debug_msg_buffer);
+	
+	sprintf(debug_msg_buffer, "Stack: %u of %u bytes high-water\r\n", stack_high_water(), stack_size());
+	serial_debug_send_message(debug_msg_buffer);
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * perf.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef PERF_H_
+#define PERF_H_
+
+#include "asf.h"
+#include "config.h"
+#include "systime.h"
+
+/* Runtime performance counters, enabled by PERF_COUNTERS in config.h.
+
+Send 'p' on the debug USART to print them, 'r' to reset them.
+With PERF_COUNTERS undefined, all of the PERF_ macros below compile away to nothing.
+*/
+
+#define PERF_NUM_STATES 9	//Entries in enum BMS_STATE
+
+//Min/max tracker for a duration or other measurement.
+struct perf_tracker {
+	uint32_t count;
+	uint32_t last;
+	uint32_t min;
+	uint32_t max;
+};
+
+struct perf_counters {
+	//BQ7693 I2C traffic
+	uint32_t i2c_transactions;
+	uint32_t i2c_bytes;
+	uint32_t i2c_retries;
+	uint32_t i2c_timeouts;
+	uint32_t samples;				//Telemetry snapshots taken by the sampler
+	
+	//Time with the EIC interrupt (BQ7693 ALERT) masked during I2C operations
+	struct perf_tracker eic_masked_cycles;
+	uint32_t eic_masked_total_ms;
+	uint32_t eic_masked_remainder;	//Cycles not yet rolled up into eic_masked_total_ms
+	
+	struct perf_tracker cc_isr_cycles;
+	
+	//ALERT interrupt entry to the error LED going on, and fault time to it being logged by the state machine
+	struct perf_tracker fault_to_led_cycles;
+	struct perf_tracker fault_to_log_ms;
+	
+	//Trigger interrupt entry to the DSG_ON write completing, on the fast path
+	struct perf_tracker trigger_to_dsg_cycles;
+	
+	//Time spent in each state handler call from bms_mainloop(), and per-iteration time of the handlers' own loops
+	struct perf_tracker state_handler_ms[PERF_NUM_STATES];
+	struct perf_tracker state_iteration_ms[PERF_NUM_STATES];
+	
+	//Dyson USART
+	uint32_t dyson_tx_frames;
+	uint32_t dyson_tx_errors;
+	uint32_t dyson_rx_buffers;
+	uint32_t dyson_rx_frames;
+	uint32_t dyson_rx_parse_failures;
+	
+	//Debug USART
+	uint32_t debug_bytes;
+	uint32_t debug_drops;
+};
+
+#ifdef PERF_COUNTERS
+
+extern struct perf_counters perf;
+
+void perf_reset(void);
+void perf_print(void);
+void perf_track(struct perf_tracker *tracker, uint32_t value);
+void perf_eic_unmasked(uint32_t masked_at);
+void perf_state_iteration(uint8_t state);
+
+#define PERF_INC(counter)				(perf.counter++)
+#define PERF_ADD(counter, n)			(perf.counter += (n))
+#define PERF_TIMESTAMP(name)			uint32_t name = systime_cycles()
+#define PERF_TIMESTAMP_MS(name)			uint32_t name = systime_ms()
+#define PERF_TRACK_CYCLES(tracker, since)	perf_track(&perf.tracker, systime_cycles() - (since))
+#define PERF_TRACK_MS(tracker, since)	perf_track(&perf.tracker, systime_ms() - (since))
+#define PERF_EIC_UNMASKED(since)		perf_eic_unmasked(since)
+#define PERF_STATE_ITERATION(state)		perf_state_iteration(state)
+
+#else
+
+#define PERF_INC(counter)
+#define PERF_ADD(counter, n)
+#define PERF_TIMESTAMP(name)
+#define PERF_TIMESTAMP_MS(name)
+#define PERF_TRACK_CYCLES(tracker, since)
+#define PERF_TRACK_MS(tracker, since)
+#define PERF_EIC_UNMASKED(since)
+#define PERF_STATE_ITERATION(state)
+
+#endif
+
+#endif /* PERF_H_ */
@@ -0,0 +1,140 @@
+/*
+ * resistance.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "resistance.h"
+#include "serial_debug.h"
+
+extern volatile struct eeprom_data eeprom_data;
+
+enum RESISTANCE_PHASE {
+	RESISTANCE_QUIET,		//No current - waiting for a load to be applied
+	RESISTANCE_STEP_ON,		//The last sample straddled the load being applied
+	RESISTANCE_LOADED,		//Under load - waiting for it to be removed
+	RESISTANCE_STEP_OFF,	//The last sample straddled the load being removed
+};
+
+static enum RESISTANCE_PHASE resistance_phase = RESISTANCE_QUIET;
+static struct telemetry resistance_ref;	//Last sample before the step
+static bool resistance_ref_valid = false;
+
+static void resistance_measure(const struct telemetry *before, const struct telemetry *after) {
+	int32_t delta_i = after->current - before->current;
+	
+	//Too small a step, too far apart, or skewed by balancing - not worth having.
+	if ((delta_i < 0 ? -delta_i : delta_i) < RESISTANCE_MIN_STEP_MA) {
+		return;
+	}
+	if (after->time_ms - before->time_ms > RESISTANCE_MAX_GAP_MS || before->balancing || after->balancing) {
+		return;
+	}
+	
+	for (int i=0; i<NUM_CELLS; ++i) {
+		//mV / mA = ohms, so * 100000 gives 10s of micro-ohms.
+		int32_t r = (((int32_t)after->cell_voltages[i] - before->cell_voltages[i]) * 100000) / delta_i;
+		if (r <= 0 || r > RESISTANCE_MAX_UOHM / 10) {
+			continue;
+		}
+		
+		uint16_t old = eeprom_data.cell_resistance[i];
+		if (old == 0) {
+			eeprom_data.cell_resistance[i] = r;
+		}
+		else {
+			eeprom_data.cell_resistance[i] = old + (r - old) / (1 << RESISTANCE_FILTER_SHIFT);
+		}
+	}
+	
+#ifdef SERIAL_DEBUG
+	sprintf(debug_msg_buffer, "%s: %" PRId32 " mA step\r\n", __FUNCTION__, delta_i);
+	serial_debug_send_message(debug_msg_buffer);
+	resistance_print();
+#endif
+}
+
+void resistance_update(const struct telemetry *sample) {
+	int32_t current = sample->current < 0 ? -sample->current : sample->current;
+	bool quiet = current <= RESISTANCE_QUIET_MA;
+	
+	switch (resistance_phase) {
+		case RESISTANCE_QUIET:
+			if (!quiet && sample->cc_oneshot && resistance_ref_valid) {
+				//A one-shot reading started after the step - nothing to skip.
+				resistance_measure(&resistance_ref, sample);
+				resistance_phase = RESISTANCE_LOADED;
+			}
+			else if (!quiet) {
+				resistance_phase = RESISTANCE_STEP_ON;
+				return;
+			}
+			break;
+		
+		case RESISTANCE_STEP_ON:
+			if (quiet) {
+				//Just a blip.
+				resistance_phase = RESISTANCE_QUIET;
+				break;
+			}
+			if (resistance_ref_valid) {
+				resistance_measure(&resistance_ref, sample);
+			}
+			resistance_phase = RESISTANCE_LOADED;
+			break;
+		
+		case RESISTANCE_LOADED:
+			if (quiet && sample->cc_oneshot && resistance_ref_valid) {
+				resistance_measure(&resistance_ref, sample);
+				resistance_phase = RESISTANCE_QUIET;
+			}
+			else if (quiet) {
+				resistance_phase = RESISTANCE_STEP_OFF;
+				return;
+			}
+			break;
+		
+		case RESISTANCE_STEP_OFF:
+			if (!quiet) {
+				resistance_phase = RESISTANCE_LOADED;
+				break;
+			}
+			if (resistance_ref_valid) {
+				resistance_measure(&resistance_ref, sample);
+			}
+			resistance_phase = RESISTANCE_QUIET;
+			break;
+	}
+	
+	//The reference for the next step is the last sample that didn't straddle one.
+	resistance_ref = *sample;
+	resistance_ref_valid = true;
+}
+
+uint32_t resistance_cell_uohm(uint8_t cell) {
+	return cell < NUM_CELLS ? eeprom_data.cell_resistance[cell] * 10UL : 0;
+}
+
+uint16_t resistance_compensate(uint8_t cell, uint16_t cell_mv, int32_t current_ma) {
+	if (current_ma >= 0) {
+		return cell_mv;
+	}
+	//mA * micro-ohms = nV
+	uint32_t sag = ((uint64_t)(-current_ma) * resistance_cell_uohm(cell)) / 1000000;
+	if (sag > CELL_IR_COMP_MAX_MV) {
+		sag = CELL_IR_COMP_MAX_MV;
+	}
+	return cell_mv + sag;
+}
+
+void resistance_print() {
+#ifdef SERIAL_DEBUG
+	for (int i=0; i<NUM_CELLS; ++i) {
+		uint32_t uohm = resistance_cell_uohm(i);
+		sprintf(debug_msg_buffer, "Cell %d: %" PRIu32 ".%02" PRIu32 " mOhm\r\n", i, uohm / 1000, (uohm % 1000) / 10);
+		serial_debug_send_message(debug_msg_buffer);
+	}
+#endif
+}
@@ -0,0 +1,41 @@
+/*
+ * resistance.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef RESISTANCE_H_
+#define RESISTANCE_H_
+
+#include "asf.h"
+#include "config.h"
+#include "telemetry.h"
+#include "eeprom_handler.h"
+
+/* Per-cell internal resistance, measured from the load steps at the start and end of each discharge.
+
+R = dV/dI between the last sample before the step and the first sample wholly after it - the sample
+whose CC window straddles the step only saw part of the current, so it's skipped, unless the state
+machine started a one-shot CC reading at the step, in which case the very next sample will do. That gives the
+resistance as seen ~250-500mS after the step, which includes some of the cell's polarisation, and
+the cell's share of interconnect resistance.
+
+Runs from the sampler on snapshots the sampler has already taken, so it costs the trigger path nothing.
+Each measurement is folded into eeprom_data.cell_resistance with an exponential filter.
+*/
+
+void resistance_update(const struct telemetry *sample);
+
+//Filtered resistance of a cell in micro-ohms, 0 if it hasn't been measured yet.
+uint32_t resistance_cell_uohm(uint8_t cell);
+
+//Estimate a cell's resting voltage from its voltage under load, the pack current, and its resistance.
+//Only compensates for discharge current, by at most CELL_IR_COMP_MAX_MV. Unmeasured cells come back as-is.
+uint16_t resistance_compensate(uint8_t cell, uint16_t cell_mv, int32_t current_ma);
+
+void resistance_print(void);
+
+#endif /* RESISTANCE_H_ */
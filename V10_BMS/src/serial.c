@@ -10,6 +10,10 @@
 #include "serial.h"
 
 #include "leds.h" //fixme
+#include "trace.h"
+#include "perf.h"
+#include "clocks.h"
+#include "watchdog.h"
 
 //These are the messages we need to send to the Dyson.
 //The first block are sent at first trigger pull.
@@ -73,52 +77,40 @@ static inline void pin_set_peripheral_function(uint32_t pinmux) {
 uint8_t serial_read_buffer[40];
 void usart_read_callback(struct usart_module *const usart_module) {
 	//Parse the data in the buffer, and see if we have a whole message.
-	//This way of doing things is nasty, as messages do get truncated and lost, but enough get through to handle the error info...	
-	int startFrame=-1, endFrame=-1;
-	for (int i = 0; i < 40; ++i) {
-		if (serial_read_buffer[i] == SERIAL_MSG_DELIM_CHAR) {
-			if (serial_read_buffer[i+1] == SERIAL_MSG_DELIM_CHAR) continue; //Garbled message - across a buffer.
-			//This should be the start of a message.
-			if (startFrame == -1) {
-				startFrame = i;
-			}
-			else {
-				endFrame = i;
-				break;
-			}
-		}
+	trace_uart_rx(serial_read_buffer, sizeof(serial_read_buffer));
+	
+	bool error = false;
+	enum SERIAL_RX_RESULT rx_result = serial_parse_frame(serial_read_buffer, sizeof(serial_read_buffer), &error);
+	
+	PERF_INC(dyson_rx_buffers);
+	if (rx_result == SERIAL_RX_NO_FRAME) {
+		PERF_INC(dyson_rx_parse_failures);
+	}
+	else {
+		PERF_INC(dyson_rx_frames);
 	}
 	
-	if (startFrame != -1 && endFrame != -1) {
-		//Got a valid message.
-		//We want only 21 byte messages as those are the only ones we understand......
-		if (endFrame - startFrame == 21) {
-			//We want 20 byte messages as they contain the error flags.
-			if (serial_read_buffer[startFrame + MSG_NUM_OFFSET] == 0x06 || serial_read_buffer[startFrame + MSG_NUM_OFFSET] == 0x03) {
-				if (serial_read_buffer[startFrame+ MSG_ERR_CODE_OFFSET] == 0x01) {
+	switch (rx_result) {
+		case SERIAL_RX_FILTER_STATUS:
 #ifdef SERIAL_DEBUG
-					serial_debug_send_message("USART message: Error from vacuum: FILTER\r\n");	
-#endif
-					leds_show_filter_err_status(true);
-				}
-				else {
-					leds_show_filter_err_status(false);
-				}				
+			if (error) {
+				serial_debug_send_message("USART message: Error from vacuum: FILTER\r\n");
 			}
-			else if (serial_read_buffer[startFrame + MSG_NUM_OFFSET] == 0x04 ||serial_read_buffer[startFrame + MSG_NUM_OFFSET] == 0x07) {
-				if (serial_read_buffer[startFrame+ MSG_ERR_CODE_OFFSET] == 0x01) {
+#endif
+			leds_show_filter_err_status(error);
+			break;
+		case SERIAL_RX_BLOCKED_STATUS:
 #ifdef SERIAL_DEBUG
-					serial_debug_send_message("USART message: Error from vacuum: BLOCKED\r\n");
+			if (error) {
+				serial_debug_send_message("USART message: Error from vacuum: BLOCKED\r\n");
+			}
 #endif
-					leds_show_blocked_err_status(true);
-				}
-				else {
-					leds_show_blocked_err_status(false);
-				}
-			}			
-		}	
+			leds_show_blocked_err_status(error);
+			break;
+		default:
+			break;
 	}
-	//Queue up next read.*/	usart_read_buffer_job(&usart_instance, (uint8_t *)serial_read_buffer, 40);}
+	//Queue up next read.*/	usart_read_buffer_job(&usart_instance, (uint8_t *)serial_read_buffer, sizeof(serial_read_buffer));}
 
 void serial_init() {	
 	//Set up the pinmux settings for SERCOM2
@@ -145,17 +137,32 @@ void serial_init() {
 	usart_enable_callback(&usart_instance, USART_CALLBACK_BUFFER_RECEIVED);
 	
 	usart_enable(&usart_instance);
-	//Start read job - the next one is kicked off by the above callback	usart_read_buffer_job(&usart_instance, (uint8_t *)serial_read_buffer, 40);}
+	//Start read job - the next one is kicked off by the above callback	usart_read_buffer_job(&usart_instance, (uint8_t *)serial_read_buffer, sizeof(serial_read_buffer));}
 
 void serial_send_next_message(){	
 	uint8_t *data;
 	size_t msglen = serial_get_next_block(&data);
 	int result = usart_write_buffer_wait(&usart_instance, data, msglen);
+	PERF_INC(dyson_tx_frames);
+	watchdog_checkin(WATCHDOG_TASK_DYSON_UART);
 	if (result != STATUS_OK) {
+		PERF_INC(dyson_tx_errors);
 		leds_blink_error_led(100);
 	}
 }
 	
 void serial_reset_message_counter() {
 	serial_msgIndex = 0;	
-}
\ No newline at end of file
+}
+
+void serial_set_enabled(bool enable) {
+	//The Dyson only listens while it has power, so the USART is only clocked while discharging.
+	if (enable) {
+		clocks_sercom_enable(2, true);
+		usart_enable(&usart_instance);
+	}
+	else {
+		usart_disable(&usart_instance);
+		clocks_sercom_enable(2, false);
+	}
+}
@@ -7,9 +7,17 @@
  */ 
 
 #include "serial_debug.h"
+#include "balance.h"
+#include "resistance.h"
+#include "energy.h"
+#include "bms.h"
+#include "crash.h"
 #ifdef SERIAL_DEBUG
 struct usart_module debug_usart;
 #include <string.h>
+
+//Whether anything is plugged into the debug header - if not, SERCOM0 is never clocked.
+static bool serial_debug_attached = true;
 #endif
 
 char debug_buffer[80];
@@ -27,6 +35,22 @@ static inline void pin_set_peripheral_function(uint32_t pinmux) {
 void serial_debug_init() {
 
 #ifdef SERIAL_DEBUG
+#ifdef CLOCK_GATING
+	//An attached adapter holds our RX line (PA11) at its idle high - see if it overcomes a pull-down.
+	struct port_config rx_pin_config;
+	port_get_config_defaults(&rx_pin_config);
+	rx_pin_config.direction = PORT_PIN_DIR_INPUT;
+	rx_pin_config.input_pull = PORT_PIN_PULL_DOWN;
+	port_pin_set_config(PIN_PA11, &rx_pin_config);
+	delay_ms(1);
+	serial_debug_attached = port_pin_get_input_level(PIN_PA11);
+	
+	rx_pin_config.input_pull = PORT_PIN_PULL_NONE;
+	port_pin_set_config(PIN_PA11, &rx_pin_config);
+	if (!serial_debug_attached) {
+		return;
+	}
+#endif
 	//Set up the pinmux settings for SERCOM0
 	pin_set_peripheral_function(PINMUX_PA11C_SERCOM0_PAD3);
 	pin_set_peripheral_function(PINMUX_PA10C_SERCOM0_PAD2);
@@ -48,33 +72,85 @@ void serial_debug_init() {
 	//Enable
 	usart_enable(&debug_usart);
 	
+#ifdef TRACE_CAPTURE
+	//Start streaming whatever the trace has captured so far.
+	trace_init();
+#endif
+	
 	//Initial debug blurb
 	serial_debug_send_message("Dyson V10 BMS Aftermarket firmware init\r\n");
 	serial_debug_send_message("(C) David Pye davidmpye@gmail.com\r\n");
 	serial_debug_send_message("GNU GPL v3.0 or later\r\n");
-	//Need to pause 250mS before cell voltages are available from the BQ7693
-	delay_ms(250);
-	serial_debug_send_cell_voltages();
 #endif
 
 }
 
 void serial_debug_send_message(char *msg) {
 	
-#ifdef SERIAL_DEBUG
-	int result = usart_write_buffer_wait(&debug_usart, msg, strlen(msg));
+#if defined(TRACE_CAPTURE)
+	//The USART is carrying the binary trace, so wrap the message up in a trace record.
+	trace_log(msg);
+#elif defined(SERIAL_DEBUG)
+	if (!serial_debug_attached) {
+		return;
+	}
+	size_t len = strlen(msg);
+	int result = usart_write_buffer_wait(&debug_usart, (uint8_t *)msg, len);
+	PERF_ADD(debug_bytes, len);
+	PERF_ADD(debug_drops, result != STATUS_OK);
 #else
 	return 0;
 #endif
 
 }
 
+void serial_debug_service() {
+	//Called regularly from the state handlers' loops - handles single character commands from the debug USART.
+#ifdef SERIAL_DEBUG
+	uint16_t cmd;
+	if (!serial_debug_attached || usart_read_wait(&debug_usart, &cmd) != STATUS_OK) {
+		return;
+	}
+	
+	switch (cmd) {
+#ifdef PERF_COUNTERS
+		case 'p':
+			perf_print();
+			break;
+		case 'r':
+			perf_reset();
+			serial_debug_send_message("Perf counters reset\r\n");
+			break;
+#endif
+		case 'b':
+			balance_print();
+			break;
+		case 'i':
+			resistance_print();
+			break;
+		case 'e':
+			energy_print();
+			break;
+		case 't':
+			bms_state_machine_print();
+			break;
+		case 'c':
+			crash_print();
+			break;
+		default:
+			break;
+	}
+#endif
+}
+
 void serial_debug_send_cell_voltages() {
 #ifdef SERIAL_DEBUG
-	uint16_t *cell_voltages = bq7693_get_cell_voltages();
+	//From the latest telemetry snapshot - no need to go back to the BQ7693.
+	struct telemetry sample;
+	telemetry_read(&sample);
 	serial_debug_send_message("Pack cell voltages:\r\n");
-	for (int i=0; i<7; ++i) {
-		sprintf(debug_msg_buffer, "Cell %d: %d mV, min %d mV, max %d mV\r\n", i, cell_voltages[i], CELL_LOWEST_DISCHARGE_VOLTAGE, CELL_FULL_CHARGE_VOLTAGE);
+	for (int i=0; i<NUM_CELLS; ++i) {
+		sprintf(debug_msg_buffer, "Cell %d: %d mV, min %d mV, max %d mV\r\n", i, sample.cell_voltages[i], CELL_LOWEST_DISCHARGE_VOLTAGE, CELL_FULL_CHARGE_VOLTAGE);
 		serial_debug_send_message(debug_msg_buffer);
 	}
 #endif
@@ -14,9 +14,13 @@
 #include "config.h"
 
 #include "bq7693.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "perf.h"
 
 void serial_debug_init(void);
 void serial_debug_send_message(char *msg);
+void serial_debug_service(void);
 
 void serial_debug_send_cell_voltages();
 
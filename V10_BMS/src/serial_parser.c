@@ -0,0 +1,48 @@
+/*
+ * serial_parser.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "serial_parser.h"
+
+enum SERIAL_RX_RESULT serial_parse_frame(const uint8_t *buf, size_t len, bool *error) {
+	//This way of doing things is nasty, as messages do get truncated and lost, but enough get through to handle the error info...	
+	int startFrame=-1, endFrame=-1;
+	for (size_t i = 0; i < len; ++i) {
+		if (buf[i] == SERIAL_MSG_DELIM_CHAR) {
+			if (i + 1 < len && buf[i+1] == SERIAL_MSG_DELIM_CHAR) continue; //Garbled message - across a buffer.
+			//This should be the start of a message.
+			if (startFrame == -1) {
+				startFrame = i;
+			}
+			else {
+				endFrame = i;
+				break;
+			}
+		}
+	}
+	
+	if (startFrame == -1 || endFrame == -1) {
+		return SERIAL_RX_NO_FRAME;
+	}
+	
+	//We want only 21 byte messages as those are the only ones we understand......
+	//(endFrame is inside the buffer, so both offsets below are too)
+	if (endFrame - startFrame != MSG_STATUS_FRAME_LEN) {
+		return SERIAL_RX_UNKNOWN_FRAME;
+	}
+	
+	const uint8_t *frame = &buf[startFrame];
+	*error = (frame[MSG_ERR_CODE_OFFSET] == 0x01);
+	
+	if (frame[MSG_NUM_OFFSET] == 0x06 || frame[MSG_NUM_OFFSET] == 0x03) {
+		return SERIAL_RX_FILTER_STATUS;
+	}
+	else if (frame[MSG_NUM_OFFSET] == 0x04 || frame[MSG_NUM_OFFSET] == 0x07) {
+		return SERIAL_RX_BLOCKED_STATUS;
+	}
+	return SERIAL_RX_UNKNOWN_FRAME;
+}
@@ -0,0 +1,44 @@
+/*
+ * serial_parser.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef SERIAL_PARSER_H_
+#define SERIAL_PARSER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* This is a bit of info about the serial protocol, which I don't fully understand.
+
+There are variable length messages, of which the 21 byte long messages seem to contain filter/blocked status.
+
+If the message sequence number (byte 8) is 3 or 6, and byte 0x0F is 0x01, then FILTER ERROR has occurred.
+If the message sequence number (byte 8) is 4 or 7, and byte 0x0F is 0x01, then BLOCKED ERROR has occurred.
+ 
+If the byte 0x0F is 0x00, then the error state is OK.
+
+The parser has no ASF dependencies, so it can be built and fed arbitrary data on a host.
+*/
+
+#define SERIAL_MSG_DELIM_CHAR 0x12
+#define MSG_NUM_OFFSET 0x08
+#define MSG_ERR_CODE_OFFSET 0x0F
+#define MSG_STATUS_FRAME_LEN 21
+
+enum SERIAL_RX_RESULT {
+	SERIAL_RX_NO_FRAME,			//No complete frame in the buffer
+	SERIAL_RX_UNKNOWN_FRAME,	//Got a frame, but not one we understand
+	SERIAL_RX_FILTER_STATUS,	//Filter status frame - error flag is valid
+	SERIAL_RX_BLOCKED_STATUS,	//Blocked status frame - error flag is valid
+};
+
+//Look for the first complete frame in buf, and decode the filter/blocked status if it has one.
+enum SERIAL_RX_RESULT serial_parse_frame(const uint8_t *buf, size_t len, bool *error);
+
+#endif /* SERIAL_PARSER_H_ */
@@ -0,0 +1,153 @@
+/*
+ * soc.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "soc.h"
+
+//Rested cell voltage (mV) at 0%, 10% ... 100% state of charge.
+//Approximate curve for the Molicel INR18650P26a, from the datasheet discharge curves at low rate.
+static const uint16_t soc_ocv_table[] = {
+	3000, 3420, 3520, 3590, 3640, 3700, 3790, 3890, 3980, 4080, 4180
+};
+#define SOC_OCV_POINTS (sizeof(soc_ocv_table) / sizeof(soc_ocv_table[0]))
+#define SOC_OCV_STEP_PPM (SOC_FULL_PPM / (SOC_OCV_POINTS - 1))
+
+static int32_t soc_ppm = SOC_FULL_PPM / 2;
+static uint32_t soc_variance;			//(0.01%)^2
+//Counting error not yet added to soc_variance, in (0.01%)^2 / SOC_CC_NOISE_SCALE - ppm to 0.01% and per mille, squared.
+#define SOC_CC_NOISE_SCALE 10000000000ULL
+static uint64_t soc_cc_noise = 0;
+
+static uint32_t soc_rest_start_ms = 0;
+static bool soc_resting = false;
+static uint32_t soc_last_ocv_ms = 0;
+
+static int32_t soc_clamp(int32_t ppm) {
+	if (ppm < 0) {
+		return 0;
+	}
+	if (ppm > SOC_FULL_PPM) {
+		return SOC_FULL_PPM;
+	}
+	return ppm;
+}
+
+//Mean of the cell voltages - what the OCV table is looked up with.
+static uint16_t soc_average_cell(const struct telemetry *sample) {
+	uint32_t sum = 0;
+	for (int i=0; i<NUM_CELLS; ++i) {
+		sum += sample->cell_voltages[i];
+	}
+	return sum / NUM_CELLS;
+}
+
+//SoC for a rested cell voltage, and the variance of that SoC given SOC_OCV_UNCERTAINTY_MV.
+static int32_t soc_from_ocv(uint16_t cell_mv, uint32_t *variance) {
+	uint8_t seg = 0;
+	while (seg < SOC_OCV_POINTS - 2 && cell_mv > soc_ocv_table[seg + 1]) {
+		seg++;
+	}
+	int32_t seg_mv = soc_ocv_table[seg + 1] - soc_ocv_table[seg];
+	
+	//Where the curve is flat, a few mV is a lot of SoC.
+	uint32_t sigma = (uint32_t)SOC_OCV_UNCERTAINTY_MV * (SOC_OCV_STEP_PPM / 100) / seg_mv;
+	*variance = sigma * sigma;
+	
+	int32_t ppm = (int32_t)seg * SOC_OCV_STEP_PPM + ((int32_t)cell_mv - soc_ocv_table[seg]) * SOC_OCV_STEP_PPM / seg_mv;
+	return soc_clamp(ppm);
+}
+
+static void soc_correct(int32_t measured_ppm, uint32_t measurement_variance) {
+	//Kalman gain in Q16.
+	uint32_t gain = ((uint64_t)soc_variance << 16) / ((uint64_t)soc_variance + measurement_variance);
+	soc_ppm = soc_clamp(soc_ppm + (int32_t)(((int64_t)(measured_ppm - soc_ppm) * gain) >> 16));
+	soc_variance -= ((uint64_t)soc_variance * gain) >> 16;
+}
+
+void soc_init(int32_t charge_level, int32_t pack_capacity) {
+	//Start from the stored coulomb count, but without much confidence in it.
+	if (pack_capacity > 0) {
+		soc_ppm = soc_clamp(((int64_t)charge_level * SOC_FULL_PPM) / pack_capacity);
+	}
+	soc_variance = SOC_INITIAL_VARIANCE;
+	soc_cc_noise = 0;
+	soc_resting = false;
+}
+
+uint8_t soc_update(const struct telemetry *sample) {
+	//Predict - move by the charge counted since the last sample, the same as the coulomb count: the integer CC
+	//maths' carried remainder and the BMS's own consumption included.
+	if (sample->pack_capacity > 0) {
+		int32_t delta = ((int64_t)sample->charge_uah * SOC_FULL_PPM) / sample->pack_capacity;
+		soc_ppm = soc_clamp(soc_ppm + delta);
+		
+		//Counting error - a standard deviation of SOC_CC_ERROR_PERMILLE of the charge moved, squared into the
+		//variance, plus a little drift regardless. A sample's share is well under one unit, so the rest is carried.
+		uint64_t sigma = (uint64_t)(delta < 0 ? -delta : delta) * SOC_CC_ERROR_PERMILLE;	//0.01% / 10^5
+		soc_cc_noise += sigma * sigma;	//(0.01%)^2 / 10^10
+		uint32_t moved = soc_cc_noise / SOC_CC_NOISE_SCALE;
+		soc_cc_noise -= (uint64_t)moved * SOC_CC_NOISE_SCALE;
+		if (soc_variance < UINT32_MAX / 2) {
+			soc_variance += SOC_CC_VARIANCE + moved;
+		}
+	}
+	
+	//Correct - from the OCV table, once the pack has been resting long enough.
+	int32_t current = sample->current < 0 ? -sample->current : sample->current;
+	if (current > SOC_REST_CURRENT_MA) {
+		soc_resting = false;
+	}
+	else if (!soc_resting) {
+		soc_resting = true;
+		soc_rest_start_ms = sample->time_ms;
+		soc_last_ocv_ms = sample->time_ms;
+	}
+	else if (!sample->balancing) {
+		uint32_t rested = sample->time_ms - soc_rest_start_ms;
+		//Consecutive readings of the same rested voltage aren't independent - only take one every so often.
+		if (rested >= SOC_REST_MIN_MS && sample->time_ms - soc_last_ocv_ms >= SOC_OCV_UPDATE_MS) {
+			soc_last_ocv_ms = sample->time_ms;
+			
+			uint32_t variance;
+			int32_t measured = soc_from_ocv(soc_average_cell(sample), &variance);
+			
+			//Cells are still relaxing early in the rest - trust the reading less until SOC_OCV_SETTLE_MS.
+			if (rested < SOC_OCV_SETTLE_MS) {
+				variance = ((uint64_t)variance * SOC_OCV_SETTLE_MS) / rested;
+			}
+			soc_correct(measured, variance);
+		}
+	}
+	
+	return soc_percent();
+}
+
+uint8_t soc_percent() {
+	return (soc_ppm + SOC_FULL_PPM / 200) / (SOC_FULL_PPM / 100);
+}
+
+bool soc_resync(const struct telemetry *sample, uint8_t *ocv_percent) {
+	int32_t current = sample->current < 0 ? -sample->current : sample->current;
+	if (current > SOC_REST_CURRENT_MA) {
+		return false;
+	}
+	
+	uint32_t variance;
+	int32_t measured = soc_from_ocv(soc_average_cell(sample), &variance);
+	*ocv_percent = (measured + SOC_FULL_PPM / 200) / (SOC_FULL_PPM / 100);
+	
+	//Fixed weighting rather than the filter's own gain - how long the pack sat in ship mode isn't known,
+	//so how relaxed the cells are is a judgement call for SOC_BOOT_OCV_WEIGHT.
+	soc_ppm = soc_clamp(soc_ppm + (measured - soc_ppm) * SOC_BOOT_OCV_WEIGHT / 100);
+	soc_variance = ((uint64_t)variance * SOC_BOOT_OCV_WEIGHT * SOC_BOOT_OCV_WEIGHT
+		+ (uint64_t)soc_variance * (100 - SOC_BOOT_OCV_WEIGHT) * (100 - SOC_BOOT_OCV_WEIGHT)) / 10000;
+	return true;
+}
+
+int32_t soc_charge_level(int32_t pack_capacity) {
+	return ((int64_t)soc_ppm * pack_capacity) / SOC_FULL_PPM;
+}
@@ -0,0 +1,47 @@
+/*
+ * soc.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef SOC_H_
+#define SOC_H_
+
+#include "asf.h"
+#include "config.h"
+#include "telemetry.h"
+
+/* State of charge estimator.
+
+Coulomb counting is accurate over the short term but drifts (CC offset, capacity errors) and never
+finds out. The open circuit voltage of a rested cell gives an absolute SoC, but only when no current
+has flowed for a while. So the two are combined as a one-state Kalman filter:
+
+ - every sample, the SoC moves by the charge counted since the last one, and the uncertainty grows.
+ - once the pack has rested, the OCV table gives a measurement, weighted by how much we trust it
+   (less on the flat part of the curve, and less the shorter the rest), and the uncertainty shrinks.
+
+All fixed point - SoC is in ppm of capacity, variance in (0.01%)^2.
+*/
+
+#define SOC_FULL_PPM 1000000
+
+void soc_init(int32_t charge_level, int32_t pack_capacity);
+
+//Run from the sampler with each new snapshot. Returns the SoC in percent.
+uint8_t soc_update(const struct telemetry *sample);
+
+uint8_t soc_percent(void);
+
+//After waking from ship mode the pack has usually been resting for a long time, so its voltage is a good
+//SoC reference. If the sample shows no current flowing, blend the OCV SoC in with weight SOC_BOOT_OCV_WEIGHT.
+//Returns false (and leaves the estimate alone) if the pack isn't relaxed.
+bool soc_resync(const struct telemetry *sample, uint8_t *ocv_percent);
+
+//The estimate as a charge level, for re-anchoring the coulomb count (or energy level, given the energy capacity).
+int32_t soc_charge_level(int32_t pack_capacity);
+
+#endif /* SOC_H_ */
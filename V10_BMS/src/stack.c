@@ -0,0 +1,34 @@
+/*
+ * stack.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "stack.h"
+
+//From the linker script.
+extern uint32_t _sstack;
+extern uint32_t _estack;
+
+void stack_paint() {
+	//Everything below what we're using now - leave a few words for this function itself.
+	uint32_t msp = __get_MSP();
+	uint32_t *sp = (uint32_t *)msp - 8;
+	for (uint32_t *p = &_sstack; p < sp; ++p) {
+		*p = STACK_PAINT;
+	}
+}
+
+uint16_t stack_high_water() {
+	const uint32_t *p = &_sstack;
+	while (p < &_estack && *p == STACK_PAINT) {
+		++p;
+	}
+	return (uint32_t)&_estack - (uint32_t)p;
+}
+
+uint16_t stack_size() {
+	return (uint32_t)&_estack - (uint32_t)&_sstack;
+}
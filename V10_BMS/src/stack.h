@@ -0,0 +1,32 @@
+/*
+ * stack.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef STACK_H_
+#define STACK_H_
+
+#include "asf.h"
+
+/* Stack high-water mark.
+
+The stack is the .stack section at the top of RAM (STACK_SIZE in the linker script, 1KB by default), growing down
+from _estack to _sstack. stack_paint() fills the unused part with a pattern at boot, and stack_high_water() finds
+the deepest point anything has overwritten it since. For the static RAM, see tools/ram_report.py.
+*/
+
+#define STACK_PAINT 0xC5C5C5C5
+
+//Call first thing at boot.
+void stack_paint(void);
+
+//Most bytes of stack ever in use. Scans the painted area, so not for the hot path.
+uint16_t stack_high_water(void);
+
+uint16_t stack_size(void);
+
+#endif /* STACK_H_ */
@@ -0,0 +1,49 @@
+/*
+ * systime.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "systime.h"
+
+static volatile uint32_t systime_ms_count = 0;
+static uint32_t systime_cpms = 8000000UL / 1000;
+
+void SysTick_Handler(void) {
+	systime_ms_count++;
+}
+
+void systime_init() {
+	systime_cpms = system_cpu_clock_get_hz() / 1000;
+	
+	//Reload every millisecond, and interrupt on each reload.
+	SysTick->LOAD = systime_cpms - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+void systime_clock_changed() {
+	//The millisecond count carries on - at most the part of a millisecond in progress is lost.
+	systime_init();
+}
+
+uint32_t systime_ms() {
+	return systime_ms_count;
+}
+
+uint32_t systime_cycles() {
+	uint32_t ms, val;
+	//Re-read if the tick interrupt fired between the two reads.
+	do {
+		ms = systime_ms_count;
+		val = SysTick->VAL;
+	} while (ms != systime_ms_count);
+	
+	return ms * systime_cpms + (systime_cpms - 1 - val);
+}
+
+uint32_t systime_cycles_per_ms() {
+	return systime_cpms;
+}
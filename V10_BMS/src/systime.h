@@ -0,0 +1,31 @@
+/*
+ * systime.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef SYSTIME_H_
+#define SYSTIME_H_
+
+#include "asf.h"
+
+//SysTick fires once per millisecond and provides a monotonic time base.
+//The delay_ms/delay_us routines measure against the same free-running counter, so they can be used alongside it.
+void systime_init(void);
+
+//Milliseconds since systime_init() - wraps after ~49 days.
+uint32_t systime_ms(void);
+
+//Core clock cycles since systime_init() - wraps after ~9 minutes at 8MHz, so only use for measuring short intervals.
+uint32_t systime_cycles(void);
+
+//Number of core clock cycles in a millisecond.
+uint32_t systime_cycles_per_ms(void);
+
+//Call after changing the CPU clock divider - reprograms SysTick so it still fires every millisecond.
+void systime_clock_changed(void);
+
+#endif /* SYSTIME_H_ */
@@ -0,0 +1,41 @@
+/*
+ * telemetry.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "telemetry.h"
+
+static struct telemetry telemetry_buffers[2];
+static volatile uint8_t telemetry_current = 0;	//Buffer holding the latest snapshot
+static volatile uint32_t telemetry_seq = 0;		//Published version, 0 = nothing yet
+
+void telemetry_publish(const struct telemetry *sample) {
+	//Only ever called from one context (the sampler), so nothing else writes the spare buffer.
+	uint8_t next = telemetry_current ^ 1;
+	telemetry_buffers[next] = *sample;
+	
+	//Make sure the buffer contents are written before it's made visible.
+	__DMB();
+	telemetry_current = next;
+	telemetry_seq++;
+}
+
+uint32_t telemetry_read(struct telemetry *sample) {
+	uint32_t seq;
+	do {
+		seq = telemetry_seq;
+		__DMB();
+		*sample = telemetry_buffers[telemetry_current];
+		__DMB();
+		//If a new snapshot was published while copying, the buffer may have been reused - go round again.
+	} while (seq != telemetry_seq);
+	
+	return seq;
+}
+
+uint32_t telemetry_version() {
+	return telemetry_seq;
+}
@@ -0,0 +1,51 @@
+/*
+ * telemetry.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include "asf.h"
+#include "config.h"
+
+/* The latest complete set of pack measurements.
+
+Published by the sampler (bms_sample()) into one of two buffers, then made current by flipping an index,
+so readers always copy a buffer that isn't being written. A version number is bumped on each publish, and
+a reader retries if it changes under it - so the copy is consistent from the main loop or an ISR, with no
+need to disable interrupts, and no I2C traffic.
+*/
+
+struct telemetry {
+	uint32_t time_ms;					//When the sample was taken
+	uint16_t cell_voltages[NUM_CELLS];	//mV
+	int32_t pack_voltage;				//mV
+	int16_t temperature;				//'C * 10 eg 217 = 21.7'C
+	int32_t current;					//mA, +ve charging, -ve discharging
+	int32_t charge_level;				//micro-amp-hours
+	int32_t charge_uah;					//Charge counted since the previous sample, as added to charge_level
+	int32_t pack_capacity;				//micro-amp-hours
+	int32_t energy_level;				//mWh
+	uint16_t runtime_minutes;			//At the average discharge power, ENERGY_RUNTIME_UNKNOWN if not known
+	uint8_t soc;						//percent
+	uint8_t sys_stat;					//SYS_STAT bits seen by the ALERT interrupt since the previous sample
+	int16_t cc_raw;						//Last coulomb counter reading, before offset correction
+	bool fets_on;						//Either FET was on when the sample was taken
+	bool cc_oneshot;					//current is from a one-shot CC reading started just after a load step
+	uint8_t balancing;					//Cells being bled while the sample was taken (bit 0 = cell 0) - their voltages read low
+	uint32_t self_uah;					//Estimated uAh drawn by the BMS itself since boot (included in charge_level, charge_uah and so the SoC)
+};
+
+void telemetry_publish(const struct telemetry *sample);
+
+//Copy the latest snapshot into *sample. Returns its version - 0 if nothing has been published yet.
+uint32_t telemetry_read(struct telemetry *sample);
+
+uint32_t telemetry_version(void);
+
+#endif /* TELEMETRY_H_ */
@@ -0,0 +1,101 @@
+/*
+ * timer.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "timer.h"
+
+static struct timer *timer_wheel[TIMER_WHEEL_SLOTS];
+
+//The next tick to be processed, and the systime_ms() at which it's due. Counting ticks ourselves, rather than
+//dividing systime_ms(), keeps them continuous when the millisecond counter wraps.
+static uint32_t timer_tick = 0;
+static uint32_t timer_tick_due_ms = 0;
+
+//Only ever added to here, so an interrupt can read it without masking.
+static volatile uint32_t timer_asleep_total_us = 0;
+
+static void timer_unlink(struct timer *timer) {
+	*timer->link = timer->next;
+	if (timer->next) {
+		timer->next->link = timer->link;
+	}
+	timer->next = NULL;
+	timer->link = NULL;
+}
+
+void timer_init() {
+	timer_tick_due_ms = systime_ms() + TIMER_TICK_MS;
+	
+	//Idle sleep just stops the CPU clock - peripherals and SysTick carry on, and any interrupt wakes us.
+	system_set_sleepmode(SYSTEM_SLEEPMODE_IDLE_0);
+}
+
+void timer_start(struct timer *timer, uint32_t delay_ms, timer_callback callback) {
+	if (timer->link) {
+		timer_unlink(timer);
+	}
+	
+	//Round up to whole ticks from when the next one is due, so we never fire early. If we're running late,
+	//the next tick is already overdue and is as soon as it can be.
+	int32_t ms_after_due = (int32_t)(systime_ms() + delay_ms - timer_tick_due_ms);
+	uint32_t ticks = ms_after_due > 0 ? (ms_after_due + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0;
+	
+	timer->expires_tick = timer_tick + ticks;
+	timer->callback = callback;
+	
+	struct timer **slot = &timer_wheel[timer->expires_tick & (TIMER_WHEEL_SLOTS - 1)];
+	timer->next = *slot;
+	if (*slot) {
+		(*slot)->link = &timer->next;
+	}
+	timer->link = slot;
+	*slot = timer;
+}
+
+void timer_cancel(struct timer *timer) {
+	if (timer->link) {
+		timer_unlink(timer);
+	}
+}
+
+bool timer_pending(const struct timer *timer) {
+	return timer->link != NULL;
+}
+
+void timer_service() {
+	//Catch up on every tick that has passed - normally just the one, more after a blocking LED sequence etc.
+	while ((int32_t)(systime_ms() - timer_tick_due_ms) >= 0) {
+		uint32_t tick = timer_tick++;
+		timer_tick_due_ms += TIMER_TICK_MS;
+		
+		//Anything a callback starts lands on a later tick, so it won't be fired again below.
+		struct timer *timer = timer_wheel[tick & (TIMER_WHEEL_SLOTS - 1)];
+		while (timer) {
+			if ((int32_t)(timer->expires_tick - tick) > 0) {
+				//Due on a later turn of the wheel.
+				timer = timer->next;
+				continue;
+			}
+			timer_unlink(timer);
+			timer->callback(timer);
+			//The callback may have started or cancelled others in this slot - start again from the top.
+			timer = timer_wheel[tick & (TIMER_WHEEL_SLOTS - 1)];
+		}
+	}
+}
+
+void timer_sleep() {
+	timer_service();
+	
+	uint32_t start = systime_cycles();
+	system_sleep();
+	timer_asleep_total_us += (systime_cycles() - start) / (systime_cycles_per_ms() / 1000);
+}
+
+uint32_t timer_asleep_us() {
+	return timer_asleep_total_us;
+}
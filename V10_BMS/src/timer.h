@@ -0,0 +1,56 @@
+/*
+ * timer.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include "asf.h"
+#include "systime.h"
+
+/* Software timers on the systime millisecond base.
+
+A hashed timer wheel - each timer hangs off the slot for its expiry tick, so starting or cancelling one
+is O(1), and each tick only looks at one slot. Callbacks run from timer_service() in the main loop, not
+from an interrupt, so they can do anything a state handler can.
+*/
+
+//Wheel resolution, and number of slots - a power of two. A timer further out than one turn of the
+//wheel just stays in its slot until the turn it's due on.
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_SLOTS 32
+
+struct timer;
+typedef void (*timer_callback)(struct timer *timer);
+
+//Owned by the caller, usually static. Only touch it through the functions below.
+struct timer {
+	struct timer *next;
+	struct timer **link;	//Whatever points at us in the slot list - NULL when not scheduled.
+	uint32_t expires_tick;
+	timer_callback callback;
+};
+
+void timer_init(void);
+
+//(Re)schedule the callback to run no sooner than delay_ms from now.
+void timer_start(struct timer *timer, uint32_t delay_ms, timer_callback callback);
+void timer_cancel(struct timer *timer);
+bool timer_pending(const struct timer *timer);
+
+//Run the callbacks of any timers that have expired.
+void timer_service(void);
+
+//Service the timers, then sleep until the next interrupt - SysTick wakes us at least every millisecond.
+//Call it at the bottom of a polling loop in place of a delay.
+void timer_sleep(void);
+
+//Total time spent asleep in timer_sleep() since boot - wraps after ~71 minutes, so use differences.
+uint32_t timer_asleep_us(void);
+
+#endif /* TIMER_H_ */
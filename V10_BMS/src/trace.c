@@ -0,0 +1,198 @@
+/*
+ * trace.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "trace.h"
+
+#ifdef TRACE_CAPTURE
+
+#include <string.h>
+#include "systime.h"
+#include "perf.h"
+
+extern struct usart_module debug_usart;
+
+static uint8_t trace_buffer[TRACE_BUFFER_SIZE];
+static volatile uint8_t trace_head = 0;		//Next byte to be written
+static volatile uint8_t trace_tail = 0;		//Next byte to be sent
+static volatile uint8_t trace_tx_len = 0;	//Bytes currently being sent by the USART job
+
+static bool trace_started = false;
+static bool trace_time_sent = false;
+static uint32_t trace_last_ms = 0;
+static uint16_t trace_dropped = 0;
+
+//Last seen pin levels, one bit per PORTA pin, so pins are only recorded on change.
+static uint32_t trace_pin_in_levels = 0;
+static uint32_t trace_pin_out_levels = 0;
+static uint32_t trace_pin_in_seen = 0;
+static uint32_t trace_pin_out_seen = 0;
+
+static void trace_kick(void) {
+	//Start sending the next contiguous run of the ring, if the USART is idle.
+	if (!trace_started || trace_tx_len || trace_head == trace_tail) {
+		return;
+	}
+	
+	if (trace_head > trace_tail) {
+		trace_tx_len = trace_head - trace_tail;
+	}
+	else {
+		trace_tx_len = TRACE_BUFFER_SIZE - trace_tail;
+	}
+	usart_write_buffer_job(&debug_usart, &trace_buffer[trace_tail], trace_tx_len);
+}
+
+static void trace_tx_callback(struct usart_module *const module) {
+	trace_tail += trace_tx_len;
+	trace_tx_len = 0;
+	trace_kick();
+}
+
+static bool trace_put(uint8_t type, const uint8_t *payload, uint8_t len, uint16_t delta_ms) {
+	//Must be called with interrupts disabled.
+	uint8_t used = trace_head - trace_tail;
+	if (TRACE_BUFFER_SIZE - used <= TRACE_HEADER_LEN + len) {
+		return false;
+	}
+	
+	trace_buffer[trace_head++] = TRACE_SYNC_CHAR;
+	trace_buffer[trace_head++] = type;
+	trace_buffer[trace_head++] = len;
+	trace_buffer[trace_head++] = delta_ms & 0xFF;
+	trace_buffer[trace_head++] = delta_ms >> 8;
+	for (int i=0; i<len; ++i) {
+		trace_buffer[trace_head++] = payload[i];
+	}
+	return true;
+}
+
+void trace_record(uint8_t type, const uint8_t *payload, uint8_t len) {
+	system_interrupt_enter_critical_section();
+	
+	uint32_t now = systime_ms();
+	uint32_t delta = now - trace_last_ms;
+	
+	if (trace_dropped) {
+		uint8_t count[2] = { trace_dropped & 0xFF, trace_dropped >> 8 };
+		if (trace_put(TRACE_REC_DROPPED, count, 2, 0)) {
+			trace_dropped = 0;
+		}
+	}
+	
+	if (!trace_time_sent || delta > 0xFFFF) {
+		//The first record, or too long since the last record for a delta - send the absolute time first.
+		if (trace_put(TRACE_REC_TIME, (uint8_t *)&now, 4, 0)) {
+			trace_time_sent = true;
+			delta = 0;
+		}
+	}
+	
+	if (delta <= 0xFFFF && trace_put(type, payload, len, delta)) {
+		trace_last_ms = now;
+		trace_kick();
+	}
+	else {
+		trace_dropped++;
+		PERF_INC(debug_drops);
+	}
+	
+	system_interrupt_leave_critical_section();
+}
+
+void trace_init() {
+	usart_register_callback(&debug_usart, trace_tx_callback, USART_CALLBACK_BUFFER_TRANSMITTED);
+	usart_enable_callback(&debug_usart, USART_CALLBACK_BUFFER_TRANSMITTED);
+	
+	uint8_t cause = system_get_reset_cause();
+	trace_record(TRACE_REC_RESET, &cause, 1);
+	
+	//Anything recorded before now (eg the BQ7693 init) has been waiting in the ring buffer.
+	system_interrupt_enter_critical_section();
+	trace_started = true;
+	trace_kick();
+	system_interrupt_leave_critical_section();
+}
+
+void trace_i2c_read(uint8_t addr, const uint8_t *buf, size_t len, bool ok) {
+	uint8_t payload[1 + 8];
+	
+	payload[0] = addr;
+	if (!ok || len > sizeof(payload) - 1) {
+		len = 0;
+	}
+	memcpy(&payload[1], buf, len);
+	trace_record(TRACE_REC_I2C_READ, payload, 1 + len);
+}
+
+void trace_i2c_write(uint8_t addr, uint8_t value) {
+	uint8_t payload[2] = { addr, value };
+	trace_record(TRACE_REC_I2C_WRITE, payload, 2);
+}
+
+static void trace_pin(uint8_t type, uint32_t *levels, uint32_t *seen, uint8_t pin, bool level) {
+	uint32_t mask = 1UL << (pin & 0x1F);
+	
+	//LEDs are also driven from the USART RX callback, so guard the shared level masks.
+	system_interrupt_enter_critical_section();
+	if (!(*seen & mask) || ((*levels & mask) != 0) != level) {
+		*seen |= mask;
+		if (level) {
+			*levels |= mask;
+		}
+		else {
+			*levels &= ~mask;
+		}
+		
+		uint8_t payload[2] = { pin, level };
+		trace_record(type, payload, 2);
+	}
+	system_interrupt_leave_critical_section();
+}
+
+void trace_pin_input(uint8_t pin, bool level) {
+	trace_pin(TRACE_REC_PIN_IN, &trace_pin_in_levels, &trace_pin_in_seen, pin, level);
+}
+
+void trace_pin_output(uint8_t pin, bool level) {
+	trace_pin(TRACE_REC_PIN_OUT, &trace_pin_out_levels, &trace_pin_out_seen, pin, level);
+}
+
+void trace_uart_rx(const uint8_t *buf, size_t len) {
+	trace_record(TRACE_REC_UART_RX, buf, len);
+}
+
+void trace_state(uint8_t state, uint8_t error) {
+	uint8_t payload[2] = { state, error };
+	trace_record(TRACE_REC_STATE, payload, 2);
+}
+
+void trace_irq(uint8_t channel) {
+	trace_record(TRACE_REC_IRQ, &channel, 1);
+}
+
+void trace_eeprom_read(uint8_t page, const uint8_t *buf, size_t len) {
+	uint8_t payload[1 + EEPROM_PAGE_SIZE];
+	
+	payload[0] = page;
+	if (len > sizeof(payload) - 1) {
+		len = sizeof(payload) - 1;
+	}
+	memcpy(&payload[1], buf, len);
+	trace_record(TRACE_REC_EEPROM, payload, 1 + len);
+}
+
+void trace_log(const char *msg) {
+	size_t len = strlen(msg);
+	if (len > 0xFF) {
+		len = 0xFF;
+	}
+	PERF_ADD(debug_bytes, len);
+	trace_record(TRACE_REC_LOG, (const uint8_t *)msg, len);
+}
+
+#endif
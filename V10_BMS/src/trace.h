@@ -0,0 +1,86 @@
+/*
+ * trace.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "asf.h"
+#include "config.h"
+
+/* Binary field trace, streamed over the debug USART when TRACE_CAPTURE is defined in config.h.
+
+Captures every input the state machine sees (raw BQ7693 register reads, trigger/charger pin levels,
+bytes received from the vacuum, when each interrupt fired, and the reset cause and stored EEPROM data
+it booted with), plus the outputs it produces (state transitions, LED/charge pins and BQ7693 register
+writes, which include the FET control), so a run can be decoded and compared offline with
+tools/trace_decode.py, or replayed through the firmware on a PC with host/trace_replay.
+
+Each record is:
+	0xA5 | type | payload length | ms since previous record (16 bit, little endian) | payload
+
+A TRACE_REC_TIME record carrying the absolute time goes ahead of the first record, and of any record
+whose gap from the one before is too big for the 16 bit delta.
+Records are queued into a ring buffer and sent by interrupt, so they can be raised from ISRs - if the
+ring is full, the record is dropped and a TRACE_REC_DROPPED record reports how many were lost.
+Debug text messages are wrapped in TRACE_REC_LOG records so they don't corrupt the stream.
+*/
+
+#define TRACE_SYNC_CHAR 0xA5
+#define TRACE_HEADER_LEN 5
+#define TRACE_BUFFER_SIZE 256	//Must be 256 - the uint8_t ring indices wrap naturally.
+
+enum TRACE_RECORD_TYPE {
+	TRACE_REC_TIME = 0x01,		//uint32_t absolute ms
+	TRACE_REC_I2C_READ,			//register address, data bytes (address only if the read failed)
+	TRACE_REC_I2C_WRITE,		//register address, value
+	TRACE_REC_PIN_IN,			//pin, level - only sent when the level changes
+	TRACE_REC_PIN_OUT,			//pin, level - only sent when the level changes
+	TRACE_REC_UART_RX,			//bytes received from the vacuum
+	TRACE_REC_STATE,			//enum BMS_STATE, enum BMS_ERROR_CODE
+	TRACE_REC_LOG,				//debug message text
+	TRACE_REC_DROPPED,			//uint16_t count of records lost since the last one sent
+	TRACE_REC_IRQ,				//EXTINT channel whose interrupt handler is starting
+	TRACE_REC_RESET,			//enum system_reset_cause - sent once, by trace_init()
+	TRACE_REC_EEPROM,			//page, data bytes - as read at boot, before any layout migration
+};
+
+#ifdef TRACE_CAPTURE
+
+#ifndef SERIAL_DEBUG
+#error TRACE_CAPTURE streams over the debug USART, so needs SERIAL_DEBUG
+#endif
+
+void trace_init(void);
+void trace_record(uint8_t type, const uint8_t *payload, uint8_t len);
+
+void trace_i2c_read(uint8_t addr, const uint8_t *buf, size_t len, bool ok);
+void trace_i2c_write(uint8_t addr, uint8_t value);
+void trace_pin_input(uint8_t pin, bool level);
+void trace_pin_output(uint8_t pin, bool level);
+void trace_uart_rx(const uint8_t *buf, size_t len);
+void trace_state(uint8_t state, uint8_t error);
+void trace_log(const char *msg);
+void trace_irq(uint8_t channel);
+void trace_eeprom_read(uint8_t page, const uint8_t *buf, size_t len);
+
+#else
+
+//Capture disabled - hooks compile away to nothing.
+static inline void trace_i2c_read(uint8_t addr, const uint8_t *buf, size_t len, bool ok) {}
+static inline void trace_i2c_write(uint8_t addr, uint8_t value) {}
+static inline void trace_pin_input(uint8_t pin, bool level) {}
+static inline void trace_pin_output(uint8_t pin, bool level) {}
+static inline void trace_uart_rx(const uint8_t *buf, size_t len) {}
+static inline void trace_state(uint8_t state, uint8_t error) {}
+static inline void trace_irq(uint8_t channel) {}
+static inline void trace_eeprom_read(uint8_t page, const uint8_t *buf, size_t len) {}
+
+#endif
+
+#endif /* TRACE_H_ */
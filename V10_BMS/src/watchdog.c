@@ -0,0 +1,129 @@
+/*
+ * watchdog.c
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+#include "watchdog.h"
+#include "serial_debug.h"
+
+//How long each task may go without checking in.
+static const uint16_t watchdog_deadline_ms[WATCHDOG_NUM_TASKS] = {
+	[WATCHDOG_TASK_SAMPLER] = 12000,
+	[WATCHDOG_TASK_STATE_MACHINE] = 12000,
+	[WATCHDOG_TASK_DYSON_UART] = 1000,
+};
+
+static volatile uint32_t watchdog_checkin_ms[WATCHDOG_NUM_TASKS];
+static uint8_t watchdog_active = (1 << WATCHDOG_TASK_SAMPLER) | (1 << WATCHDOG_TASK_STATE_MACHINE);
+static uint32_t watchdog_last_feed_ms = 0;
+static bool watchdog_running = false;
+
+//Left alone by the startup code, so it survives the reset.
+#define WATCHDOG_RECORD_MAGIC 0x57444F47
+static struct {
+	uint32_t magic;
+	uint8_t task;
+	uint32_t overdue_ms;
+	uint32_t time_ms;
+} watchdog_record __attribute__((section(".noinit")));
+
+void watchdog_init() {
+#ifdef WATCHDOG
+	//~1kHz for the WDT.
+	struct system_gclk_gen_config gen_config;
+	system_gclk_gen_get_config_defaults(&gen_config);
+	gen_config.source_clock = SYSTEM_CLOCK_SOURCE_ULP32K;
+	gen_config.division_factor = 32;
+	system_gclk_gen_set_config(GCLK_GENERATOR_2, &gen_config);
+	system_gclk_gen_enable(GCLK_GENERATOR_2);
+	
+	struct system_gclk_chan_config chan_config;
+	system_gclk_chan_get_config_defaults(&chan_config);
+	chan_config.source_generator = GCLK_GENERATOR_2;
+	system_gclk_chan_set_config(WDT_GCLK_ID, &chan_config);
+	system_gclk_chan_enable(WDT_GCLK_ID);
+	system_apb_clock_set_mask(SYSTEM_CLOCK_APB_APBA, PM_APBAMASK_WDT);
+	
+	uint32_t now = systime_ms();
+	for (uint8_t i=0; i<WATCHDOG_NUM_TASKS; ++i) {
+		watchdog_checkin_ms[i] = now;
+	}
+	watchdog_last_feed_ms = now;
+	
+	WDT->CONFIG.reg = WDT_CONFIG_WINDOW(WATCHDOG_WINDOW) | WDT_CONFIG_PER(WATCHDOG_PERIOD);
+	while (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY);
+	WDT->CTRL.reg = WDT_CTRL_WEN | WDT_CTRL_ENABLE;
+	while (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY);
+	watchdog_running = true;
+#endif
+}
+
+void watchdog_checkin(enum WATCHDOG_TASK task) {
+	watchdog_checkin_ms[task] = systime_ms();
+}
+
+void watchdog_set_task_active(enum WATCHDOG_TASK task, bool active) {
+	if (active) {
+		//Its deadline starts now.
+		watchdog_checkin_ms[task] = systime_ms();
+		watchdog_active |= 1 << task;
+	}
+	else {
+		watchdog_active &= ~(1 << task);
+	}
+}
+
+void watchdog_feed() {
+	uint32_t now = systime_ms();
+	//Feeding in the closed window resets us straight away.
+	if (!watchdog_running || now - watchdog_last_feed_ms < WATCHDOG_FEED_INTERVAL_MS) {
+		return;
+	}
+	
+	for (uint8_t i=0; i<WATCHDOG_NUM_TASKS; ++i) {
+		uint32_t since = now - watchdog_checkin_ms[i];
+		if ((watchdog_active & (1 << i)) && since > watchdog_deadline_ms[i]) {
+			//Stop feeding, and let the WDT reset us, unless it catches up first. Keep the first culprit.
+			if (watchdog_record.magic != WATCHDOG_RECORD_MAGIC) {
+				watchdog_record.task = i;
+				watchdog_record.overdue_ms = since;
+				watchdog_record.time_ms = now;
+				watchdog_record.magic = WATCHDOG_RECORD_MAGIC;
+			}
+			return;
+		}
+	}
+	
+	//A clear written while the last one is still syncing would stall the bus - try again next time.
+	if (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY) {
+		return;
+	}
+	WDT->CLEAR.reg = WDT_CLEAR_CLEAR_KEY;
+	watchdog_last_feed_ms = now;
+	//The late task has caught up and we're feeding again - it isn't to blame for any later reset.
+	watchdog_record.magic = 0;
+}
+
+void watchdog_report_reset() {
+#ifdef SERIAL_DEBUG
+	enum system_reset_cause cause = system_get_reset_cause();
+	bool recorded = cause == SYSTEM_RESET_CAUSE_WDT && watchdog_record.magic == WATCHDOG_RECORD_MAGIC;
+	
+	sprintf(debug_msg_buffer, "Reset cause 0x%02X\r\n", cause);
+	serial_debug_send_message(debug_msg_buffer);
+	if (recorded) {
+		sprintf(debug_msg_buffer, "Watchdog: task %d missed its deadline by %" PRIu32 " ms, at %" PRIu32 " ms\r\n", watchdog_record.task,
+			watchdog_record.overdue_ms - watchdog_deadline_ms[watchdog_record.task], watchdog_record.time_ms);
+		serial_debug_send_message(debug_msg_buffer);
+	}
+	else if (cause == SYSTEM_RESET_CAUSE_WDT) {
+		//The WDT went off without us deciding to stop feeding - stuck somewhere that never reached watchdog_feed().
+		serial_debug_send_message("Watchdog: no task recorded - locked up outside the main loop\r\n");
+	}
+#endif
+	//Whatever it said is garbage after a power up, and used after anything else.
+	watchdog_record.magic = 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * watchdog.h
+ *
+ *  Author:  David Pye
+ *  Contact: davidmpye@gmail.com
+ *  Licence: GNU GPL v3 or later
+ */ 
+
+
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include "asf.h"
+#include "systime.h"
+#include "config.h"
+
+/* The SAMD20 WDT, in windowed mode, fed only while every active task keeps checking in.
+
+Each task checks in from its own loop. watchdog_feed() is called from the main loop's hot path - it returns
+straight away until the closed window has passed, then feeds only if no active task has missed its deadline.
+If one has, it's recorded in no-init RAM and the WDT is left to reset us (the record is dropped at the next feed
+if it catches up in time); watchdog_report_reset() logs it on the next boot.
+
+The WDT runs from GCLK generator 2 - OSCULP32K / 32, about 1kHz.
+*/
+
+enum WATCHDOG_TASK {
+	WATCHDOG_TASK_SAMPLER,			//bms_sample() completing - catches an I2C lock-up
+	WATCHDOG_TASK_STATE_MACHINE,	//The state handlers' loops
+	WATCHDOG_TASK_DYSON_UART,		//Messages to the vacuum - only active while discharging
+	WATCHDOG_NUM_TASKS,
+};
+
+//Closed window 512 cycles (~0.5s), then open for 16K cycles (~16s) - long enough for the blocking LED sequences.
+#define WATCHDOG_WINDOW WDT_CONFIG_WINDOW_512_Val
+#define WATCHDOG_PERIOD WDT_CONFIG_PER_16K_Val
+//Feed no more often than this - twice the closed window, as OSCULP32K is far from accurate.
+#define WATCHDOG_FEED_INTERVAL_MS 1000
+
+//Start the WDT. Every task's deadline starts from now.
+void watchdog_init(void);
+
+void watchdog_checkin(enum WATCHDOG_TASK task);
+void watchdog_set_task_active(enum WATCHDOG_TASK task, bool active);
+void watchdog_feed(void);
+
+//Log (over the debug USART) why we last reset, and which task was to blame if it was the WDT.
+void watchdog_report_reset(void);
+
+#endif /* WATCHDOG_H_ */
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+#
+# crash_decode.py - turn a HardFault dump printed over the debug USART into source lines.
+#
+#  Author:  David Pye
+#  Contact: davidmpye@gmail.com
+#  Licence: GNU GPL v3 or later
+#
+# Usage:
+#   crash_decode.py build/samd20_firmware.elf debug.log   - decode the dump(s) in a captured debug log
+#   crash_decode.py build/samd20_firmware.elf < debug.log
+#
+# The dump is printed at boot after a HardFault, or on demand with the 'c' debug command - see src/crash.h.
+# The ELF must be the one that was running when it crashed.
+
+import argparse
+import re
+import subprocess
+import sys
+
+STATES = ["BMS_IDLE", "BMS_CHARGER_CONNECTED", "BMS_CHARGING", "BMS_CHARGER_CONNECTED_NOT_CHARGING",
+          "BMS_CHARGER_UNPLUGGED", "BMS_TRIGGER_PULLED", "BMS_DISCHARGING", "BMS_FAULT", "BMS_SLEEP"]
+
+# Anything in here could be a code address - see MEMORY in the linker script.
+FLASH_END = 0x7600
+
+HEADER = re.compile(r"Crash (\d+) at (\d+) ms, state (\d+), stack high-water (\d+) bytes")
+REGISTER = re.compile(r"\b(PC|LR|xPSR|R\d+) 0x([0-9A-Fa-f]{8})")
+
+
+def symbolize(addr2line, elf, address):
+    """Function and file:line for a code address, or None if it isn't one."""
+    if address >= FLASH_END:
+        return None
+    # Thumb addresses have bit 0 set.
+    output = subprocess.run([addr2line, "-e", elf, "-f", "-i", "-p", "-C", "0x%08x" % (address & ~1)],
+                            capture_output=True, text=True, check=True).stdout.strip()
+    return None if output.startswith("??") else output
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Symbolize a V10 BMS HardFault dump")
+    parser.add_argument("elf")
+    parser.add_argument("log", nargs="?", help="captured debug output (default: stdin)")
+    parser.add_argument("--addr2line", default="arm-none-eabi-addr2line")
+    args = parser.parse_args()
+
+    text = open(args.log, errors="replace").read() if args.log else sys.stdin.read()
+
+    found = False
+    for line in text.splitlines():
+        header = HEADER.search(line)
+        if header:
+            found = True
+            count, time_ms, state, stack_high_water = (int(g) for g in header.groups())
+            name = STATES[state] if state < len(STATES) else "state %d" % state
+            print("Crash %d at %d ms in %s, stack high-water %d bytes" % (count, time_ms, name, stack_high_water))
+            continue
+
+        for register, value in REGISTER.findall(line):
+            address = int(value, 16)
+            if register == "xPSR":
+                print("  %-4s 0x%08x  exception %d" % (register, address, address & 0x3F))
+                continue
+            # PC and LR always point at code. The other registers only might - guess from the Thumb bit,
+            # and skip the vector table.
+            if register not in ("PC", "LR") and (address < 0x100 or not address & 1):
+                print("  %-4s 0x%08x" % (register, address))
+                continue
+            where = symbolize(args.addr2line, args.elf, address)
+            print("  %-4s 0x%08x  %s" % (register, address, where or ""))
+
+        if line.strip().startswith(tuple("0123456789")) and "->" in line:
+            print("  transition %s" % line.strip())
+
+    if not found:
+        print("No crash dump found")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
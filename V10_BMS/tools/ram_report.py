@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+# ram_report.py - static RAM use per module, from the linker map file.
+#
+#  Author:  David Pye
+#  Contact: davidmpye@gmail.com
+#  Licence: GNU GPL v3 or later
+#
+# Usage:
+#   ram_report.py build/samd20_firmware.map
+#   ram_report.py build/samd20_firmware.map --min-free 256   - fail if less than 256 bytes are left over
+#
+# Run after every build of the firmware target (see CMakeLists.txt). Counts .data, .bss and .noinit by the
+# object file they came from, then the stack, and what's left of the RAM region. How much of the stack is
+# actually used at runtime is the 'Stack' line of the 'p' debug command - see src/stack.h.
+
+import argparse
+import os
+import re
+import sys
+from collections import defaultdict
+
+KINDS = {".relocate": "data", ".data": "data", ".bss": "bss", ".noinit": "noinit"}
+
+MEMORY = re.compile(r"^(\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)")
+OUTPUT_SECTION = re.compile(r"^(\.\S+)(?:\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+))?")
+INPUT_SECTION = re.compile(r"^ (\S+)(?:\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)(?:\s+(\S.*))?)?$")
+ADDRESS_SIZE = re.compile(r"^\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)(?:\s+(\S.*))?$")
+
+
+def module_name(path):
+    """bms for .../src/bms.c.obj, libc_nano.a for .../libc_nano.a(lib_a-sprintf.o)."""
+    if path is None:
+        return "(padding)"
+    if "(" in path:
+        return os.path.basename(path.split("(")[0])
+    name = os.path.basename(path)
+    for suffix in (".obj", ".o", ".c"):
+        if name.endswith(suffix):
+            name = name[:-len(suffix)]
+    return name
+
+
+def parse(lines):
+    """RAM region (origin, length), {module: {kind: bytes}}, and the stack size."""
+    ram = None
+    usage = defaultdict(lambda: defaultdict(int))
+    stack = 0
+
+    in_map = False
+    section = None
+    pending = False
+    for line in lines:
+        line = line.rstrip()
+        if not in_map:
+            memory = MEMORY.match(line)
+            if memory and memory.group(1) == "ram":
+                ram = (int(memory.group(2), 16), int(memory.group(3), 16))
+            if line.startswith("Linker script and memory map"):
+                in_map = True
+            continue
+
+        # An input section whose name was too long - its address, size and file are on the next line.
+        if pending:
+            follow = ADDRESS_SIZE.match(line)
+            pending = False
+            if follow and section in KINDS:
+                usage[module_name(follow.group(3))][KINDS[section]] += int(follow.group(2), 16)
+            continue
+
+        output = OUTPUT_SECTION.match(line)
+        if output:
+            section = output.group(1)
+            if section == ".stack" and output.group(3):
+                stack = int(output.group(3), 16)
+            continue
+
+        if section not in KINDS:
+            continue
+        entry = INPUT_SECTION.match(line)
+        if not entry or entry.group(1).startswith("*("):
+            continue
+        if entry.group(3) is None:
+            pending = True
+            continue
+        usage[module_name(entry.group(4))][KINDS[section]] += int(entry.group(3), 16)
+
+    return ram, usage, stack
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Report static RAM use per module from a linker map")
+    parser.add_argument("map")
+    parser.add_argument("--min-free", type=int, default=0, metavar="BYTES",
+                        help="exit with an error if fewer bytes than this are left unallocated")
+    args = parser.parse_args()
+
+    with open(args.map, errors="replace") as f:
+        ram, usage, stack = parse(f)
+    if ram is None:
+        print("No 'ram' region in %s" % args.map)
+        return 1
+
+    print("%-24s %6s %6s %6s %6s" % ("Module", "data", "bss", "noinit", "total"))
+    totals = defaultdict(int)
+    for module, kinds in sorted(usage.items(), key=lambda item: -sum(item[1].values())):
+        print("%-24s %6d %6d %6d %6d" % (module, kinds["data"], kinds["bss"], kinds["noinit"], sum(kinds.values())))
+        for kind, size in kinds.items():
+            totals[kind] += size
+    static = sum(totals.values())
+    print("%-24s %6d %6d %6d %6d" % ("Total", totals["data"], totals["bss"], totals["noinit"], static))
+
+    free = ram[1] - static - stack
+    print()
+    print("RAM %d bytes: %d static, %d stack, %d free" % (ram[1], static, stack, free))
+    if free < args.min_free:
+        print("Less than %d bytes free" % args.min_free)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+#
+# trace_decode.py - decode a binary trace captured from the debug USART with TRACE_CAPTURE enabled.
+#
+#  Author:  David Pye
+#  Contact: davidmpye@gmail.com
+#  Licence: GNU GPL v3 or later
+#
+# Usage:
+#   trace_decode.py capture.bin                 - print every record
+#   trace_decode.py capture.bin --diff ref.bin  - compare state transitions, LED/charge pins and FET
+#                                                 (SYS_CTRL2) writes against a reference capture
+#   trace_decode.py capture.bin --extract-uart DIR
+#                                               - save each buffer received from the vacuum as a file in DIR,
+#                                                 eg to seed host/corpus/serial_parser for the fuzzer
+#
+# See src/trace.h for the record format.
+
+import argparse
+import os
+import struct
+import sys
+
+SYNC = 0xA5
+
+(REC_TIME, REC_I2C_READ, REC_I2C_WRITE, REC_PIN_IN, REC_PIN_OUT, REC_UART_RX, REC_STATE, REC_LOG, REC_DROPPED,
+ REC_IRQ, REC_RESET, REC_EEPROM) = range(1, 13)
+
+STATES = ["BMS_IDLE", "BMS_CHARGER_CONNECTED", "BMS_CHARGING", "BMS_CHARGER_CONNECTED_NOT_CHARGING",
+          "BMS_CHARGER_UNPLUGGED", "BMS_TRIGGER_PULLED", "BMS_DISCHARGING", "BMS_FAULT", "BMS_SLEEP"]
+
+PINS = {0: "LED_BLOCKED", 1: "LED_FILTER", 2: "ENABLE_CHARGE", 4: "TRIGGER", 6: "CHARGER",
+        18: "LED_BAT_HI", 19: "LED_ERR", 24: "LED_BAT_MED", 25: "LED_BAT_LO"}
+
+IRQS = {4: "TRIGGER", 8: "ALERT"}
+
+RESET_CAUSES = {0x01: "POR", 0x02: "BOD12", 0x04: "BOD33", 0x10: "EXTERNAL", 0x20: "WDT", 0x40: "SOFTWARE"}
+
+SYS_CTRL2 = 0x05
+
+
+def records(data):
+    """Yield (time_ms, type, payload) for each record, resyncing on garbage."""
+    i = 0
+    now = 0
+    while i + 5 <= len(data):
+        if data[i] != SYNC:
+            i += 1
+            continue
+        rtype, length, delta = data[i + 1], data[i + 2], data[i + 3] | (data[i + 4] << 8)
+        payload = data[i + 5:i + 5 + length]
+        if len(payload) < length:
+            break
+        if rtype == REC_TIME:
+            now = struct.unpack("<I", payload)[0]
+        else:
+            now += delta
+        yield now, rtype, payload
+        i += 5 + length
+
+
+def describe(rtype, payload):
+    if rtype == REC_TIME:
+        return "TIME"
+    if rtype == REC_I2C_READ:
+        if len(payload) == 1:
+            return "I2C_READ  0x%02X FAILED" % payload[0]
+        return "I2C_READ  0x%02X %s" % (payload[0], payload[1:].hex(" "))
+    if rtype == REC_I2C_WRITE:
+        return "I2C_WRITE 0x%02X 0x%02X" % (payload[0], payload[1])
+    if rtype in (REC_PIN_IN, REC_PIN_OUT):
+        kind = "PIN_IN " if rtype == REC_PIN_IN else "PIN_OUT"
+        return "%s   %s=%d" % (kind, PINS.get(payload[0], "PA%02d" % payload[0]), payload[1])
+    if rtype == REC_UART_RX:
+        return "UART_RX   %s" % payload.hex(" ")
+    if rtype == REC_STATE:
+        name = STATES[payload[0]] if payload[0] < len(STATES) else str(payload[0])
+        return "STATE     %s error %d" % (name, payload[1])
+    if rtype == REC_LOG:
+        return "LOG       %s" % payload.decode("ascii", "replace").rstrip()
+    if rtype == REC_DROPPED:
+        return "DROPPED   %d records" % struct.unpack("<H", payload)[0]
+    if rtype == REC_IRQ:
+        return "IRQ       EXTINT%d %s" % (payload[0], IRQS.get(payload[0], ""))
+    if rtype == REC_RESET:
+        return "RESET     %s" % RESET_CAUSES.get(payload[0], "0x%02X" % payload[0])
+    if rtype == REC_EEPROM:
+        return "EEPROM    page %d %s" % (payload[0], payload[1:].hex(" "))
+    return "UNKNOWN   type %d %s" % (rtype, payload.hex(" "))
+
+
+def outputs(data):
+    """The externally visible behaviour - state changes, output pins and FET control writes."""
+    for now, rtype, payload in records(data):
+        if rtype in (REC_STATE, REC_PIN_OUT) or (rtype == REC_I2C_WRITE and payload[0] == SYS_CTRL2):
+            yield now, describe(rtype, payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a V10 BMS binary trace")
+    parser.add_argument("trace")
+    parser.add_argument("--diff", metavar="REFERENCE", help="compare outputs against a reference trace")
+    parser.add_argument("--extract-uart", metavar="DIR", help="save each buffer received from the vacuum in DIR")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as f:
+        data = f.read()
+
+    if args.extract_uart:
+        os.makedirs(args.extract_uart, exist_ok=True)
+        count = 0
+        for now, rtype, payload in records(data):
+            if rtype == REC_UART_RX:
+                with open(os.path.join(args.extract_uart, "rx_%08d" % now), "wb") as f:
+                    f.write(payload)
+                count += 1
+        print("%d buffers saved" % count)
+        return 0
+
+    if not args.diff:
+        for now, rtype, payload in records(data):
+            print("%10d  %s" % (now, describe(rtype, payload)))
+        return 0
+
+    with open(args.diff, "rb") as f:
+        reference = list(outputs(f.read()))
+    actual = list(outputs(data))
+
+    for n, (ref, act) in enumerate(zip(reference, actual)):
+        if ref[1] != act[1]:
+            print("Outputs diverge at event %d:" % n)
+            print("  reference %10d  %s" % ref)
+            print("  trace     %10d  %s" % act)
+            return 1
+    if len(reference) != len(actual):
+        print("Outputs match for %d events, then reference has %d and trace has %d" %
+              (min(len(reference), len(actual)), len(reference), len(actual)))
+        return 1
+    print("Outputs match (%d events)" % len(actual))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())